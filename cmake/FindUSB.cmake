@@ -41,13 +41,3 @@ int main()
 }
 " LIBUSB_CONST_BUFFERS)
 
-CHECK_C_SOURCE_COMPILES("
-#include <usb.h>
-static void usb_destroy_configuration(struct usb_device *dev) {
-}
-int main()
-{
-    usb_destroy_configuration(NULL);
-    return 0;
-}
-" MISSING_USB_DESTROY_CONFIGURATION)
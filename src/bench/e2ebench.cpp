@@ -0,0 +1,610 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file e2ebench.cpp
+    \brief End-to-end loopback benchmark.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "usbnet.h"
+#include "histogram.h"
+#include "cmdflags.hpp"
+#include "common.h"
+#include "protobase.h"
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <limits.h>
+#include <errno.h>
+
+/* Simulated device without latency and throughput limit,
+ * so only the stack is measured.
+ */
+static const char* SimConfig =
+   "[device]\n"
+   "latency = 0\n"
+   "[endpoint 0x81]\n"
+   "latency = 0\n"
+   "rate = 0\n"
+   "[endpoint 0x02]\n"
+   "latency = 0\n"
+   "rate = 0\n"
+   "[endpoint 0x83]\n"
+   "type = interrupt\n"
+   "interval = 1\n"
+   "latency = 0\n"
+   "rate = 0\n"
+   "[endpoint 0x04]\n"
+   "type = interrupt\n"
+   "interval = 1\n"
+   "latency = 0\n"
+   "rate = 0\n";
+
+/* Bulk transfer sizes. */
+static const int BulkSizes[] = { 64, 512, 4096, 16384, 65536, 262144, 1048576 };
+
+/* Latency of one call. */
+struct Latency
+{
+   const char* name;
+   int errors;
+   histogram_t hist; // ns
+};
+
+/* Throughput of one transfer size. */
+struct Throughput
+{
+   const char* name;
+   int size;
+   int transfers;
+   int errors;
+   double elapsed;
+   double client; // CPU seconds
+   double server;
+};
+
+/* Monotonic time in seconds. */
+static double now()
+{
+   return now_ns() / 1e9;
+}
+
+/* CPU time of this process in seconds. */
+static double client_cpu()
+{
+   rusage ru;
+   getrusage(RUSAGE_SELF, &ru);
+   return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* CPU time of server process in seconds, from /proc. */
+static double server_cpu(pid_t pid)
+{
+   char path[64], buf[1024];
+   snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+   FILE* fp = fopen(path, "r");
+   if(fp == NULL)
+      return 0.0;
+   size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+   fclose(fp);
+   buf[len] = '\0';
+
+   // utime and stime are 14th and 15th field, name may contain spaces
+   unsigned long utime = 0, stime = 0;
+   const char* p = strrchr(buf, ')');
+   if(p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+      return 0.0;
+   return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Directory of this executable. */
+static std::string self_dir()
+{
+   char buf[PATH_MAX];
+   ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+   if(len <= 0)
+      return ".";
+   buf[len] = '\0';
+   std::string path(buf);
+   return path.substr(0, path.rfind('/'));
+}
+
+/* Find tool next to this executable (install or build tree), fall back to name. */
+static std::string find_tool(const char* name, const char* builddir)
+{
+   std::string dir = self_dir();
+   std::string paths[] = { dir + "/" + name, dir + "/../" + builddir + "/" + name, dir + "/../" + name };
+   for(unsigned i = 0; i < 3; ++i) {
+      if(access(paths[i].c_str(), F_OK) == 0)
+         return paths[i];
+   }
+   return name;
+}
+
+/* Wait until server accepts connections. */
+static bool wait_server(int port, pid_t pid, int timeout)
+{
+   sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(port);
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+   double deadline = now() + timeout / 1000.0;
+   while(now() < deadline) {
+      if(waitpid(pid, NULL, WNOHANG) == pid)
+         return false;
+      int fd = socket(AF_INET, SOCK_STREAM, 0);
+      int res = connect(fd, (sockaddr*) &addr, sizeof(addr));
+      close(fd);
+      if(res == 0)
+         return true;
+      usleep(20 * 1000);
+   }
+   return false;
+}
+
+/* Copy stream until either side closes. */
+static void relay_raw(int src, int dst)
+{
+   char buf[65536];
+   ssize_t len = 0;
+   while((len = recv(src, buf, sizeof(buf), 0)) > 0) {
+      if(send(dst, buf, len, MSG_NOSIGNAL) != len)
+         break;
+   }
+}
+
+/* Copy frames, hold back ping responses and everything behind them. */
+static void relay_frames(int src, int dst, int delay)
+{
+   std::vector<char> buf(PACKET_MINSIZE);
+   uint32_t hlen = 0, size = 0;
+   while((hlen = pkt_recv_header(src, &buf[0])) > 0) {
+      unpack_size(&buf[1], &size);
+      if(buf.size() < hlen + size)
+         buf.resize(hlen + size);
+      if(size > 0 && recv_full(src, &buf[hlen], size) == 0)
+         break;
+      if((unsigned char) buf[0] == NullRequest)
+         usleep(delay * 1000);
+      if(send(dst, &buf[0], hlen + size, MSG_NOSIGNAL) != (ssize_t) (hlen + size))
+         break;
+   }
+}
+
+/* Proxy single connection to server, ping responses delayed by given ms.
+ * \return proxy pid, listening port is stored in \c proxy_port
+ */
+static pid_t start_proxy(int port, int delay, int* proxy_port)
+{
+   sockaddr_in addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   socklen_t alen = sizeof(addr);
+   int lfd = socket(AF_INET, SOCK_STREAM, 0);
+   if(bind(lfd, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(lfd, 1) < 0 ||
+      getsockname(lfd, (sockaddr*) &addr, &alen) < 0) {
+      close(lfd);
+      return -1;
+   }
+   *proxy_port = ntohs(addr.sin_port);
+
+   pid_t pid = fork();
+   if(pid != 0) {
+      close(lfd);
+      return pid;
+   }
+
+   // Connect accepted client to server
+   int cfd = accept(lfd, NULL, NULL);
+   int sfd = socket(AF_INET, SOCK_STREAM, 0);
+   addr.sin_port = htons(port);
+   if(cfd < 0 || connect(sfd, (sockaddr*) &addr, sizeof(addr)) < 0)
+      _exit(EXIT_FAILURE);
+
+   // Requests are copied as they are, responses frame by frame
+   if(fork() == 0) {
+      relay_raw(cfd, sfd);
+      shutdown(sfd, SHUT_WR);
+      _exit(EXIT_SUCCESS);
+   }
+   relay_frames(sfd, cfd, delay);
+   shutdown(cfd, SHUT_WR);
+   _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Client side, runs under usbnet with preloaded libusbnet.
+ */
+
+/* Measure call latency, call returns negative on error. */
+template <class Call>
+static void measure(Latency& l, Call call, int count)
+{
+   hist_init(&l.hist);
+   l.errors = 0;
+   for(int i = 0; i < count / 10; ++i)
+      call();
+   for(int i = 0; i < count; ++i) {
+      double start = now();
+      int res = call();
+      hist_record(&l.hist, (uint64_t) ((now() - start) * 1e9));
+      if(res < 0)
+         ++l.errors;
+   }
+}
+
+/* Calls measured for latency. */
+struct FindBusses     { int operator()() { return usb_find_busses(); } };
+struct FindDevices    { int operator()() { return usb_find_devices(); } };
+struct OpenClose {
+   struct usb_device* dev;
+   int operator()() {
+      usb_dev_handle* h = usb_open(dev);
+      return (h != NULL) ? usb_close(h) : -1;
+   }
+};
+struct ClaimRelease {
+   usb_dev_handle* h;
+   int operator()() {
+      int res = usb_claim_interface(h, 0);
+      return (res < 0) ? res : usb_release_interface(h, 0);
+   }
+};
+struct ControlIn {
+   usb_dev_handle* h;
+   int operator()() { char buf[64]; return usb_control_msg(h, 0xc0, 0x01, 0, 0, buf, sizeof(buf), 1000); }
+};
+struct ControlOut {
+   usb_dev_handle* h;
+   int operator()() { char buf[8] = { 0 }; return usb_control_msg(h, 0x40, 0x01, 0, 0, buf, sizeof(buf), 1000); }
+};
+struct ClearHalt {
+   usb_dev_handle* h;
+   int operator()() { return usb_clear_halt(h, 0x81); }
+};
+struct Transfer {
+   usb_dev_handle* h;
+   int ep, size;
+   bool bulk;
+   int operator()() {
+      char buf[64] = { 0 };
+      if(bulk)
+         return (ep & USB_ENDPOINT_IN) ? usb_bulk_read(h, ep, buf, size, 1000)
+                                       : usb_bulk_write(h, ep, buf, size, 1000);
+      return (ep & USB_ENDPOINT_IN) ? usb_interrupt_read(h, ep, buf, size, 1000)
+                                    : usb_interrupt_write(h, ep, buf, size, 1000);
+   }
+};
+
+/* Measure bulk throughput of one transfer size for at least given time. */
+static Throughput throughput(usb_dev_handle* h, int ep, int size, double mintime, pid_t server)
+{
+   Throughput t;
+   t.name = (ep & USB_ENDPOINT_IN) ? "bulk_read" : "bulk_write";
+   t.size = size;
+   t.transfers = t.errors = 0;
+
+   std::vector<char> buf(size, (char) 0xa5);
+   double cpu = client_cpu(), scpu = server_cpu(server);
+   double start = now();
+   do {
+      int res = (ep & USB_ENDPOINT_IN) ? usb_bulk_read(h, ep, &buf[0], size, 1000)
+                                       : usb_bulk_write(h, ep, &buf[0], size, 1000);
+      if(res < 0)
+         ++t.errors;
+      ++t.transfers;
+      t.elapsed = now() - start;
+   } while(t.elapsed < mintime || t.transfers < 4);
+
+   t.client = client_cpu() - cpu;
+   t.server = server_cpu(server) - scpu;
+   return t;
+}
+
+static void print_json(FILE* fp, const std::vector<Latency>& lat, const std::vector<Throughput>& tput)
+{
+   fprintf(fp, "{\n");
+   fprintf(fp, "  \"benchmark\": \"e2ebench\",\n");
+   fprintf(fp, "  \"latency\": [");
+   for(size_t i = 0; i < lat.size(); ++i) {
+      const Latency& l = lat[i];
+      fprintf(fp, "%s\n    { \"name\": \"%s\", \"count\": %llu, \"errors\": %d, \"mean_us\": %.2f, "
+                  "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f }",
+              (i > 0) ? "," : "", l.name, (unsigned long long) l.hist.count, l.errors,
+              hist_mean(&l.hist) / 1e3, hist_percentile(&l.hist, 50) / 1e3,
+              hist_percentile(&l.hist, 90) / 1e3, hist_percentile(&l.hist, 99) / 1e3,
+              l.hist.max / 1e3);
+   }
+   fprintf(fp, "\n  ],\n");
+   fprintf(fp, "  \"throughput\": [");
+   for(size_t i = 0; i < tput.size(); ++i) {
+      const Throughput& t = tput[i];
+      double mb = (double) t.size * (t.transfers - t.errors) / 1e6;
+      fprintf(fp, "%s\n    { \"name\": \"%s\", \"size\": %d, \"transfers\": %d, \"errors\": %d, "
+                  "\"mb_per_s\": %.2f, \"client_cpu_ms_per_mb\": %.3f, \"server_cpu_ms_per_mb\": %.3f }",
+              (i > 0) ? "," : "", t.name, t.size, t.transfers, t.errors,
+              (t.elapsed > 0) ? mb / t.elapsed : 0.0,
+              (mb > 0) ? t.client * 1e3 / mb : 0.0,
+              (mb > 0) ? t.server * 1e3 / mb : 0.0);
+   }
+   fprintf(fp, "\n  ]\n}\n");
+}
+
+/* Open first device. */
+static usb_dev_handle* open_first(struct usb_device** dev)
+{
+   // Measure plain request/response path
+   unsetenv("USBNET_READAHEAD");
+   unsetenv("USBNET_WRITEBEHIND");
+
+   usb_init();
+   usb_find_busses();
+   usb_find_devices();
+   *dev = NULL;
+   if(usb_get_busses() != NULL)
+      *dev = usb_get_busses()->devices;
+   usb_dev_handle* h = NULL;
+   if(*dev == NULL || (h = usb_open(*dev)) == NULL)
+      error_msg("Bench: device not found");
+   return h;
+}
+
+/* Check one bulk write and read of given size, returned data included.
+ * With simulated usbfs, a read timing out first must leave no URBs behind.
+ */
+static int run_verify(int size, bool urbs)
+{
+   struct usb_device* dev = NULL;
+   usb_dev_handle* h = open_first(&dev);
+   if(h == NULL || size <= 0)
+      return EXIT_FAILURE;
+
+   std::vector<char> buf(size, (char) 0x5a);
+   int wres = usb_bulk_write(h, 0x02, &buf[0], size, 10000);
+
+   // Simulated usbfs takes 25 ms per MB, cancels queued URBs on timeout
+   int tres = 0;
+   if(urbs) {
+      tres = usb_bulk_read(h, 0x81, &buf[0], size, 1);
+      printf("bulk_read %d B in 1 ms = %d\n", size, tres);
+   }
+
+   // Missing chunks are left zeroed, device returns 0xa5 or endpoint with usbfs
+   char pattern = urbs ? (char) 0x81 : (char) 0xa5;
+   std::fill(buf.begin(), buf.end(), 0);
+   int rres = usb_bulk_read(h, 0x81, &buf[0], size, 10000);
+   int bad = 0;
+   for(int i = 0; i < rres; ++i) {
+      if(buf[i] != pattern)
+         ++bad;
+   }
+   usb_close(h);
+
+   printf("bulk_write %d B = %d\n", size, wres);
+   printf("bulk_read %d B = %d, %d bytes differ\n", size, rres, bad);
+   return (wres == size && tres != size && rres == size && bad == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int run_client(pid_t server, int count, double mintime, const std::string& output)
+{
+   // First device
+   struct usb_device* dev = NULL;
+   usb_dev_handle* h = open_first(&dev);
+   if(h == NULL)
+      return EXIT_FAILURE;
+
+   // Round-trip latency per call
+   std::vector<Latency> lat(11);
+   FindBusses fb;
+   FindDevices fd;
+   OpenClose oc = { dev };
+   ClaimRelease cr = { h };
+   ControlIn ci = { h };
+   ControlOut co = { h };
+   ClearHalt ch = { h };
+   Transfer br = { h, 0x81, 64, true }, bw = { h, 0x02, 64, true };
+   Transfer ir = { h, 0x83, 8, false }, iw = { h, 0x04, 8, false };
+   lat[0].name  = "find_busses";     measure(lat[0], fb, count);
+   lat[1].name  = "find_devices";    measure(lat[1], fd, count);
+   lat[2].name  = "open_close";      measure(lat[2], oc, count);
+   lat[3].name  = "claim_release";   measure(lat[3], cr, count);
+   usb_claim_interface(h, 0);
+   lat[4].name  = "control_in";      measure(lat[4], ci, count);
+   lat[5].name  = "control_out";     measure(lat[5], co, count);
+   lat[6].name  = "clear_halt";      measure(lat[6], ch, count);
+   lat[7].name  = "bulk_read";       measure(lat[7], br, count);
+   lat[8].name  = "bulk_write";      measure(lat[8], bw, count);
+   lat[9].name  = "interrupt_read";  measure(lat[9], ir, count);
+   lat[10].name = "interrupt_write"; measure(lat[10], iw, count);
+
+   // Bulk throughput and CPU cost
+   std::vector<Throughput> tput;
+   for(unsigned i = 0; i < sizeof(BulkSizes) / sizeof(int); ++i)
+      tput.push_back(throughput(h, 0x02, BulkSizes[i], mintime, server));
+   for(unsigned i = 0; i < sizeof(BulkSizes) / sizeof(int); ++i)
+      tput.push_back(throughput(h, 0x81, BulkSizes[i], mintime, server));
+
+   usb_release_interface(h, 0);
+   usb_close(h);
+
+   // Report
+   FILE* fp = stdout;
+   if(!output.empty() && (fp = fopen(output.c_str(), "w")) == NULL) {
+      error_msg("Bench: failed to open '%s'", output.c_str());
+      return EXIT_FAILURE;
+   }
+   print_json(fp, lat, tput);
+   if(fp != stdout)
+      fclose(fp);
+
+   return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[])
+{
+   // Command line options
+   std::string server = find_tool("usbexportd", "server");
+   std::string client = find_tool("usbnet", "client");
+   std::string lib = find_tool("libusbnet.so", "lib");
+   std::string engine("auto"), config, output, window("4194304"), usbfs("kernel");
+   int port = 22230, count = 2000, mintime = 500, verify = 0, delay = 0;
+   pid_t worker = 0;
+
+   // Parse command line arguments
+   CmdFlags cmd(argc, argv);
+   cmd.add('S', "server",   "Server executable.", server.c_str())
+      .add('C', "client",   "Client executable.", client.c_str())
+      .add('l', "library",  "Preloaded library.", lib.c_str())
+      .add('p', "port",     "Server port on loopback.", "22230")
+      .add('e', "engine",   "Server event engine.", "auto")
+      .add('W', "chunk-window", "Server chunk window in bytes.", "4194304")
+      .add('u', "usbfs",    "Server bulk transfer backend (kernel, sim).", "kernel")
+      .add('m', "sim-config", "Simulated devices configuration, zero latency device by default.")
+      .add('n', "count",    "Calls per latency measurement.", "2000")
+      .add('t', "time",     "Minimum time per transfer size in ms.", "500")
+      .add('o', "output",   "Write JSON results to file instead of stdout.")
+      .add('x', "verify",   "Only check bulk write and read of given size, for tests.")
+      .add('d', "ping-delay", "Delay ping responses by given ms through proxy, for tests.")
+      .add('w', "worker",   "Run client side against server pid (internal).")
+      .add('?', "help",     "Print help",   "", false);
+
+   cmd.setUsage("Usage: usbnet-e2ebench [options]");
+
+   CmdFlags::Match m = cmd.getopt();
+   while(m.first >= 0) {
+
+      // Evaluate
+      switch(m.first) {
+      case 'S': server  = m.second; break;
+      case 'C': client  = m.second; break;
+      case 'l': lib     = m.second; break;
+      case 'p': port    = atoi(m.second.c_str()); break;
+      case 'e': engine  = m.second; break;
+      case 'W': window  = m.second; break;
+      case 'u': usbfs   = m.second; break;
+      case 'm': config  = m.second; break;
+      case 'n': count   = atoi(m.second.c_str()); break;
+      case 't': mintime = atoi(m.second.c_str()); break;
+      case 'o': output  = m.second; break;
+      case 'x': verify  = atoi(m.second.c_str()); break;
+      case 'd': delay   = atoi(m.second.c_str()); break;
+      case 'w': worker  = atoi(m.second.c_str()); break;
+      case '?':
+         cmd.printHelp();
+         return EXIT_SUCCESS;
+         break;
+      default:
+         break;
+      }
+
+      // Next option
+      m = cmd.getopt();
+   }
+
+   // Client side
+   if(worker > 0 && verify > 0)
+      return run_verify(verify, usbfs == "sim");
+   if(worker > 0)
+      return run_client(worker, count, mintime / 1000.0, output);
+
+   // Zero latency device
+   char tmpconf[] = "/tmp/usbnet-e2ebench-XXXXXX";
+   if(config.empty()) {
+      int fd = mkstemp(tmpconf);
+      if(fd < 0 || write(fd, SimConfig, strlen(SimConfig)) < 0) {
+         error_msg("Bench: failed to write simulator configuration");
+         return EXIT_FAILURE;
+      }
+      close(fd);
+      config = tmpconf;
+   }
+
+   // Start server with simulated devices
+   char portstr[16];
+   snprintf(portstr, sizeof(portstr), "%d", port);
+   pid_t spid = fork();
+   if(spid == 0) {
+      execl(server.c_str(), "usbexportd", "-q", "-l", "-p", portstr, "-e", engine.c_str(),
+            "-W", window.c_str(), "-u", usbfs.c_str(), "-b", "sim", "-m", config.c_str(), (char*) NULL);
+      error_msg("Bench: failed to execute '%s': %s", server.c_str(), strerror(errno));
+      _exit(EXIT_FAILURE);
+   }
+
+   int ret = EXIT_FAILURE;
+   pid_t ppid = 0;
+   if(spid > 0 && wait_server(port, spid, 5000)) {
+
+      // Client connects through proxy
+      int cport = port;
+      if(delay > 0 && (ppid = start_proxy(port, delay, &cport)) < 0) {
+         error_msg("Bench: failed to start proxy");
+         cport = 0;
+      }
+
+      // Run client side under usbnet
+      char args[128];
+      snprintf(args, sizeof(args), " -w %d -n %d -t %d -x %d -u %s", (int) spid, count, mintime, verify,
+               usbfs.c_str());
+      std::string exec = "\"" + self_dir() + "/usbnet-e2ebench\"" + args;
+      if(!output.empty())
+         exec += " -o \"" + output + "\"";
+      snprintf(args, sizeof(args), "127.0.0.1:%d", cport);
+
+      pid_t cpid = (cport > 0) ? fork() : -1;
+      if(cpid == 0) {
+         execl(client.c_str(), "usbnet", "-q", "-h", args, "-l", lib.c_str(), exec.c_str(), (char*) NULL);
+         error_msg("Bench: failed to execute '%s': %s", client.c_str(), strerror(errno));
+         _exit(EXIT_FAILURE);
+      }
+
+      int status = 0;
+      if(cpid > 0 && waitpid(cpid, &status, 0) == cpid && WIFEXITED(status))
+         ret = WEXITSTATUS(status);
+   }
+   else {
+      error_msg("Bench: server '%s' is not listening on port %d", server.c_str(), port);
+   }
+
+   // Stop proxy and server
+   if(ppid > 0) {
+      kill(ppid, SIGTERM);
+      waitpid(ppid, NULL, 0);
+   }
+   if(spid > 0) {
+      kill(spid, SIGTERM);
+      waitpid(spid, NULL, 0);
+   }
+   if(config == tmpconf)
+      unlink(tmpconf);
+
+   return ret;
+}
+/** @} */
@@ -0,0 +1,596 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file protobench.cpp
+    \brief Protocol encode/decode microbenchmark.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "protocol.hpp"
+#include "usbnet.h"
+#include "cmdflags.hpp"
+#include "common.h"
+extern "C" {
+#include "protocol.h"
+}
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* Devices in enumeration tree and devices per bus. */
+static const int TreeDevices = 500;
+static const int TreeBusDevices = 50;
+
+/* Bulk payload sizes. */
+static const int BulkSizes[] = { 8, 64, 512, 4096, 65536, 1048576 };
+
+/* Benchmark operation, runs ops operations and returns bytes processed. */
+typedef uint64_t (*RunFn)(int size, long long ops);
+
+/* Benchmark case. */
+struct Case
+{
+   std::string name;
+   RunFn run;
+   int size;
+};
+
+/* Benchmark result. */
+struct Result
+{
+   std::string name;
+   long long ops;
+   double ns;    // Best ns per operation
+   double bytes; // Bytes per operation
+};
+
+/* Result sink, keeps compiler from dropping the work. */
+static volatile uint32_t sSink = 0;
+
+/* Time spent in measured sections, -1 if whole run is measured. */
+static double sTimed = -1.0;
+
+/* Cost of one measured section boundary pair in seconds. */
+static double sClockCost = 0.0;
+
+/* Monotonic time in seconds. */
+static double now()
+{
+   return now_ns() / 1e9;
+}
+
+/* Payload data of given size. */
+static const char* payload(int size)
+{
+   static std::vector<char> buf;
+   if((int) buf.size() < size)
+      buf.resize(size, (char) 0xa5);
+   return &buf[0];
+}
+
+/* Encode control transfer request, as the client does. */
+static void encode_control(Packet* pkt, const char* data)
+{
+   pkt_init(pkt, UsbControlMsg);
+   pkt_addint(pkt, (int) 65536);
+   pkt_addint(pkt, (int) 0x40);
+   pkt_addint(pkt, (int) 0x01);
+   pkt_addint(pkt, (int) 0x0100);
+   pkt_addint(pkt, (int) 0);
+   pkt_addstr(pkt, 8, data);
+   pkt_addint(pkt, (int) 1000);
+}
+
+/* Encode bulk write request, as the client does. */
+static void encode_bulk(Packet* pkt, const char* data, int size)
+{
+   pkt_init(pkt, UsbBulkWrite);
+   pkt_addint(pkt, (int) 65536);
+   pkt_addint(pkt, (int) 0x02);
+   pkt_addstr(pkt, size, data);
+   pkt_addint(pkt, (int) 1000);
+}
+
+/* Encode enumeration response, as the server does.
+ * Device blocks are encoded standalone, then appended to bus blocks.
+ */
+static void encode_tree(Proto::Packet& pkt)
+{
+   // Device descriptors, one interface with three endpoints
+   struct usb_device_descriptor dev_d;
+   memset(&dev_d, 0, sizeof(dev_d));
+   dev_d.bLength = USB_DT_DEVICE_SIZE;
+   dev_d.bDescriptorType = USB_DT_DEVICE;
+   dev_d.idVendor = htons(0x1234);
+   dev_d.bNumConfigurations = 1;
+   struct usb_config_descriptor cfg_d;
+   memset(&cfg_d, 0, sizeof(cfg_d));
+   cfg_d.bNumInterfaces = 1;
+   struct usb_interface_descriptor alt_d;
+   memset(&alt_d, 0, sizeof(alt_d));
+   alt_d.bNumEndpoints = 3;
+   struct usb_endpoint_descriptor ep_d;
+   memset(&ep_d, 0, sizeof(ep_d));
+
+   pkt.addInt32(TreeDevices);
+   Proto::ByteBuffer dev;
+   char name[16];
+   for(int b = 0; b < TreeDevices / TreeBusDevices; ++b) {
+      Proto::Struct bus = pkt.writeBlock(StructureType);
+      snprintf(name, sizeof(name), "%03d", b + 1);
+      bus.addString(name);
+      bus.addUInt32(b + 1);
+      for(int d = 0; d < TreeBusDevices; ++d) {
+         dev.clear();
+         Proto::Struct top(dev, 0);
+         Proto::Struct blk = top.writeBlock(SequenceType);
+         snprintf(name, sizeof(name), "%03d", d + 1);
+         blk.addString(name);
+         blk.addUInt8(d + 1);
+         blk.addData((const char*) &dev_d, sizeof(dev_d));
+         blk.addData((const char*) &cfg_d, sizeof(cfg_d));
+         blk.addInt32(1);
+         blk.addData((const char*) &alt_d, sizeof(alt_d));
+         for(int e = 0; e < alt_d.bNumEndpoints; ++e)
+            blk.addData((const char*) &ep_d, sizeof(ep_d));
+         blk.addInt32(0);
+         blk.finalize();
+         bus.append(dev.data(), dev.size());
+      }
+      bus.finalize();
+   }
+   pkt.finalize();
+}
+
+/* Load C packet from encoded C++ frame. */
+static void load_frame(Packet* pkt, Proto::Packet& src)
+{
+   uint32_t size = 0;
+   int len = unpack_size(src.data() + 1, &size);
+   pkt_init(pkt, src.op());
+   pkt_reserve(pkt, size);
+   memcpy(pkt->buf, src.data() + 1 + len, size);
+   pkt->size = size;
+}
+
+/* Frame header length for given payload. */
+static int header_size(uint32_t size)
+{
+   char buf[8];
+   return 1 + pack_size(size, buf);
+}
+
+/*
+ * C API.
+ */
+
+static uint64_t c_pack_size(int, long long ops)
+{
+   static const uint32_t vals[] = { 0x12, 0x7f, 0x1234, 0x12345, 0x1234567 };
+   char buf[8];
+   uint64_t bytes = 0;
+   for(long long i = 0; i < ops; ++i)
+      bytes += pack_size(vals[i % 5], buf);
+   sSink += buf[1];
+   return bytes;
+}
+
+static uint64_t c_unpack_size(int, long long ops)
+{
+   char bufs[5][8];
+   static const uint32_t vals[] = { 0x12, 0x7f, 0x1234, 0x12345, 0x1234567 };
+   for(int i = 0; i < 5; ++i)
+      pack_size(vals[i], bufs[i]);
+
+   uint64_t bytes = 0;
+   uint32_t val = 0;
+   for(long long i = 0; i < ops; ++i) {
+      bytes += unpack_size(bufs[i % 5], &val);
+      sSink += val;
+   }
+   return bytes;
+}
+
+static uint64_t c_addnumeric(int, long long ops)
+{
+   Packet* pkt = pkt_new(4096, UsbControlMsg);
+   uint64_t bytes = 0;
+   for(long long i = 0; i < ops; ++i) {
+      if((i & 255) == 0) {
+         bytes += pkt->size;
+         pkt_init(pkt, UsbControlMsg);
+      }
+      pkt_addnumeric(pkt, IntegerType, sizeof(int32_t), i);
+   }
+   bytes += pkt->size;
+   pkt_free(pkt);
+   return bytes;
+}
+
+static uint64_t c_control_encode(int, long long ops)
+{
+   Packet* pkt = pkt_new(64, UsbControlMsg);
+   const char* data = payload(8);
+   for(long long i = 0; i < ops; ++i)
+      encode_control(pkt, data);
+   uint64_t bytes = (header_size(pkt->size) + pkt->size) * ops;
+   pkt_free(pkt);
+   return bytes;
+}
+
+static uint64_t c_control_decode(int, long long ops)
+{
+   Packet* pkt = pkt_new(64, UsbControlMsg);
+   encode_control(pkt, payload(8));
+   Iterator it;
+   for(long long i = 0; i < ops; ++i) {
+      pkt_begin(pkt, &it);
+      sSink += iter_getint(&it);
+      sSink += iter_getint(&it);
+      sSink += iter_getint(&it);
+      sSink += iter_getint(&it);
+      sSink += iter_getint(&it);
+      sSink += *((const char*) iter_nextval(&it));
+      sSink += iter_getint(&it);
+   }
+   uint64_t bytes = (header_size(pkt->size) + pkt->size) * ops;
+   pkt_free(pkt);
+   return bytes;
+}
+
+static uint64_t c_bulk_append(int size, long long ops)
+{
+   Packet* pkt = pkt_new(size + 64, UsbBulkWrite);
+   const char* data = payload(size);
+   for(long long i = 0; i < ops; ++i)
+      encode_bulk(pkt, data, size);
+   uint64_t bytes = (header_size(pkt->size) + pkt->size) * ops;
+   pkt_free(pkt);
+   return bytes;
+}
+
+static uint64_t c_bulk_iter(int size, long long ops)
+{
+   Packet* pkt = pkt_new(size + 64, UsbBulkWrite);
+   encode_bulk(pkt, payload(size), size);
+   Iterator it;
+   for(long long i = 0; i < ops; ++i) {
+      pkt_begin(pkt, &it);
+      while(!iter_end(&it)) {
+         sSink += it.len;
+         iter_next(&it);
+      }
+   }
+   uint64_t bytes = (header_size(pkt->size) + pkt->size) * ops;
+   pkt_free(pkt);
+   return bytes;
+}
+
+static uint64_t c_devices_decode(int, long long ops)
+{
+   Proto::Packet src(UsbFindDevices);
+   encode_tree(src);
+   Packet* pkt = pkt_new(64, UsbFindDevices);
+   load_frame(pkt, src);
+
+   // Walk whole tree, entering busses and devices
+   Iterator it;
+   for(long long i = 0; i < ops; ++i) {
+      pkt_begin(pkt, &it);
+      while(!iter_end(&it)) {
+         if(it.type == StructureType || it.type == SequenceType)
+            iter_enter(&it);
+         else {
+            sSink += it.len;
+            iter_next(&it);
+         }
+      }
+   }
+   uint64_t bytes = (uint64_t) src.size() * ops;
+   pkt_free(pkt);
+   return bytes;
+}
+
+/*
+ * C++ API.
+ */
+
+static uint64_t cpp_addnumeric(int, long long ops)
+{
+   // New packet every 256 values
+   uint64_t bytes = 0;
+   for(long long i = 0; i < ops; ) {
+      Proto::Packet pkt(UsbControlMsg);
+      for(int n = 0; n < 256 && i < ops; ++n, ++i)
+         pkt.addNumeric(IntegerType, sizeof(int32_t), i);
+      bytes += pkt.size() - 1;
+   }
+   return bytes;
+}
+
+static uint64_t cpp_control_encode(int, long long ops)
+{
+   const char* data = payload(8);
+   uint64_t bytes = 0;
+   for(long long i = 0; i < ops; ++i) {
+      Proto::Packet pkt(UsbControlMsg);
+      pkt.addInt32(65536);
+      pkt.addInt32(0x40);
+      pkt.addInt32(0x01);
+      pkt.addInt32(0x0100);
+      pkt.addInt32(0);
+      pkt.addData(data, 8, OctetType);
+      pkt.addInt32(1000);
+      pkt.finalize();
+      bytes += pkt.size();
+   }
+   return bytes;
+}
+
+static uint64_t cpp_control_decode(int, long long ops)
+{
+   Proto::Packet pkt(UsbControlMsg);
+   pkt.addInt32(65536);
+   pkt.addInt32(0x40);
+   pkt.addInt32(0x01);
+   pkt.addInt32(0x0100);
+   pkt.addInt32(0);
+   pkt.addData(payload(8), 8, OctetType);
+   pkt.addInt32(1000);
+   pkt.finalize();
+   for(long long i = 0; i < ops; ++i) {
+      Proto::Iterator it(pkt);
+      sSink += it.getInt();
+      sSink += it.getInt();
+      sSink += it.getInt();
+      sSink += it.getInt();
+      sSink += it.getInt();
+      sSink += *it.getByteArray();
+      sSink += it.getInt();
+   }
+   return (uint64_t) pkt.size() * ops;
+}
+
+static uint64_t cpp_bulk_encode(int size, long long ops)
+{
+   const char* data = payload(size);
+   uint64_t bytes = 0;
+   for(long long i = 0; i < ops; ++i) {
+      Proto::Packet pkt(UsbBulkWrite);
+      pkt.addInt32(65536);
+      pkt.addInt32(0x02);
+      pkt.addData(data, size, OctetType);
+      pkt.addInt32(1000);
+      pkt.finalize();
+      bytes += pkt.size();
+   }
+   return bytes;
+}
+
+static uint64_t cpp_bulk_iter(int size, long long ops)
+{
+   Proto::Packet pkt(UsbBulkWrite);
+   pkt.addInt32(65536);
+   pkt.addInt32(0x02);
+   pkt.addData(payload(size), size, OctetType);
+   pkt.addInt32(1000);
+   pkt.finalize();
+   for(long long i = 0; i < ops; ++i) {
+      Proto::Iterator it(pkt);
+      while(it.type() != InvalidType) {
+         sSink += it.length();
+         it.next();
+      }
+   }
+   return (uint64_t) pkt.size() * ops;
+}
+
+static uint64_t cpp_finalize(int size, long long ops)
+{
+   // Unfinalized frame, only finalize() is measured
+   Proto::Packet src(UsbBulkWrite);
+   src.addInt32(65536);
+   src.addInt32(0x02);
+   src.addData(payload(size), size, OctetType);
+   src.addInt32(1000);
+   Proto::Packet pkt;
+   uint64_t bytes = 0;
+   sTimed = 0.0;
+   for(long long i = 0; i < ops; ++i) {
+      pkt.assign(src.data(), src.size());
+      double start = now();
+      pkt.finalize();
+      sTimed += now() - start - sClockCost;
+      bytes += pkt.size();
+   }
+   return bytes;
+}
+
+static uint64_t cpp_devices_encode(int, long long ops)
+{
+   uint64_t bytes = 0;
+   for(long long i = 0; i < ops; ++i) {
+      Proto::Packet pkt(UsbFindDevices);
+      encode_tree(pkt);
+      bytes += pkt.size();
+   }
+   return bytes;
+}
+
+/* Measure case, each round runs for at least given time. */
+static Result measure(const Case& c, double mintime, int rounds)
+{
+   Result r;
+   r.name = c.name;
+   r.ops = 0;
+   r.ns = 0.0;
+   r.bytes = 0.0;
+
+   long long ops = 1;
+   for(int round = 0; round < rounds; ) {
+      sTimed = -1.0;
+      double start = now();
+      uint64_t bytes = c.run(c.size, ops);
+      double elapsed = (sTimed >= 0.0) ? sTimed : now() - start;
+
+      // Scale up until round is long enough
+      if(elapsed < mintime) {
+         double scale = (elapsed > 0.0) ? mintime / elapsed * 1.2 : 100.0;
+         if(scale > 100.0)
+            scale = 100.0;
+         ops = (long long) (ops * scale) + 1;
+         continue;
+      }
+
+      // Keep best round
+      double ns = elapsed * 1e9 / ops;
+      if(r.ops == 0 || ns < r.ns) {
+         r.ns = ns;
+         r.ops = ops;
+         r.bytes = (double) bytes / ops;
+      }
+      ++round;
+   }
+
+   return r;
+}
+
+/* Calibrate measured section boundaries. */
+static void calibrate()
+{
+   const int count = 100000;
+   double start = now();
+   for(int i = 0; i < count; ++i)
+      sSink += (uint32_t) now();
+   sClockCost = (now() - start) / count;
+}
+
+static void print_json(FILE* fp, const std::vector<Result>& results, double mintime, int rounds)
+{
+   fprintf(fp, "{\n");
+   fprintf(fp, "  \"benchmark\": \"protobench\",\n");
+   fprintf(fp, "  \"min_time_ms\": %.0f,\n", mintime * 1000);
+   fprintf(fp, "  \"rounds\": %d,\n", rounds);
+   fprintf(fp, "  \"results\": [");
+   for(size_t i = 0; i < results.size(); ++i) {
+      const Result& r = results[i];
+      double rate = (r.ns > 0.0) ? r.bytes / r.ns * 1e3 : 0.0;
+      fprintf(fp, "%s\n    { \"name\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.3f, "
+                  "\"bytes_per_op\": %.1f, \"mb_per_s\": %.1f }",
+              (i > 0) ? "," : "", r.name.c_str(), r.ops, r.ns, r.bytes, rate);
+   }
+   fprintf(fp, "\n  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+   // Command line options
+   std::string filter, output;
+   double mintime = 0.2;
+   int rounds = 3;
+
+   // Parse command line arguments
+   CmdFlags cmd(argc, argv);
+   cmd.add('t', "time",   "Minimum round time in ms.", "200")
+      .add('r', "rounds", "Rounds per case, best is reported.", "3")
+      .add('f', "filter", "Run only cases containing given string.")
+      .add('o', "output", "Write JSON results to file instead of stdout.")
+      .add('?', "help",   "Print help",   "", false);
+
+   cmd.setUsage("Usage: usbnet-protobench [options]");
+
+   CmdFlags::Match m = cmd.getopt();
+   while(m.first >= 0) {
+
+      // Evaluate
+      switch(m.first) {
+      case 't': mintime = atoi(m.second.c_str()) / 1000.0; break;
+      case 'r': rounds = atoi(m.second.c_str()); break;
+      case 'f': filter = m.second; break;
+      case 'o': output = m.second; break;
+      case '?':
+         cmd.printHelp();
+         return EXIT_SUCCESS;
+         break;
+      default:
+         break;
+      }
+
+      // Next option
+      m = cmd.getopt();
+   }
+
+   if(rounds < 1)
+      rounds = 1;
+
+   // Cases
+   std::vector<Case> cases;
+   Case fixed[] = {
+      { "c/pack_size",          c_pack_size,         0 },
+      { "c/unpack_size",        c_unpack_size,       0 },
+      { "c/addnumeric",         c_addnumeric,        0 },
+      { "c/control_encode",     c_control_encode,    0 },
+      { "c/control_decode",     c_control_decode,    0 },
+      { "c/devices_decode",     c_devices_decode,    0 },
+      { "c++/addnumeric",       cpp_addnumeric,      0 },
+      { "c++/control_encode",   cpp_control_encode,  0 },
+      { "c++/control_decode",   cpp_control_decode,  0 },
+      { "c++/devices_encode",   cpp_devices_encode,  0 },
+   };
+   cases.assign(fixed, fixed + sizeof(fixed) / sizeof(Case));
+   struct { const char* name; RunFn run; } bulk[] = {
+      { "c/bulk_append",   c_bulk_append },
+      { "c/bulk_iter",     c_bulk_iter },
+      { "c++/bulk_encode", cpp_bulk_encode },
+      { "c++/bulk_iter",   cpp_bulk_iter },
+      { "c++/finalize",    cpp_finalize },
+   };
+   for(unsigned i = 0; i < sizeof(bulk) / sizeof(bulk[0]); ++i) {
+      for(unsigned j = 0; j < sizeof(BulkSizes) / sizeof(int); ++j) {
+         char name[64];
+         snprintf(name, sizeof(name), "%s/%d", bulk[i].name, BulkSizes[j]);
+         Case c = { name, bulk[i].run, BulkSizes[j] };
+         cases.push_back(c);
+      }
+   }
+
+   // Run
+   calibrate();
+   std::vector<Result> results;
+   for(size_t i = 0; i < cases.size(); ++i) {
+      if(cases[i].name.find(filter) == std::string::npos)
+         continue;
+      results.push_back(measure(cases[i], mintime, rounds));
+   }
+
+   // Report
+   FILE* fp = stdout;
+   if(!output.empty() && (fp = fopen(output.c_str(), "w")) == NULL) {
+      error_msg("Failed to open '%s'", output.c_str());
+      return EXIT_FAILURE;
+   }
+   print_json(fp, results, mintime, rounds);
+   if(fp != stdout)
+      fclose(fp);
+
+   return EXIT_SUCCESS;
+}
+/** @} */
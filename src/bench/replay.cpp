@@ -0,0 +1,384 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file replay.cpp
+    \brief Recorded session replay.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "protocol.hpp"
+#include "socket.hpp"
+#include "usbnet.h"
+#include "sessionrec.h"
+#include "histogram.h"
+#include "cmdflags.hpp"
+#include "common.h"
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <map>
+#include <errno.h>
+using namespace Proto;
+
+/* Opcodes counted apart. */
+static const int Opcodes = 32;
+
+/* Recorded request. */
+struct Request
+{
+   long long time;   // Send time (us since recording start)
+   uint8_t op;       // Opcode
+   ByteBuffer frame; // Encoded frame
+   int devpos;       // Device handle position in frame, -1 if none
+   bool reply;       // Response with same opcode expected
+   int devfd;        // Handle opened by UsbOpen, -1 otherwise
+};
+
+/* Per-opcode result. */
+struct OpStats
+{
+   uint64_t count;
+   uint64_t errors;
+   uint64_t bytesOut;
+   uint64_t bytesIn;
+   histogram_t latency; // Request to response (us)
+};
+
+/* Replayed copy of the session. */
+struct Copy
+{
+   pthread_t thread;
+   const std::vector<Request>* requests;
+   std::string host;
+   int port;
+   double speed;        // Time scale, 0 replays as fast as possible
+   OpStats ops[Opcodes];
+   double elapsed;
+   bool failed;
+};
+
+/* Load recorded requests, pair them with responses. */
+static bool load(const char* path, std::vector<Request>& requests)
+{
+   FILE* fp = fopen(path, "rb");
+   if(fp == NULL) {
+      error_msg("Replay: can't open '%s': %s", path, strerror(errno));
+      return false;
+   }
+
+   char magic[8];
+   if(fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, SREC_MAGIC, sizeof(magic)) != 0) {
+      error_msg("Replay: '%s' is not a session recording", path);
+      fclose(fp);
+      return false;
+   }
+
+   srec_entry_t e;
+   std::vector<char> payload;
+   while(fread(&e, sizeof(e), 1, fp) == 1) {
+      payload.resize(e.size + 1);
+      if(e.size > 0 && fread(&payload[0], e.size, 1, fp) != 1)
+         break;
+
+      // Response to the last request, other responses are server pushes
+      if(e.dir == SRecResponse) {
+         if(requests.empty())
+            continue;
+         Request& req = requests.back();
+         if(req.reply || req.op != e.op)
+            continue;
+         req.reply = true;
+
+         // Remember opened handle to remap later requests
+         if(req.op == UsbOpen) {
+            Packet res(e.op);
+            res.append(&payload[0], e.size);
+            res.finalize();
+            Iterator it(res);
+            if(it.getInt() >= 0 && it.type() == IntegerType)
+               req.devfd = it.getInt();
+         }
+         continue;
+      }
+
+      // Encode request
+      Packet pkt(e.op);
+      if(e.size > 0)
+         pkt.append(&payload[0], e.size);
+      requests.push_back(Request());
+      Request& req = requests.back();
+      req.time = e.time;
+      req.op = e.op;
+      req.reply = false;
+      req.devfd = -1;
+      pkt.take(req.frame);
+
+      // Device requests begin with 32bit handle
+      req.devpos = -1;
+      if(e.size >= 2 && payload[0] == IntegerType) {
+         uint32_t len = 0;
+         int n = unpack_size(&payload[1], &len);
+         if(len == sizeof(int32_t) && 1 + n + len <= e.size)
+            req.devpos = req.frame.size() - e.size + 1 + n;
+      }
+   }
+
+   fclose(fp);
+   return true;
+}
+
+/* Send whole frame. */
+static bool send_frame(int fd, const ByteBuffer& frame)
+{
+   size_t sent = 0;
+   while(sent < frame.size()) {
+      ssize_t len = ::send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+      if(len < 0) {
+         if(errno == EINTR)
+            continue;
+         return false;
+      }
+      sent += len;
+   }
+   return true;
+}
+
+/* Replay session on own connection. */
+static void* replay(void* arg)
+{
+   Copy* c = (Copy*) arg;
+   c->failed = true;
+
+   Socket sock;
+   if(sock.connect(c->host, c->port) != Socket::Ok) {
+      error_msg("Replay: connection to %s:%d failed", c->host.c_str(), c->port);
+      return NULL;
+   }
+
+   // Same socket setup as the wrapper, bounded wait for responses
+   int flag = 1;
+   setsockopt(sock.sock(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+   timeval tv = { 10, 0 };
+   setsockopt(sock.sock(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+   const std::vector<Request>& requests = *c->requests;
+   std::map<int, int> handles; // Recorded handle -> replayed handle
+   long long origin = requests.empty() ? 0 : requests.front().time;
+   long long start = now_us();
+   bool ok = true;
+   for(size_t i = 0; ok && i < requests.size(); ++i) {
+      const Request& req = requests[i];
+
+      // Keep recorded pace
+      if(c->speed > 0) {
+         long long due = start + (long long) ((req.time - origin) / c->speed);
+         sleep_us(due - now_us());
+      }
+
+      // Remap device handle
+      ByteBuffer frame(req.frame);
+      if(req.devpos >= 0) {
+         int32_t val;
+         memcpy(&val, frame.data() + req.devpos, sizeof(val));
+         std::map<int, int>::iterator h = handles.find((int32_t) ntohl(val));
+         if(h != handles.end()) {
+            val = htonl(h->second);
+            memcpy(&frame[req.devpos], &val, sizeof(val));
+         }
+      }
+
+      OpStats& s = c->ops[(req.op - CallType) % Opcodes];
+      long long sent = now_us();
+      if(!send_frame(sock.sock(), frame)) {
+         error_msg("Replay: connection lost");
+         break;
+      }
+      ++s.count;
+      s.bytesOut += frame.size();
+      if(!req.reply)
+         continue;
+
+      // Wait for response, server pushes are skipped
+      Packet res;
+      for(;;) {
+         if(res.recv(sock.sock()) < 0) {
+            error_msg("Replay: no response to %s", call_name(req.op));
+            ok = false;
+            break;
+         }
+         s.bytesIn += res.size();
+         if(res.op() == req.op)
+            break;
+      }
+      if(!ok)
+         break;
+      hist_record(&s.latency, now_us() - sent);
+
+      // Negative result code
+      Iterator it(res);
+      int result = (it.type() == IntegerType) ? it.getInt() : 0;
+      if(result < 0)
+         ++s.errors;
+
+      // Map opened handle
+      if(req.op == UsbOpen && req.devfd >= 0 && result >= 0 && it.type() == IntegerType)
+         handles[req.devfd] = it.getInt();
+   }
+
+   c->elapsed = (now_us() - start) / 1e6;
+   c->failed = !ok;
+   sock.close();
+   return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+   // Command line options
+   std::string host("localhost"), path;
+   int port = 22222, copies = 1;
+   double speed = 1.0;
+
+   // Parse command line arguments
+   CmdFlags cmd(argc, argv);
+   cmd.add('h', "host",   "Target server host:[port]", "localhost:22222")
+      .add('s', "speed",  "Replay speed, 1 keeps recorded timing, 0 as fast as possible.", "1")
+      .add('n', "copies", "Sessions replayed in parallel.", "1")
+      .add('q', "quiet",  "Quiet output", "", false)
+      .add('?', "help",   "Print help",   "", false);
+
+   cmd.setUsage("Usage: usbnet-replay [options] <recording>\n"
+                "Recording is made with USBNET_RECORD=<file> usbnet ...");
+
+   CmdFlags::Match m = cmd.getopt();
+   while(m.first >= 0) {
+
+      // Evaluate
+      switch(m.first) {
+      case 'h': {
+         host = m.second;
+         size_t pos = host.find(':');
+         if(pos != std::string::npos) {
+            port = atoi(host.substr(pos + 1).c_str());
+            host.erase(pos);
+         }
+      }
+         break;
+      case 's': speed  = atof(m.second.c_str()); break;
+      case 'n': copies = atoi(m.second.c_str()); break;
+      case 'q': log_setlevel(MsgError); break;
+      case '?':
+         cmd.printHelp();
+         return EXIT_SUCCESS;
+         break;
+      case  0 :
+         path = m.second;
+         break;
+      default:
+         break;
+      }
+
+      // Next option
+      m = cmd.getopt();
+   }
+
+   if(path.empty() || copies < 1) {
+      cmd.printHelp();
+      return EXIT_FAILURE;
+   }
+
+   // Load recording
+   std::vector<Request> requests;
+   if(!load(path.c_str(), requests))
+      return EXIT_FAILURE;
+   long long span = requests.empty() ? 0 : requests.back().time - requests.front().time;
+   log_msg("Replay: %d requests recorded over %.3f s", (int) requests.size(), span / 1e6);
+
+   // Replay copies in parallel
+   std::vector<Copy> c(copies);
+   for(int i = 0; i < copies; ++i) {
+      memset(c[i].ops, 0, sizeof(c[i].ops));
+      c[i].requests = &requests;
+      c[i].host = host;
+      c[i].port = port;
+      c[i].speed = speed;
+      c[i].elapsed = 0;
+      c[i].failed = true;
+      if(pthread_create(&c[i].thread, NULL, replay, &c[i]) != 0) {
+         error_msg("Replay: failed to start copy %d", i);
+         copies = i;
+         break;
+      }
+   }
+
+   // Merge results
+   OpStats total[Opcodes];
+   memset(total, 0, sizeof(total));
+   double elapsed = 0;
+   int failed = 0;
+   for(int i = 0; i < copies; ++i) {
+      pthread_join(c[i].thread, NULL);
+      if(c[i].failed)
+         ++failed;
+      if(c[i].elapsed > elapsed)
+         elapsed = c[i].elapsed;
+      for(int op = 0; op < Opcodes; ++op) {
+         total[op].count += c[i].ops[op].count;
+         total[op].errors += c[i].ops[op].errors;
+         total[op].bytesOut += c[i].ops[op].bytesOut;
+         total[op].bytesIn += c[i].ops[op].bytesIn;
+         hist_merge(&total[op].latency, &c[i].ops[op].latency);
+      }
+   }
+
+   // Report
+   uint64_t count = 0, bytes_out = 0, bytes_in = 0;
+   for(int op = 0; op < Opcodes; ++op) {
+      count += total[op].count;
+      bytes_out += total[op].bytesOut;
+      bytes_in += total[op].bytesIn;
+   }
+   double rate = (elapsed > 0) ? count / elapsed : 0;
+   printf("%d copies, %llu requests in %.3f s: %.0f req/s, out %.2f MB/s, in %.2f MB/s\n",
+          copies, (unsigned long long) count, elapsed, rate,
+          (elapsed > 0) ? bytes_out / elapsed / 1e6 : 0, (elapsed > 0) ? bytes_in / elapsed / 1e6 : 0);
+   printf("%-22s %9s %7s %9s %9s %9s %9s %9s\n",
+          "OPCODE", "COUNT", "ERRORS", "REQ/S", "P50(us)", "P90(us)", "P99(us)", "MAX(us)");
+   for(int op = 0; op < Opcodes; ++op) {
+      OpStats& s = total[op];
+      if(s.count == 0)
+         continue;
+      printf("%-22s %9llu %7llu %9.0f %9llu %9llu %9llu %9llu\n",
+             call_name(CallType + op), (unsigned long long) s.count, (unsigned long long) s.errors,
+             (elapsed > 0) ? s.count / elapsed : 0,
+             (unsigned long long) hist_percentile(&s.latency, 50),
+             (unsigned long long) hist_percentile(&s.latency, 90),
+             (unsigned long long) hist_percentile(&s.latency, 99),
+             (unsigned long long) s.latency.max);
+   }
+
+   if(failed > 0)
+      error_msg("Replay: %d of %d copies did not complete", failed, copies);
+
+   return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+/** @} */
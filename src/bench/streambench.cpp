@@ -0,0 +1,192 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file streambench.cpp
+    \brief Bulk IN throughput benchmark.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup bench
+    @{
+  */
+#include "usbnet.h"
+#include "cmdflags.hpp"
+#include "common.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/* Benchmark result. */
+struct Result
+{
+   int transfers;
+   int errors;
+   long long bytes;
+   double elapsed;
+};
+
+/* Monotonic time in seconds. */
+static double now()
+{
+   return now_ns() / 1e9;
+}
+
+static void print_result(const char* name, const Result& r)
+{
+   double rate = (r.elapsed > 0) ? r.bytes / r.elapsed / 1e6 : 0;
+   printf("%-18s %6d transfers %6d errors %10lld B %8.3f s %8.2f MB/s\n",
+          name, r.transfers, r.errors, r.bytes, r.elapsed, rate);
+}
+
+/* Request/response path, one usb_bulk_read() per transfer. */
+static Result bench_request(usb_dev_handle* h, int ep, int chunk, int count, int timeout)
+{
+   Result r = { 0, 0, 0, 0 };
+   std::vector<char> buf(chunk);
+   double start = now();
+   for(r.transfers = 0; r.transfers < count; ++r.transfers) {
+      int res = usb_bulk_read(h, ep, &buf[0], chunk, timeout);
+      if(res < 0)
+         ++r.errors;
+      else
+         r.bytes += res;
+   }
+
+   r.elapsed = now() - start;
+   return r;
+}
+
+/* Subscribed stream path. */
+static Result bench_stream(usb_dev_handle* h, int ep, int chunk, int depth, int count)
+{
+   Result r = { 0, 0, 0, 0 };
+   std::vector<char> buf(chunk);
+   double start = now();
+   if(usbnet_stream_open(h, ep, chunk, depth) < 0) {
+      error_msg("Bench: failed to open stream on endpoint 0x%02x", ep);
+      r.errors = count;
+      return r;
+   }
+
+   for(r.transfers = 0; r.transfers < count; ++r.transfers) {
+      int res = usbnet_stream_read(h, ep, &buf[0], chunk);
+      if(res < 0) {
+         ++r.errors;
+
+         // Stream is closed on errors other than timeout
+         if(res != -ETIMEDOUT && usbnet_stream_open(h, ep, chunk, depth) < 0)
+            break;
+      }
+      else
+         r.bytes += res;
+   }
+
+   usbnet_stream_close(h, ep);
+   r.elapsed = now() - start;
+   return r;
+}
+
+int main(int argc, char* argv[])
+{
+   // Command line options
+   int bus = -1, dev = -1, iface = -1;
+   int ep = 0x81, chunk = 16384, depth = 8, count = 1000, timeout = 1000;
+
+   // Parse command line arguments
+   CmdFlags cmd(argc, argv);
+   cmd.add('d', "device",   "Device bus:devnum, first device by default.")
+      .add('i', "interface", "Claim interface before transfers.")
+      .add('e', "endpoint", "Bulk IN endpoint (hex).", "81")
+      .add('s', "chunk",    "Transfer size in bytes.", "16384")
+      .add('w', "window",   "Stream read-ahead window.", "8")
+      .add('n', "count",    "Number of transfers per path.", "1000")
+      .add('t', "timeout",  "Request/response transfer timeout (ms).", "1000")
+      .add('?', "help",     "Print help",   "", false);
+
+   cmd.setUsage("Usage: usbnet [options] \"usbnet-streambench [options]\"");
+
+   CmdFlags::Match m = cmd.getopt();
+   while(m.first >= 0) {
+
+      // Evaluate
+      switch(m.first) {
+      case 'd':
+         if(sscanf(m.second.c_str(), "%d:%d", &bus, &dev) != 2) {
+            error_msg("Bench: invalid device '%s'", m.second.c_str());
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'i': iface   = atoi(m.second.c_str()); break;
+      case 'e': ep      = strtol(m.second.c_str(), NULL, 16); break;
+      case 's': chunk   = atoi(m.second.c_str()); break;
+      case 'w': depth   = atoi(m.second.c_str()); break;
+      case 'n': count   = atoi(m.second.c_str()); break;
+      case 't': timeout = atoi(m.second.c_str()); break;
+      case '?':
+         cmd.printHelp();
+         return EXIT_SUCCESS;
+         break;
+      default:
+         break;
+      }
+
+      // Next option
+      m = cmd.getopt();
+   }
+
+   // Request/response path is measured without read-ahead
+   unsetenv("USBNET_READAHEAD");
+
+   // Find device
+   usb_init();
+   usb_find_busses();
+   usb_find_devices();
+   struct usb_device* udev = NULL;
+   for(struct usb_bus* b = usb_get_busses(); b && !udev; b = b->next) {
+      for(struct usb_device* d = b->devices; d && !udev; d = d->next) {
+         if(bus < 0 || ((int) b->location == bus && d->devnum == dev))
+            udev = d;
+      }
+   }
+
+   usb_dev_handle* h = NULL;
+   if(udev == NULL || (h = usb_open(udev)) == NULL) {
+      error_msg("Bench: device not found");
+      return EXIT_FAILURE;
+   }
+
+   if(iface >= 0 && usb_claim_interface(h, iface) < 0) {
+      error_msg("Bench: failed to claim interface %d", iface);
+      usb_close(h);
+      return EXIT_FAILURE;
+   }
+
+   // Run benchmarks
+   printf("Endpoint 0x%02x, %d x %d B, stream window %d\n", ep, count, chunk, depth);
+   Result req = bench_request(h, ep, chunk, count, timeout);
+   print_result("request/response", req);
+   Result str = bench_stream(h, ep, chunk, depth, count);
+   print_result("stream", str);
+   if(req.elapsed > 0 && str.elapsed > 0 && req.bytes > 0)
+      printf("Speedup: %.2fx\n", (str.bytes / str.elapsed) / (req.bytes / req.elapsed));
+
+   if(iface >= 0)
+      usb_release_interface(h, iface);
+   usb_close(h);
+   return EXIT_SUCCESS;
+}
+/** @} */
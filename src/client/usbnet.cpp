@@ -23,20 +23,171 @@
     @{
   */
 #include "clientsocket.hpp"
-#include "protobase.h"
+#include "protocol.hpp"
+#include "usbnet.h"
 #include "common.h"
 #include "cmdflags.hpp"
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/tcp.h>
+#include <unistd.h>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+using namespace Proto;
+
+/* Format byte count with binary suffix. */
+static std::string format_bytes(uint64_t val) {
+   static const char* units = "BKMGT";
+   double v = val;
+   int u = 0;
+   while(v >= 1024.0 && u < 4) {
+      v /= 1024.0;
+      ++u;
+   }
+   char buf[32];
+   if(u == 0)
+      snprintf(buf, sizeof(buf), "%lluB", (unsigned long long) val);
+   else
+      snprintf(buf, sizeof(buf), "%.1f%c", v, units[u]);
+   return buf;
+}
+
+/* Format latency in microseconds. */
+static std::string format_us(uint64_t us) {
+   char buf[32];
+   if(us < 10000)
+      snprintf(buf, sizeof(buf), "%lluus", (unsigned long long) us);
+   else if(us < 10000000)
+      snprintf(buf, sizeof(buf), "%llums", (unsigned long long) us / 1000);
+   else
+      snprintf(buf, sizeof(buf), "%llus", (unsigned long long) us / 1000000);
+   return buf;
+}
+
+/* Opcode usage ordering, most used first. */
+typedef std::pair<uint64_t, int> OpCount;
+static bool by_count(const OpCount& a, const OpCount& b) {
+   return a.first > b.first;
+}
+
+/* Decode and print UsbStats response. */
+static void print_stats(Packet& pkt, const std::string& target)
+{
+   Iterator it(pkt);
+
+   // Server block
+   uint64_t heap_used = it.getUInt64();
+   uint64_t heap_total = it.getUInt64();
+   unsigned frames = it.getUInt();
+   uint64_t backlog = it.getUInt64();
+
+   // Totals
+   unsigned uptime = it.getUInt();
+   uint64_t requests = it.getUInt64();
+   uint64_t bytes_in = it.getUInt64();
+   uint64_t bytes_out = it.getUInt64();
+   uint64_t shed = it.getUInt64();
+
+   printf("usbexportd %s  up %uh%02um%02us  heap %s / %s  backlog %u (%s)\n",
+          target.c_str(), uptime / 3600, (uptime / 60) % 60, uptime % 60,
+          format_bytes(heap_used).c_str(), format_bytes(heap_total).c_str(),
+          frames, format_bytes(backlog).c_str());
+   printf("requests %llu  in %s  out %s  shed %llu\n\n",
+          (unsigned long long) requests, format_bytes(bytes_in).c_str(),
+          format_bytes(bytes_out).c_str(), (unsigned long long) shed);
+   printf("%-6s %8s %10s %8s %8s %5s %5s %7s %7s %7s %7s  %s\n",
+          "KIND", "FD", "REQS", "IN", "OUT", "PEND", "QUEUE",
+          "P50", "P90", "P99", "MAX", "OPCODES");
+
+   // Client and device entries
+   while(it.type() == UnsignedType) {
+      unsigned kind = it.getUInt();
+      int id = it.getInt();
+      uint64_t in = it.getUInt64();
+      uint64_t out = it.getUInt64();
+      unsigned pending = it.getUInt();
+      unsigned queued = it.getUInt();
+      unsigned p50 = it.getUInt(), p90 = it.getUInt();
+      unsigned p99 = it.getUInt(), max = it.getUInt();
+
+      // Opcode counters
+      std::vector<OpCount> ops;
+      uint64_t total = 0;
+      unsigned count = it.getUInt();
+      for(unsigned i = 0; i < count && it.type() == UnsignedType; ++i) {
+         int op = it.getUInt();
+         ops.push_back(OpCount(it.getUInt64(), op));
+         total += ops.back().first;
+      }
+      std::sort(ops.begin(), ops.end(), by_count);
+
+      // Three most used opcodes
+      std::string top;
+      for(unsigned i = 0; i < ops.size() && i < 3; ++i) {
+         char buf[64];
+         const char* name = call_name(ops[i].second);
+         if(strncmp(name, "Usb", 3) == 0)
+            name += 3;
+         snprintf(buf, sizeof(buf), "%s%s:%llu", i > 0 ? " " : "", name,
+                  (unsigned long long) ops[i].first);
+         top.append(buf);
+      }
+
+      // Devices only have queues
+      char queue[16] = "-";
+      if(kind != 0)
+         snprintf(queue, sizeof(queue), "%u", queued);
+
+      printf("%-6s %8d %10llu %8s %8s %5u %5s %7s %7s %7s %7s  %s\n",
+             kind == 0 ? "client" : "device", id, (unsigned long long) total,
+             format_bytes(in).c_str(), format_bytes(out).c_str(), pending,
+             queue,
+             format_us(p50).c_str(), format_us(p90).c_str(),
+             format_us(p99).c_str(), format_us(max).c_str(), top.c_str());
+   }
+}
+
+/* Poll server metrics, refresh every interval ms or print once if 0. */
+static int show_stats(ClientSocket& remote, const std::string& target, int interval)
+{
+   for(;;) {
+      Packet pkt(UsbStats);
+      if(pkt.send(remote.sock()) < 0) {
+         error_msg("Client: failed to send stats request.");
+         return EXIT_FAILURE;
+      }
+
+      Packet res;
+      if(res.recv(remote.sock()) < 0 || res.op() != UsbStats) {
+         error_msg("Client: no stats response (server too old?).");
+         return EXIT_FAILURE;
+      }
+
+      // Top-like refresh
+      if(interval > 0)
+         printf("\033[H\033[2J");
+      print_stats(res, target);
+      fflush(stdout);
+
+      if(interval <= 0)
+         break;
+      usleep(interval * 1000);
+   }
+
+   return EXIT_SUCCESS;
+}
 
 int main(int argc, char* argv[])
 {
    // Create remote connection
    ClientSocket remote;
-   std::string host("localhost"), auth, lib("libusbnet.so"), exec;
-   int port = 22222, pos = 0, timeout = 1000;
+   std::string host("localhost"), auth, lib("libusbnet.so"), filter, exec;
+   int port = 22222, timeout = 1000, interval = 1000;
+   size_t pos = 0;
+   bool stats = false;
 
    // Parse command line arguments
    CmdFlags cmd(argc, argv);
@@ -44,10 +195,14 @@ int main(int argc, char* argv[])
       .add('a', "auth",     "Authentication token user@host[:port]")
       .add('l', "library",  "Preloaded library", "libusbnet.so")
       .add('t', "timeout",  "Connection timeout (ms).", "1000")
+      .add('f', "filter",   "Device filter, f.e. vid=0403,pid=6001;bus=2")
+      .add('s', "stats",    "Show server metrics, target is host[:port]", "", false)
+      .add('i', "interval", "Metrics refresh interval (ms), 0 prints once", "1000")
       .add('q', "quiet",    "Quiet output", "", false)
       .add('?', "help",     "Print help",   "", false);
 
-   cmd.setUsage("Usage: usbnet [options] <executable>");
+   cmd.setUsage("Usage: usbnet [options] <executable>\n"
+                "       usbnet --stats [options] <host[:port]>");
 
    // Parse command line arguments
    CmdFlags::Match m = cmd.getopt();
@@ -66,6 +221,9 @@ int main(int argc, char* argv[])
       case 'a': auth    = m.second; break;
       case 'l': lib     = m.second; break;
       case 't': timeout = atoi(m.second.c_str()); break;
+      case 'f': filter  = m.second; break;
+      case 's': stats   = true; break;
+      case 'i': interval = atoi(m.second.c_str()); break;
       case 'q': log_setlevel(MsgError); break;
       case '?':
          cmd.printHelp();
@@ -82,8 +240,18 @@ int main(int argc, char* argv[])
       m = cmd.getopt();
    }
 
+   // Metrics target
+   if(stats && !exec.empty()) {
+      host = exec;
+      pos = host.find(':');
+      if(pos != std::string::npos) {
+         port = atoi(host.substr(pos + 1).c_str());
+         host.erase(pos);
+      }
+   }
+
    // Empty executable
-   if(exec.empty()) {
+   if(exec.empty() && !stats) {
       cmd.printHelp();
       return EXIT_FAILURE;
    }
@@ -112,6 +280,15 @@ int main(int argc, char* argv[])
    int flag = 1;
    setsockopt(remote.sock(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
 
+   // Show server metrics
+   if(stats) {
+      char target[300];
+      snprintf(target, sizeof(target), "%s:%d", host.c_str(), port);
+      int ret = show_stats(remote, target, interval);
+      remote.close();
+      return ret;
+   }
+
    // Create SHM segment
    int shm_id = ipc_init();
    if(shm_id == -1) {
@@ -121,6 +298,10 @@ int main(int argc, char* argv[])
    // Attach segment and save fd
    ipc_set_remote(remote.sock());
 
+   // Pass device filter to preloaded library
+   if(!filter.empty())
+      setenv("USBNET_FILTER", filter.c_str(), 1);
+
    // Run executable with preloaded library
    std::string execs("LD_PRELOAD=\"");
    execs.append(lib);
@@ -133,6 +314,7 @@ int main(int argc, char* argv[])
 
    int ret = system(execs.c_str());
    log_msg("%s", fill.c_str());
+   ret = (ret != -1 && WIFEXITED(ret)) ? WEXITSTATUS(ret) : EXIT_FAILURE;
    log_msg("IPC: executable returned %d", ret);
 
    // Close IPC
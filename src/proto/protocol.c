@@ -27,6 +27,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 /* Shared packet lock. */
 static pthread_mutex_t __mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -102,9 +104,10 @@ void pkt_release() {
 
 uint32_t pkt_recv(int fd, Packet* dst)
 {
-   // Prepare packet
+   // Prepare packet, opcode stays invalid on failure
    uint32_t size = 0;
    dst->size = 0;
+   dst->op = InvalidType;
 
    // Read packet header
    if(!pkt_reserve(dst, PACKET_MINSIZE))
@@ -124,11 +127,14 @@ uint32_t pkt_recv(int fd, Packet* dst)
    if(dst->size > 0) {
 
       // Check buffer size
-      if(!pkt_reserve(dst, dst->size))
+      if(!pkt_reserve(dst, dst->size)) {
+         dst->op = InvalidType;
          return 0;
+      }
 
       if((dst->size = recv_full(fd, dst->buf, dst->size)) == 0) {
          error_msg("%s: failed to receive packet payload", __func__);
+         dst->op = InvalidType;
          return 0;
       }
    }
@@ -147,25 +153,44 @@ int pkt_send(Packet* pkt, int fd)
    //pkt_dump(pkt->buf, pkt->size);
    #endif
 
-   // Send opcode
+   // Pack header
    char buf[PACKET_MINSIZE] = { pkt->op };
-   send(fd, buf, 1, 0);
-
-   // Send size
-   int len = pack_size(pkt->size, buf);
-   send(fd, buf, len, 0);
+   int len = pack_size(pkt->size, buf + 1) + 1;
+
+   // Send header and payload in one call, payload is not copied
+   struct iovec iov[2] = {
+      { buf, len },
+      { pkt->buf, pkt->size }
+   };
+   struct iovec* cur = iov;
+   int iovcnt = (pkt->size > 0) ? 2 : 1;
+   while(iovcnt > 0) {
+      ssize_t sent = writev(fd, cur, iovcnt);
+      if(sent < 0) {
+         if(errno == EINTR)
+            continue;
+         return -1;
+      }
 
-   // Send payload
-   if(pkt->size > 0)
-      return send(fd, pkt->buf, pkt->size, 0);
+      // Skip sent vectors on partial write
+      while(iovcnt > 0 && (size_t) sent >= cur->iov_len) {
+         sent -= cur->iov_len;
+         ++cur; --iovcnt;
+      }
+      if(iovcnt > 0) {
+         cur->iov_base = (char*) cur->iov_base + sent;
+         cur->iov_len -= sent;
+      }
+   }
 
-   return 0;
+   return pkt->size;
 }
 
-int pkt_append(Packet* pkt, uint8_t type, uint16_t len, const void* val)
+int pkt_append(Packet* pkt, uint8_t type, uint32_t len, const void* val)
 {
-   // Reserve packet size
-   uint16_t isize = sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint16_t) + len;
+   // Reserve packet size, 16bit length is used whenever it fits
+   uint32_t lsize = (len < 0xffff) ? sizeof(uint16_t) : sizeof(uint32_t);
+   uint32_t isize = sizeof(uint8_t) + sizeof(uint8_t) + lsize + len;
    if(!pkt_reserve(pkt, pkt->size + isize))
       return 0;
 
@@ -173,11 +198,17 @@ int pkt_append(Packet* pkt, uint8_t type, uint16_t len, const void* val)
 
    // Write T-L-V
    *dst = type; dst += sizeof(uint8_t);
-   *dst = 0x82; dst += sizeof(uint8_t);
-   uint16_t wlen = htons(len);
-   memcpy(dst, &wlen, sizeof(uint16_t));
+   *dst = 0x80 + lsize; dst += sizeof(uint8_t);
+   if(lsize == sizeof(uint16_t)) {
+      uint16_t wlen = htons(len);
+      memcpy(dst, &wlen, sizeof(uint16_t));
+   }
+   else {
+      uint32_t wlen = htonl(len);
+      memcpy(dst, &wlen, sizeof(uint32_t));
+   }
    if(len > 0) {
-      memcpy(dst + sizeof(uint16_t), val, len);
+      memcpy(dst + lsize, val, len);
    }
 
    // Update packet size
@@ -32,7 +32,7 @@
 using namespace Proto;
 
 Struct::Struct(ByteBuffer& sharedbuf, int pos)
-   : mBuf(sharedbuf), mPos(pos), mCursor(0), mSize(0)
+   : mBuf(sharedbuf), mPos(pos), mCursor(0), mSize(0), mReserved(-1)
 {
    // Seek end pos
    if(mPos < 0)
@@ -86,6 +86,20 @@ Struct& Struct::addNumeric(uint8_t type, uint8_t len, uint32_t val)
    return *this;
 }
 
+Struct& Struct::addUInt64(uint64_t val)
+{
+   // Push Type and Length
+   push((uint8_t) UnsignedType);
+   pushPacked(sizeof(uint64_t));
+
+   // High word first
+   uint32_t hi = htonl((uint32_t) (val >> 32));
+   uint32_t lo = htonl((uint32_t) val);
+   append((const char*) &hi, sizeof(uint32_t));
+   append((const char*) &lo, sizeof(uint32_t));
+   return *this;
+}
+
 Struct& Struct::addData(const char* data, size_t size, uint8_t type)
 {
    push((uint8_t) type);
@@ -94,6 +108,53 @@ Struct& Struct::addData(const char* data, size_t size, uint8_t type)
    return *this;
 }
 
+char* Struct::reserveData(size_t size, uint8_t type)
+{
+   // Push Type and fixed 32bit Length
+   uint32_t len = htonl(size);
+   push((uint8_t) type);
+   mReserved = mCursor;
+   push((char) (0x80 + sizeof(uint32_t)));
+   append((const char*) &len, sizeof(uint32_t));
+
+   // Reserve value
+   mBuf.insert(mCursor, size, '\0');
+   mSize += size;
+   mCursor += size;
+   return &mBuf[mCursor - size];
+}
+
+Struct& Struct::shrinkData(size_t size)
+{
+   if(mReserved < 0)
+      return *this;
+
+   // Rewrite length and cut value
+   uint32_t cur = 0;
+   unpack_size(mBuf.data() + mReserved, &cur);
+   if(size < cur) {
+      uint32_t len = htonl(size);
+      memcpy(&mBuf[mReserved + 1], &len, sizeof(uint32_t));
+      mBuf.erase(mCursor - (cur - size), cur - size);
+      mSize -= cur - size;
+      mCursor -= cur - size;
+   }
+
+   return *this;
+}
+
+Struct& Struct::setInt32(int pos, int32_t val)
+{
+   // Skip Type and Length
+   uint32_t len = 0;
+   int szlen = unpack_size(mBuf.data() + pos + 1, &len);
+   if(len == sizeof(int32_t)) {
+      val = htonl(val);
+      memcpy(&mBuf[pos + 1 + szlen], &val, sizeof(int32_t));
+   }
+
+   return *this;
+}
 
 Struct& Struct::addString(const char* str, uint8_t type)
 {
@@ -122,8 +183,13 @@ Struct& Struct::finalize()
 
 bool Iterator::next()
 {
-   if(mPos >= mBlock.size())
+   // Invalidate past the last value
+   if(mPos >= mBlock.size()) {
+      setType(InvalidType);
+      setLength(0);
+      setValue(0);
       return false;
+   }
 
    // Load type
    const char* ptr = mBlock.data() + mPos;
@@ -160,7 +226,26 @@ bool Iterator::enter()
    return next();
 }
 
-int Packet::recv(int fd)
+void Packet::reserveHeader()
+{
+   // 32bit size, filled in on finalize()
+   const char hdr[] = { (char) (0x80 + sizeof(uint32_t)), 0, 0, 0, 0 };
+   append(hdr, sizeof(hdr));
+   mFixed = true;
+}
+
+Struct& Packet::finalize()
+{
+   if(!mFixed)
+      return Struct::finalize();
+
+   // Fill reserved header in place
+   uint32_t len = htonl(mBuf.size() - PACKET_MINSIZE);
+   memcpy(&mBuf[2], &len, sizeof(uint32_t));
+   return *this;
+}
+
+int Packet::recv(int fd, size_t limit)
 {
    // Prepare buffer
    uint32_t hsize = PACKET_MINSIZE;
@@ -171,6 +256,11 @@ int Packet::recv(int fd)
    // Unpack payload length
    uint32_t pending = 0;
    int len = unpack_size(mBuf.data() + 1, &pending);
+   if(limit > 0 && hsize + pending > limit) {
+      error_msg("%s: %u B frame over %u B limit", __func__, hsize + pending, (unsigned) limit);
+      mBuf.clear();
+      return -1;
+   }
    mBuf.resize(hsize + pending);
 
    char* ptr = (char*) mBuf.data() + 1 + len;
@@ -189,6 +279,27 @@ int Packet::recv(int fd)
    return size();
 }
 
+size_t Packet::frameSize(const char* buf, size_t len)
+{
+   // Opcode and length prefix
+   if(len < 2)
+      return 0;
+
+   // Multi-byte length
+   size_t hsize = 2;
+   unsigned c = (unsigned char) buf[1];
+   if(c > 0x80)
+      hsize += c - 0x80;
+
+   if(len < hsize)
+      return 0;
+
+   // Unpack payload length
+   uint32_t pending = 0;
+   unpack_size(buf + 1, &pending);
+   return hsize + pending;
+}
+
 void Packet::dump() {
    pkt_dump(mBuf.data(), size());
 }
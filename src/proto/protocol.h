@@ -121,11 +121,11 @@ void pkt_release();
   * \warning No byte-order conversion applied, raw data copy only.
   * \param pkt packet
   * \param type parameter type
-  * \param len  parameter size
+  * \param len  parameter size, sizes of 64KB and more use 32bit length
   * \param val  parameter value
   * \return bytes written
   */
-int pkt_append(Packet* pkt, uint8_t type, uint16_t len, const void* val);
+int pkt_append(Packet* pkt, uint8_t type, uint32_t len, const void* val);
 
 /** Append numeric value. */
 int pkt_addnumeric(Packet* pkt, uint8_t type, uint16_t len, int32_t val);
@@ -167,7 +167,7 @@ uint32_t pkt_recv(int fd, Packet* dst);
 /** Send packet.
   * \param pkt given packet
   * \param fd destination socket descriptor
-  * \return socket send() value
+  * \return payload size or -1 on error
   */
 int pkt_send(Packet* pkt, int fd);
 
@@ -126,6 +126,18 @@ class Struct
    /** Add raw data. */
    Struct& addData(const char* data, size_t size, uint8_t type = RawType);
 
+   /** Reserve data item to be filled in place.
+     * Item length is encoded in 32 bits, so it can be shrunk later.
+     * \return pointer to item value, valid until next write to the block
+     */
+   char* reserveData(size_t size, uint8_t type = RawType);
+
+   /** Shrink last reserved data item, it must be the last item in block. */
+   Struct& shrinkData(size_t size);
+
+   /** Overwrite value of 32bit integer item at given block position. */
+   Struct& setInt32(int pos, int32_t val);
+
    /** Append 8bit long unsigned integer. */
    Struct& addUInt8(uint8_t val) {
       return addNumeric(UnsignedType, 1, val);
@@ -141,6 +153,9 @@ class Struct
       return addNumeric(UnsignedType, 4, val);
    }
 
+   /** Append 64bit long unsigned integer. */
+   Struct& addUInt64(uint64_t val);
+
    /** Append 8bit long signed integer. */
    Struct& addInt8(int8_t val) {
       return addNumeric(IntegerType, 1, val);
@@ -164,6 +179,7 @@ class Struct
    private:
       ByteBuffer& mBuf;
       int mPos, mCursor, mSize;
+      int mReserved; // Last reserved item length position
 };
 
 
@@ -218,6 +234,15 @@ class Iterator
          return 0;
       }
 
+      /** Return value as 64bit unsigned int, shorter values are widened.
+        */
+      uint64_t getUInt64() {
+         if(mLength != sizeof(uint64_t))
+            return getUInt();
+         const uint32_t* val = (const uint32_t*) getVal();
+         return ((uint64_t) ntohl(val[0]) << 32) | ntohl(val[1]);
+      }
+
       /** Return value as 8bit unsigned int.
         */
       uint8_t  getUInt8() { return *((uint8_t*) getVal()); }
@@ -276,17 +301,36 @@ class Packet : public Struct
 
    /** Create on new/existing buffer. */
    Packet(uint8_t op = InvalidType)
-      : Struct(mBuf, 0) {
+      : Struct(mBuf, 0), mFixed(false), mStamp(0) {
       if(op != InvalidType) {
          push(op);
       }
    }
 
+   /** Reserve fixed size header after opcode.
+     * Payload is then not moved when packet is finalized, which keeps
+     * pointers returned by reserveData() valid.
+     */
+   void reserveHeader();
+
+   /** Finalize packet, insert packet size in header. */
+   Struct& finalize();
+
    /** Return packet opcode. */
    uint8_t op() {
       return mBuf.at(0);
    }
 
+   /** Return arrival time (monotonic us), 0 if unknown. */
+   long long stamp() {
+      return mStamp;
+   }
+
+   /** Set arrival time (monotonic us). */
+   void setStamp(long long us) {
+      mStamp = us;
+   }
+
    /** Clear buffered data. */
    void clear() {
       mBuf.clear();
@@ -302,17 +346,41 @@ class Packet : public Struct
       return mBuf.data();
    }
 
+   /** Load complete frame (header included) from raw data. */
+   void assign(const char* data, size_t size) {
+      mBuf.assign(data, size);
+   }
+
+   /** Finalize packet and move encoded frame to given buffer.
+     * Packet is left empty.
+     */
+   void take(ByteBuffer& dst) {
+      finalize();
+      dst.swap(mBuf);
+      mBuf.clear();
+   }
+
+   /** Return complete frame size if buffer contains at least packet header.
+     * \return frame size (header included) or 0 if header is incomplete
+     */
+   static size_t frameSize(const char* buf, size_t len);
+
    /** Hex-dump current data (debugging). */
    void dump();
 
-   /** Receive packet from socket. */
-   int recv(int fd);
+   /** Receive packet from socket.
+     * \param limit largest accepted frame size, 0 for no limit
+     * \return frame size or -1 on error or frame over limit
+     */
+   int recv(int fd, size_t limit = 0);
 
    /** Send packet to socket. */
    int send(int fd);
 
    private:
    std::string mBuf;
+   bool mFixed;
+   long long mStamp;
 };
 
 }
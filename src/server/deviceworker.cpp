@@ -0,0 +1,622 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file deviceworker.cpp
+    \brief Per-device request worker.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "deviceworker.hpp"
+#include "usbservice.hpp"
+#include "servicestats.hpp"
+#include "common.h"
+#include <deque>
+#include <list>
+#include <pthread.h>
+#include <errno.h>
+
+/* Queued request. */
+struct Job
+{
+   int fd;
+   unsigned session; // Client session, see ServerSocket::session()
+   long long stamp;  // Arrival time
+   int ep;           // Endpoint of write chunk, -1 for other requests
+   size_t bytes;     // Data bytes of write chunk
+   bool rejected;    // Write chunk over window, data is dropped
+   ByteBuffer frame;
+};
+
+/* Bulk IN read-ahead stream. */
+struct Stream
+{
+   int fd;      // Client socket
+   unsigned session; // Client session
+   int ep;      // Endpoint address
+   int size;    // Read size
+   int timeout; // Read timeout, 0 waits forever
+   int waited;  // Time spent in current read
+   int depth;   // Maximum credits
+   int credits; // Reads left before client acknowledges
+};
+
+/* Upper bound for stream depth. */
+static const int MaxStreamDepth = 64;
+
+/* Longest read-ahead read (ms), queued requests wait at most this long. */
+static const int StreamSlice = 50;
+
+/* Write-behind endpoint state. */
+struct WriteBehind
+{
+   int fd;      // Client socket
+   unsigned session; // Client session
+   int ep;      // Endpoint address
+   int seq;     // Last processed write
+   int gen;     // Failure generation, writes of older generations are dropped
+   int error;   // Failure to report with next ack
+   int unacked; // Processed writes not acknowledged yet
+};
+
+/* Writes acknowledged at once at most. */
+static const int AckInterval = 4;
+
+/* Chunked bulk write in progress. */
+struct ChunkedWrite
+{
+   int fd;      // Client socket
+   int ep;      // Endpoint address
+   long long start; // First chunk processed (ms), timeout applies to whole transfer
+   int total;   // Bytes written
+   int error;   // First failure
+   bool done;   // Failed or short write, remaining chunks are skipped
+};
+
+class DeviceWorker::Private
+{
+   public:
+   UsbService* service;
+   int devfd;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   std::deque<Job> queue;
+   bool started;
+   bool finishing;
+   bool finished;
+
+   /* Session of request being processed. */
+   unsigned session;
+
+   /* Read-ahead streams, accessed by worker thread only. */
+   std::list<Stream> streams;
+
+   /** Return true if any stream has credits left. */
+   bool readable();
+
+   /** Issue one read-ahead on the next readable stream. */
+   void readahead();
+
+   /** Handle stream requests.
+     * \return false if request isn't stream related
+     */
+   bool control(int fd, Packet& pkt);
+
+   /* Write-behind endpoints, accessed by worker thread only. */
+   std::list<WriteBehind> writes;
+
+   /** Process write-behind request. */
+   void write(int fd, Packet& pkt);
+
+   /** Send cumulative ack. */
+   void ack(WriteBehind& w);
+
+   /** Send pending acks. */
+   void flush();
+
+   /* Chunked writes, accessed by worker thread only. */
+   std::list<ChunkedWrite> chunks;
+
+   /** Process chunk of bulk write, rejected chunk fails the transfer. */
+   void chunk(int fd, Packet& pkt, bool rejected = false);
+
+   /** Return data bytes of write chunks queued for endpoint, caller holds lock. */
+   size_t window(int fd, int ep);
+};
+
+bool DeviceWorker::Private::readable()
+{
+   std::list<Stream>::iterator i;
+   for(i = streams.begin(); i != streams.end(); ++i) {
+      if(i->credits > 0)
+         return true;
+   }
+
+   return false;
+}
+
+void DeviceWorker::Private::readahead()
+{
+   // Round-robin between readable streams
+   std::list<Stream>::iterator i = streams.begin();
+   while(i->credits <= 0)
+      ++i;
+   streams.splice(streams.end(), streams, i);
+
+   // Client is gone, results would reach a new client on the same socket
+   Stream& s = streams.back();
+   if(service->session(s.fd) != s.session) {
+      debug_msg("stream ep 0x%02x on device fd %d dropped, client is gone", s.ep, devfd);
+      streams.pop_back();
+      return;
+   }
+
+   // Read in slices, so the worker gets back to queued requests
+   int slice = StreamSlice;
+   bool last = false;
+   if(s.timeout > 0 && s.timeout - s.waited <= slice) {
+      slice = s.timeout - s.waited;
+      last = true;
+   }
+
+   // Push result to client, timed out slice is retried silently
+   ServerSocket::bind(s.fd, s.session);
+   int res = service->stream_read(s.fd, devfd, s.ep, s.size, slice, !last);
+   ServerSocket::bind(-1, 0);
+   if(res == -ETIMEDOUT && !last) {
+      s.waited += slice;
+      return;
+   }
+   s.waited = 0;
+   --s.credits;
+
+   // Stop on errors other than timeout, client reopens
+   if(res < 0 && res != -ETIMEDOUT) {
+      debug_msg("stream ep 0x%02x on device fd %d stopped (%d)", s.ep, devfd, res);
+      streams.pop_back();
+   }
+}
+
+bool DeviceWorker::Private::control(int fd, Packet& pkt)
+{
+   switch(pkt.op())
+   {
+      case UsbStreamOpen:
+      case UsbStreamCredit:
+      case UsbStreamClose:
+         break;
+      case UsbBulkWriteAsync:
+         write(fd, pkt);
+         return true;
+      case UsbDataChunk:
+         chunk(fd, pkt);
+         return true;
+      case UsbClose:
+         // Stop streams and close device
+         streams.clear();
+         writes.clear();
+         chunks.clear();
+         return false;
+      default:
+         return false;
+   }
+
+   // Find stream
+   Iterator it(pkt);
+   it.getInt(); // Device fd
+   int ep = it.getInt();
+   std::list<Stream>::iterator i = streams.begin();
+   while(i != streams.end() && !(i->fd == fd && i->ep == ep))
+      ++i;
+
+   switch(pkt.op())
+   {
+      case UsbStreamOpen:
+      {
+         // Start or update stream
+         int res = 0;
+         Stream s;
+         s.fd = fd;
+         s.session = session;
+         s.ep = ep;
+         s.size = it.getInt();
+         s.timeout = it.getInt();
+         s.waited = 0;
+         s.depth = it.getInt();
+         if(s.depth > MaxStreamDepth)
+            s.depth = MaxStreamDepth;
+         if(!(s.ep & USB_ENDPOINT_IN) || s.size <= 0 || s.depth <= 0)
+            res = -EINVAL;
+         else if(i != streams.end()) {
+            i->size = s.size;
+            i->timeout = s.timeout;
+            i->waited = 0;
+         }
+         else {
+            s.credits = s.depth;
+            streams.push_back(s);
+         }
+
+         debug_msg("stream ep 0x%02x on device fd %d, %d x %dB = %d", s.ep, devfd, s.depth, s.size, res);
+         Packet resp(UsbStreamOpen);
+         resp.addInt32(res);
+         service->reply(fd, resp);
+      }
+         break;
+      case UsbStreamCredit:
+         // Return credits
+         if(i != streams.end()) {
+            i->credits += it.getInt();
+            if(i->credits > i->depth)
+               i->credits = i->depth;
+         }
+         break;
+      case UsbStreamClose:
+      {
+         // Stop stream, pushed results precede the response
+         int res = -ENOENT;
+         if(i != streams.end()) {
+            streams.erase(i);
+            res = 0;
+         }
+
+         Packet resp(UsbStreamClose);
+         resp.addInt32(res);
+         service->reply(fd, resp);
+      }
+         break;
+      default:
+         break;
+   }
+
+   return true;
+}
+
+void DeviceWorker::Private::write(int fd, Packet& pkt)
+{
+   Iterator it(pkt);
+   it.getInt(); // Device fd
+   int ep = it.getInt();
+   int seq = it.getInt();
+   int gen = it.getInt();
+   int size = it.length();
+   char* data = (char*) it.getByteArray();
+   int timeout = it.getInt();
+
+   // Find endpoint state
+   std::list<WriteBehind>::iterator w = writes.begin();
+   while(w != writes.end() && !(w->fd == fd && w->ep == ep))
+      ++w;
+   if(w == writes.end()) {
+      WriteBehind s = { fd, session, ep, 0, 0, 0, 0 };
+      w = writes.insert(writes.end(), s);
+   }
+
+   // Writes issued before client saw the failure are dropped
+   w->seq = seq;
+   ++w->unacked;
+   if(gen != w->gen)
+      return;
+
+   // Transfer, short write is a failure
+   int res = -ENODEV;
+   usb_dev_handle* h = service->device(fd, devfd);
+   if(h != NULL && size > 0)
+      res = service->bulk_transfer(h, ep, data, size, timeout);
+   if(res != size) {
+      debug_msg("write-behind ep 0x%02x seq %d on device fd %d failed (%d)", ep, seq, devfd, res);
+      w->error = (res < 0) ? res : -EIO;
+      ++w->gen;
+   }
+
+   // Acknowledge failures immediately
+   if(w->error != 0 || w->unacked >= AckInterval)
+      ack(*w);
+}
+
+void DeviceWorker::Private::ack(WriteBehind& w)
+{
+   Packet pkt(UsbWriteAck);
+   pkt.addInt32(devfd);
+   pkt.addInt32(w.ep);
+   pkt.addInt32(w.seq);
+   pkt.addInt32(w.error);
+   ServerSocket::bind(w.fd, w.session);
+   service->reply(w.fd, pkt);
+   w.unacked = 0;
+   w.error = 0;
+}
+
+void DeviceWorker::Private::flush()
+{
+   std::list<WriteBehind>::iterator w;
+   for(w = writes.begin(); w != writes.end(); ++w) {
+      if(w->unacked > 0)
+         ack(*w);
+   }
+   ServerSocket::bind(-1, 0);
+}
+
+size_t DeviceWorker::Private::window(int fd, int ep)
+{
+   size_t res = 0;
+   std::deque<Job>::iterator i;
+   for(i = queue.begin(); i != queue.end(); ++i) {
+      if(i->fd == fd && i->ep == ep)
+         res += i->bytes;
+   }
+
+   return res;
+}
+
+void DeviceWorker::Private::chunk(int fd, Packet& pkt, bool rejected)
+{
+   Iterator it(pkt);
+   it.getInt(); // Device fd
+   int ep = it.getInt();
+   int last = it.getInt();
+   int size = it.length();
+   char* data = (char*) it.getByteArray();
+   int timeout = it.getInt();
+
+   // Find or begin transfer
+   std::list<ChunkedWrite>::iterator w = chunks.begin();
+   while(w != chunks.end() && !(w->fd == fd && w->ep == ep))
+      ++w;
+   if(w == chunks.end()) {
+      ChunkedWrite s = { fd, ep, now_ms(), 0, 0, false };
+      w = chunks.insert(chunks.end(), s);
+   }
+
+   // Write chunk as it arrives
+   int res = -ECANCELED;
+   if(rejected) {
+      res = -ENOBUFS;
+      if(!w->done)
+         w->error = res;
+      w->done = true;
+   }
+   else if(!w->done && size > 0) {
+      res = -ENODEV;
+      usb_dev_handle* h = service->device(fd, devfd);
+      int left = timeout;
+      if(timeout > 0)
+         left = timeout - (int) (now_ms() - w->start);
+      if(!service->deadline(pkt, timeout) || (timeout > 0 && left <= 0))
+         res = -ETIMEDOUT;
+      else if(h != NULL)
+         res = service->bulk_transfer(h, ep, data, size, left);
+      if(res < 0)
+         w->error = res;
+      else
+         w->total += res;
+      w->done = (res != size);
+   }
+
+   // Acknowledge chunk, return result after last one
+   if(!last) {
+      Packet ack(UsbDataChunk);
+      ack.addInt32(devfd);
+      ack.addInt32(ep);
+      ack.addInt32(res);
+      service->reply(fd, ack);
+      return;
+   }
+
+   res = (w->error < 0) ? w->error : w->total;
+   debug_msg("chunked write ep 0x%02x on device fd %d = %d", ep, devfd, res);
+   chunks.erase(w);
+
+   Packet resp(UsbBulkWrite);
+   resp.addInt32(res);
+   service->reply(fd, resp);
+}
+
+DeviceWorker::DeviceWorker(UsbService* service, int devfd)
+   : d(new Private)
+{
+   d->service = service;
+   d->devfd = devfd;
+   d->started = false;
+   d->finishing = false;
+   d->finished = false;
+   d->session = 0;
+   pthread_mutex_init(&d->lock, NULL);
+   pthread_cond_init(&d->cond, NULL);
+}
+
+DeviceWorker::~DeviceWorker()
+{
+   // Wait for queued requests
+   if(d->started) {
+      finish();
+      pthread_join(d->thread, NULL);
+   }
+
+   pthread_cond_destroy(&d->cond);
+   pthread_mutex_destroy(&d->lock);
+   delete d;
+}
+
+bool DeviceWorker::start()
+{
+   if(pthread_create(&d->thread, NULL, &DeviceWorker::run, this) != 0) {
+      error_msg("UsbService: failed to create worker for device fd %d", d->devfd);
+      return false;
+   }
+
+   d->started = true;
+   return true;
+}
+
+bool DeviceWorker::push(int fd, Packet& pkt)
+{
+   // Write chunk endpoint
+   int ep = -1, last = 0, timeout = 0;
+   size_t bytes = 0;
+   if(pkt.op() == UsbDataChunk) {
+      Iterator it(pkt);
+      it.getInt(); // Device fd
+      ep = it.getInt();
+      last = it.getInt();
+      bytes = it.length();
+      it.getByteArray();
+      timeout = it.getInt();
+   }
+
+   pthread_mutex_lock(&d->lock);
+   if(d->finished) {
+      pthread_mutex_unlock(&d->lock);
+      return false;
+   }
+
+   // Chunks over window are queued without data, client ignores its window
+   size_t queued = (ep >= 0) ? d->window(fd, ep) : 0;
+   bool rejected = (ep >= 0 && queued + bytes > d->service->mChunkWindow);
+
+   d->queue.push_back(Job());
+   d->queue.back().fd = fd;
+   d->queue.back().session = d->service->session(fd);
+   d->queue.back().stamp = pkt.stamp();
+   d->queue.back().ep = ep;
+   d->queue.back().bytes = rejected ? 0 : bytes;
+   d->queue.back().rejected = rejected;
+   if(rejected) {
+      debug_msg("chunk for ep 0x%02x on device fd %d over window (%u B queued)", ep, d->devfd, (unsigned) queued);
+      Packet stub(UsbDataChunk);
+      stub.addInt32(d->devfd);
+      stub.addInt32(ep);
+      stub.addInt32(last);
+      stub.addData(NULL, 0, OctetType);
+      stub.addInt32(timeout);
+      stub.take(d->queue.back().frame);
+   }
+   else {
+      d->queue.back().frame.assign(pkt.data(), pkt.size());
+   }
+   pthread_cond_signal(&d->cond);
+   pthread_mutex_unlock(&d->lock);
+   return true;
+}
+
+void DeviceWorker::finish()
+{
+   pthread_mutex_lock(&d->lock);
+   d->finishing = true;
+   pthread_cond_signal(&d->cond);
+   pthread_mutex_unlock(&d->lock);
+}
+
+bool DeviceWorker::isFinished()
+{
+   pthread_mutex_lock(&d->lock);
+   bool res = d->finished;
+   pthread_mutex_unlock(&d->lock);
+   return res;
+}
+
+int DeviceWorker::devfd()
+{
+   return d->devfd;
+}
+
+unsigned DeviceWorker::queued()
+{
+   pthread_mutex_lock(&d->lock);
+   unsigned res = d->queue.size();
+   pthread_mutex_unlock(&d->lock);
+   return res;
+}
+
+void* DeviceWorker::run(void* arg)
+{
+   DeviceWorker* w = (DeviceWorker*) arg;
+   Private* d = w->d;
+   debug_msg("worker for device fd %d started", d->devfd);
+   ServiceStats::setDevice(d->devfd);
+
+   pthread_mutex_lock(&d->lock);
+   for(;;) {
+
+      // Acknowledge writes before idling or processing other requests
+      if(d->queue.empty() || d->queue.front().frame.data()[0] != UsbBulkWriteAsync) {
+         pthread_mutex_unlock(&d->lock);
+         d->flush();
+         pthread_mutex_lock(&d->lock);
+      }
+
+      // Wait for request or read-ahead credits
+      while(d->queue.empty() && !d->finishing && !d->readable())
+         pthread_cond_wait(&d->cond, &d->lock);
+      if(d->queue.empty() && d->finishing)
+         break;
+
+      // Requests take precedence over read-ahead
+      if(d->queue.empty()) {
+         pthread_mutex_unlock(&d->lock);
+         d->readahead();
+         pthread_mutex_lock(&d->lock);
+         continue;
+      }
+
+      Job job;
+      job.fd = d->queue.front().fd;
+      job.session = d->queue.front().session;
+      job.stamp = d->queue.front().stamp;
+      job.ep = d->queue.front().ep;
+      job.bytes = d->queue.front().bytes;
+      job.rejected = d->queue.front().rejected;
+      job.frame.swap(d->queue.front().frame);
+      d->queue.pop_front();
+      pthread_mutex_unlock(&d->lock);
+
+      // Drop requests of disconnected client, cleanup is queued internally
+      if(job.fd >= 0 && d->service->session(job.fd) != job.session) {
+         debug_msg("dropped request of gone client fd %d on device fd %d", job.fd, d->devfd);
+         d->service->mStats.dropped(d->devfd);
+         pthread_mutex_lock(&d->lock);
+         continue;
+      }
+
+      // Process request, responses are bound to client session
+      Packet pkt;
+      pkt.assign(job.frame.data(), job.frame.size());
+      pkt.setStamp(job.stamp);
+      d->session = job.session;
+      ServerSocket::bind(job.fd, job.session);
+      if(job.rejected)
+         d->chunk(job.fd, pkt, true);
+      else if(!d->control(job.fd, pkt))
+         d->service->process(job.fd, pkt);
+      ServerSocket::bind(-1, 0);
+      if(job.fd < 0 || d->service->session(job.fd) == job.session)
+         d->service->mStats.processed(job.fd, d->devfd, pkt);
+      else
+         d->service->mStats.dropped(d->devfd);
+
+      pthread_mutex_lock(&d->lock);
+   }
+
+   d->finished = true;
+   pthread_mutex_unlock(&d->lock);
+   debug_msg("worker for device fd %d finished", d->devfd);
+   return NULL;
+}
+
+/** @} */
@@ -0,0 +1,83 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file deviceworker.hpp
+    \brief Per-device request worker.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __deviceworker_hpp__
+#define __deviceworker_hpp__
+#include "protocol.hpp"
+using namespace Proto;
+
+class UsbService;
+
+/** Per-device request worker.
+  * Requests for an open device are queued and processed in order
+  * by the worker thread, so blocking transfers stall only the device
+  * they're issued on. Responses are posted back to the event engine.
+  * Bulk IN read-ahead streams (UsbStreamOpen) are served by the worker
+  * while its queue is idle, bounded by credits the client returns.
+  * Write-behind requests (UsbBulkWriteAsync) are acknowledged cumulatively,
+  * chunks of large writes (UsbDataChunk) are written as they arrive.
+  */
+class DeviceWorker
+{
+   public:
+   DeviceWorker(UsbService* service, int devfd);
+
+   /** Finish queued requests and join worker thread. */
+   ~DeviceWorker();
+
+   /** Start worker thread.
+     * \return false if thread couldn't be created
+     */
+   bool start();
+
+   /** Queue request for processing, packet data is copied.
+     * \return false if worker has exited, request is not queued
+     */
+   bool push(int fd, Packet& pkt);
+
+   /** Exit after queued requests are processed. */
+   void finish();
+
+   /** Return true if worker thread has exited. */
+   bool isFinished();
+
+   /** Return served device descriptor. */
+   int devfd();
+
+   /** Return number of queued requests. */
+   unsigned queued();
+
+   private:
+
+   /** Worker thread main. */
+   static void* run(void* arg);
+
+   /* Opaque pointer */
+   class Private;
+   Private* d;
+};
+
+#endif // __deviceworker_hpp__
+/** @} */
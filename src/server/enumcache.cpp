@@ -0,0 +1,355 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file enumcache.cpp
+    \brief Shared enumeration snapshot.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "enumcache.hpp"
+#include "usbservice.hpp"
+#include "usbbackend.hpp"
+#include "common.h"
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+
+/* Device nodes directory. */
+#define USBFS_PATH "/dev/bus/usb"
+
+EnumFilter::EnumFilter(const std::string& expr)
+{
+   // Split alternatives
+   size_t pos = 0;
+   while(pos < expr.size()) {
+      size_t end = expr.find(';', pos);
+      if(end == std::string::npos)
+         end = expr.size();
+      std::string alt = expr.substr(pos, end - pos);
+      if(alt.find_first_not_of(" \t") != std::string::npos)
+         mAlternatives.push_back(parse(alt));
+      pos = end + 1;
+   }
+}
+
+EnumFilter::Term EnumFilter::parse(const std::string& expr)
+{
+   Term t = { -1, -1, -1, std::string(), true };
+
+   // Split terms
+   size_t pos = 0;
+   while(pos < expr.size() && t.valid) {
+      size_t end = expr.find(',', pos);
+      if(end == std::string::npos)
+         end = expr.size();
+      std::string term = expr.substr(pos, end - pos);
+      pos = end + 1;
+
+      // Trim whitespace
+      size_t first = term.find_first_not_of(" \t");
+      if(first == std::string::npos)
+         continue;
+      term = term.substr(first, term.find_last_not_of(" \t") - first + 1);
+
+      // Parse key=value or vid:pid
+      char* endp = NULL;
+      size_t eq = term.find('=');
+      size_t colon = term.find(':');
+      if(eq != std::string::npos) {
+         std::string key = term.substr(0, eq);
+         std::string val = term.substr(eq + 1);
+         if(key == "serial") {
+            t.serial = val;
+            t.valid = !val.empty();
+            continue;
+         }
+         int base = (key == "bus") ? 10 : 16;
+         long num = strtol(val.c_str(), &endp, base);
+         t.valid = !val.empty() && *endp == '\0' && num >= 0;
+         if(key == "vid")      t.vid = num;
+         else if(key == "pid") t.pid = num;
+         else if(key == "bus") t.bus = num;
+         else t.valid = false;
+      }
+      else if(colon != std::string::npos) {
+         t.vid = strtol(term.c_str(), &endp, 16);
+         t.valid = (endp == term.c_str() + colon);
+         if(t.valid && colon + 1 < term.size()) {
+            t.pid = strtol(term.c_str() + colon + 1, &endp, 16);
+            t.valid = (*endp == '\0');
+         }
+      }
+      else
+         t.valid = false;
+   }
+
+   if(!t.valid)
+      error_msg("EnumCache: invalid device filter '%s'", expr.c_str());
+
+   return t;
+}
+
+bool EnumFilter::match(const EnumDevice& dev) const
+{
+   if(mAlternatives.empty())
+      return true;
+
+   std::vector<Term>::const_iterator t;
+   for(t = mAlternatives.begin(); t != mAlternatives.end(); ++t) {
+      if(t->valid &&
+         (t->vid < 0 || (unsigned) t->vid == dev.vid) &&
+         (t->pid < 0 || (unsigned) t->pid == dev.pid) &&
+         (t->bus < 0 || (unsigned) t->bus == dev.bus) &&
+         (t->serial.empty() || t->serial == dev.serial))
+         return true;
+   }
+
+   return false;
+}
+
+void EnumSnapshot::loadSerials(UsbBackend* backend)
+{
+   // Map bus and device number to serial
+   SerialMap serials;
+   backend->serials(serials);
+
+   // Assign
+   std::vector<EnumBus>::iterator b;
+   std::vector<EnumDevice>::iterator d;
+   for(b = busses.begin(); b != busses.end(); ++b) {
+      for(d = b->devices.begin(); d != b->devices.end(); ++d)
+         d->serial = serials[std::make_pair(d->bus, d->devnum)];
+   }
+}
+
+void EnumSnapshot::encode(Packet& pkt, const EnumFilter& filter) const
+{
+   pkt.addInt32(result);
+
+   std::vector<EnumBus>::const_iterator b;
+   std::vector<EnumDevice>::const_iterator d;
+   for(b = busses.begin(); b != busses.end(); ++b) {
+
+      // Skip busses without matching device
+      if(!filter.empty()) {
+         for(d = b->devices.begin(); d != b->devices.end(); ++d) {
+            if(filter.match(*d))
+               break;
+         }
+         if(d == b->devices.end())
+            continue;
+      }
+
+      // Add bus and matching encoded devices
+      Struct block = pkt.writeBlock(StructureType);
+      block.addString(b->dirname.c_str());
+      block.addUInt32(b->location);
+      for(d = b->devices.begin(); d != b->devices.end(); ++d) {
+         if(filter.match(*d))
+            block.append(d->block.data(), d->block.size());
+      }
+
+      block.finalize();
+   }
+}
+
+EnumCache::EnumCache(UsbService* service)
+   : mService(service), mStamp(0), mTtl(1000), mGeneration(0), mValid(false),
+     mScanning(false), mJoinable(false)
+{
+   pthread_mutex_init(&mLock, NULL);
+
+   // Watch bus directories, fall back to TTL only
+   mNotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+   if(mNotify >= 0 && inotify_add_watch(mNotify, USBFS_PATH, IN_CREATE|IN_DELETE|IN_ONLYDIR) >= 0) {
+      DIR* dir = opendir(USBFS_PATH);
+      while(dir != NULL) {
+         dirent* e = readdir(dir);
+         if(e == NULL)
+            break;
+         if(e->d_name[0] != '.')
+            watch(e->d_name);
+      }
+      if(dir != NULL)
+         closedir(dir);
+   }
+   else if(mNotify >= 0) {
+      debug_msg("can't watch %s, snapshot expires by TTL only", USBFS_PATH);
+      close(mNotify);
+      mNotify = -1;
+   }
+}
+
+EnumCache::~EnumCache()
+{
+   if(mJoinable)
+      pthread_join(mThread, NULL);
+   if(mNotify >= 0)
+      close(mNotify);
+   pthread_mutex_destroy(&mLock);
+}
+
+void EnumCache::setTtl(unsigned ms)
+{
+   pthread_mutex_lock(&mLock);
+   mTtl = ms;
+   pthread_mutex_unlock(&mLock);
+}
+
+void EnumCache::watch(const char* path)
+{
+   std::string bus(USBFS_PATH "/");
+   bus += path;
+   inotify_add_watch(mNotify, bus.c_str(), IN_CREATE|IN_DELETE|IN_ONLYDIR);
+}
+
+void EnumCache::poll()
+{
+   if(mNotify < 0)
+      return;
+
+   // Drain notifications
+   bool changed = false;
+   char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+   ssize_t len = 0;
+   while((len = read(mNotify, buf, sizeof(buf))) > 0) {
+      for(char* ptr = buf; ptr < buf + len; ) {
+         inotify_event* ev = (inotify_event*) ptr;
+
+         // New bus directory
+         if((ev->mask & IN_CREATE) && (ev->mask & IN_ISDIR) && ev->len > 0)
+            watch(ev->name);
+
+         changed = true;
+         ptr += sizeof(inotify_event) + ev->len;
+      }
+   }
+
+   if(changed)
+      invalidate();
+}
+
+void EnumCache::invalidate()
+{
+   pthread_mutex_lock(&mLock);
+   mValid = false;
+   ++mGeneration;
+   pthread_mutex_unlock(&mLock);
+}
+
+void EnumCache::request(int fd, const std::string& filter)
+{
+   poll();
+
+   // Answer from valid snapshot
+   pthread_mutex_lock(&mLock);
+   if(mValid && now_ms() - mStamp < mTtl) {
+      answer(fd, filter);
+      pthread_mutex_unlock(&mLock);
+      return;
+   }
+
+   // Wait for scan, start one if not running
+   mWaiters.push_back(Waiter(fd, filter));
+   bool start = !mScanning;
+   mScanning = true;
+   pthread_mutex_unlock(&mLock);
+   if(!start)
+      return;
+
+   // Previous scan thread is finished
+   if(mJoinable)
+      pthread_join(mThread, NULL);
+   mJoinable = (pthread_create(&mThread, NULL, &EnumCache::run, this) == 0);
+   if(!mJoinable)
+      scan();
+}
+
+void EnumCache::answer(int fd, const std::string& filter)
+{
+   // Unfiltered response is encoded once
+   if(filter.empty()) {
+      ByteBuffer frame(mFrame);
+      mService->reply(fd, frame);
+      return;
+   }
+
+   Packet pkt(UsbFindDevices);
+   mSnapshot.encode(pkt, EnumFilter(filter));
+   mService->reply(fd, pkt);
+}
+
+void EnumCache::cancel(int fd)
+{
+   pthread_mutex_lock(&mLock);
+   std::list<Waiter>::iterator i = mWaiters.begin();
+   while(i != mWaiters.end()) {
+      if(i->first == fd)
+         i = mWaiters.erase(i);
+      else
+         ++i;
+   }
+   pthread_mutex_unlock(&mLock);
+}
+
+void* EnumCache::run(void* arg)
+{
+   ((EnumCache*) arg)->scan();
+   return NULL;
+}
+
+void EnumCache::scan()
+{
+   pthread_mutex_lock(&mLock);
+   unsigned gen = mGeneration;
+   pthread_mutex_unlock(&mLock);
+
+   // Scan and encode
+   EnumSnapshot snapshot;
+   mService->scan_devices(snapshot);
+   snapshot.loadSerials(mService->mBackend);
+   Packet pkt(UsbFindDevices);
+   snapshot.encode(pkt, EnumFilter());
+   ByteBuffer frame;
+   pkt.take(frame);
+
+   // Store snapshot, stale if invalidated meanwhile
+   pthread_mutex_lock(&mLock);
+   mSnapshot.busses.swap(snapshot.busses);
+   mSnapshot.result = snapshot.result;
+   mFrame.swap(frame);
+   mStamp = now_ms();
+   mValid = (gen == mGeneration);
+   mScanning = false;
+
+   // Answer waiting clients
+   debug_msg("scanned for %d clients", (int) mWaiters.size());
+   std::list<Waiter>::iterator i;
+   for(i = mWaiters.begin(); i != mWaiters.end(); ++i)
+      answer(i->first, i->second);
+   mWaiters.clear();
+   pthread_mutex_unlock(&mLock);
+}
+
+/** @} */
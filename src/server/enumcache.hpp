@@ -0,0 +1,172 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file enumcache.hpp
+    \brief Shared enumeration snapshot.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __enumcache_hpp__
+#define __enumcache_hpp__
+#include "protocol.hpp"
+#include <list>
+#include <vector>
+#include <string>
+#include <pthread.h>
+using namespace Proto;
+
+class UsbService;
+class UsbBackend;
+
+/** Device of enumeration snapshot with its encoded block. */
+struct EnumDevice
+{
+   unsigned bus;
+   unsigned devnum;
+   unsigned vid;
+   unsigned pid;
+   std::string serial;
+   ByteBuffer block; // Encoded device, configurations and endpoints
+};
+
+/** Bus of enumeration snapshot. */
+struct EnumBus
+{
+   std::string dirname;
+   unsigned location;
+   std::vector<EnumDevice> devices;
+};
+
+/** Device filter expression.
+  * Alternatives are separated by ';', each is a comma separated list
+  * of terms that must all match: vid=0403, pid=6001, bus=1, serial=A1B2
+  * or lsusb-like vid:pid shorthand (0403:6001). Numbers are hexadecimal
+  * for vid and pid, decimal for bus. Empty filter matches all devices,
+  * invalid alternative matches none.
+  */
+class EnumFilter
+{
+   public:
+   EnumFilter(const std::string& expr = std::string());
+
+   /** Return true if filter matches all devices. */
+   bool empty() const { return mAlternatives.empty(); }
+
+   /** Return true if device matches. */
+   bool match(const EnumDevice& dev) const;
+
+   private:
+   struct Term {
+      int vid, pid, bus; // -1 matches any
+      std::string serial; // Empty matches any
+      bool valid;
+   };
+
+   /** Parse single alternative. */
+   static Term parse(const std::string& expr);
+
+   std::vector<Term> mAlternatives;
+};
+
+/** Scanned busses and devices. */
+struct EnumSnapshot
+{
+   int result; // usb_find_devices() result
+   std::vector<EnumBus> busses;
+
+   /** Read serial numbers from device backend. */
+   void loadSerials(UsbBackend* backend);
+
+   /** Encode UsbFindDevices response with matching devices.
+     * Busses without matching devices are left out if filtered.
+     */
+   void encode(Packet& pkt, const EnumFilter& filter) const;
+};
+
+/** Enumeration snapshot shared by all clients.
+  * Snapshot is answered from memory until it expires (TTL) or device
+  * nodes under /dev/bus/usb change. Only one scan runs at a time, in its
+  * own thread, and requests arriving meanwhile wait for its result.
+  * Unfiltered response is kept encoded, filtered responses are assembled
+  * from encoded device blocks.
+  */
+class EnumCache
+{
+   public:
+   EnumCache(UsbService* service);
+
+   /** Wait for running scan. */
+   ~EnumCache();
+
+   /** Set snapshot lifetime in milliseconds, 0 scans for each request. */
+   void setTtl(unsigned ms);
+
+   /** Answer enumeration request from snapshot or after next scan.
+     * \param filter device filter expression, empty for all devices
+     */
+   void request(int fd, const std::string& filter = std::string());
+
+   /** Forget waiting client. */
+   void cancel(int fd);
+
+   /** Expire snapshot. */
+   void invalidate();
+
+   private:
+
+   /** Check hotplug notifications, expire snapshot on change. */
+   void poll();
+
+   /** Watch bus directory for device nodes. */
+   void watch(const char* path);
+
+   /** Scan busses, store snapshot and answer waiting clients. */
+   void scan();
+
+   /** Send snapshot to client, lock must be held. */
+   void answer(int fd, const std::string& filter);
+
+   /** Scan thread entry. */
+   static void* run(void* arg);
+
+   UsbService* mService;
+   pthread_mutex_t mLock;
+
+   // Snapshot
+   EnumSnapshot mSnapshot;
+   ByteBuffer mFrame; // Unfiltered response
+   long long mStamp;
+   unsigned mTtl;
+   unsigned mGeneration; // Bumped on invalidation
+   bool mValid;
+
+   // Scan
+   typedef std::pair<int, std::string> Waiter; // Client fd, filter
+   std::list<Waiter> mWaiters;
+   pthread_t mThread;
+   bool mScanning;
+   bool mJoinable;
+
+   // Hotplug
+   int mNotify;
+};
+
+#endif // __enumcache_hpp__
+/** @} */
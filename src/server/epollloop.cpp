@@ -0,0 +1,422 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file epollloop.cpp
+    \brief Linux epoll event engine.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "epollloop.hpp"
+#include "serversocket.hpp"
+#include "common.h"
+#include <vector>
+#include <deque>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+/* Event batch and receive chunk size. */
+#define EPOLL_EVENTS  256
+#define EPOLL_RECVBUF 16384
+
+/* Zero-copy send, frame is pinned until kernel completion. */
+struct Pinned
+{
+   uint32_t seq; // Last zero-copy send of frame
+   ByteBuffer buf;
+};
+
+/* Client connection state. */
+struct EpollConn
+{
+   EpollConn(int fd, unsigned id, size_t limit)
+      : conn(fd, id, limit), pos(0), zerocopy(false), zc_front(false),
+        zc_next(0), zc_done(0), dead(false) {
+   }
+
+   Connection conn;
+   std::deque<ByteBuffer> out; // Unsent frames
+   size_t pos;                 // Sent offset in first frame
+   bool zerocopy;              // SO_ZEROCOPY enabled
+   bool zc_front;              // First frame was partially sent with zero-copy
+   uint32_t zc_next;           // Next zero-copy send id
+   uint32_t zc_done;           // All sends before this id completed
+   std::deque<Pinned> pinned;  // Sent frames waiting for completion
+   bool dead;                  // Disconnect after current event
+};
+
+class EpollLoop::Private
+{
+   public:
+   Private(EpollLoop* loop)
+      : q(loop), ep(-1), timer(-1), next_id(0)
+   {}
+
+   EpollLoop* q;
+   int ep;
+   int timer;
+
+   // Connections indexed by fd
+   std::vector<EpollConn*> conns;
+   unsigned next_id;
+
+   /* Events. */
+   void onAccept();
+   void onRead(EpollConn* c);
+   void onWrite(EpollConn* c);
+   void onError(EpollConn* c);
+   void onTimer();
+
+   /* Connections. */
+   void disconnect(EpollConn* c);
+};
+
+void EpollLoop::Private::onAccept()
+{
+   // Edge-triggered, accept whole backlog
+   for(;;) {
+      int fd = accept4(q->server()->sock(), NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+      if(fd < 0) {
+         if(errno == EINTR || errno == ECONNABORTED)
+            continue;
+         if(errno != EAGAIN && errno != EWOULDBLOCK)
+            error_msg("Server: accept failed: %s", strerror(errno));
+         break;
+      }
+
+      // Register client
+      EpollConn* c = new EpollConn(fd, ++next_id, q->server()->maxFrame());
+      epoll_event ev;
+      ev.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+      ev.data.u64 = ((uint64_t) c->conn.id() << 32) | (uint32_t) fd;
+      if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+         error_msg("Server: epoll_ctl failed: %s", strerror(errno));
+         close(fd);
+         delete c;
+         continue;
+      }
+
+      // Large frames are sent with zero-copy if supported
+      int one = 1;
+      c->zerocopy = (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0);
+
+      if((size_t) fd >= conns.size())
+         conns.resize(fd + 1, NULL);
+      conns[fd] = c;
+      log_msg("Server: client connected (socket fd %d)", fd);
+   }
+}
+
+void EpollLoop::Private::onRead(EpollConn* c)
+{
+   // Edge-triggered, drain socket
+   char buf[EPOLL_RECVBUF];
+   int fd = c->conn.fd();
+   bool eof = false;
+   for(;;) {
+      ssize_t len = ::recv(fd, buf, sizeof(buf), 0);
+      if(len > 0) {
+         c->conn.feed(buf, len);
+         if(c->conn.oversized())
+            break;
+         continue;
+      }
+      if(len < 0 && errno == EINTR)
+         continue;
+
+      // EOF or error
+      if(len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+         eof = true;
+      break;
+   }
+
+   // Handle complete packets, including those received before EOF
+   Packet pkt;
+   while(!c->dead && c->conn.next(pkt))
+      q->handle(fd, pkt);
+
+   if(eof || c->conn.oversized())
+      c->dead = true;
+}
+
+void EpollLoop::Private::onWrite(EpollConn* c)
+{
+   // Flush queued frames
+   while(!c->out.empty()) {
+      ByteBuffer& frame = c->out.front();
+      bool zc = c->zerocopy && frame.size() >= ZeroCopyMin;
+      int flags = MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0);
+      ssize_t len = ::send(c->conn.fd(), frame.data() + c->pos, frame.size() - c->pos, flags);
+      if(len < 0) {
+         if(errno == EINTR)
+            continue;
+         if(errno == ENOBUFS && zc) {
+            c->zerocopy = false; // Pinned memory limit, copy instead
+            continue;
+         }
+         if(errno != EAGAIN && errno != EWOULDBLOCK)
+            c->dead = true;
+         return;
+      }
+
+      // Each zero-copy send is completed separately
+      if(zc) {
+         ++c->zc_next;
+         c->zc_front = true;
+      }
+
+      c->pos += len;
+      if(c->pos < frame.size())
+         continue;
+
+      // Frame sent, zero-copy frame is held until completion
+      if(c->zc_front) {
+         Pinned p;
+         p.seq = c->zc_next - 1;
+         c->pinned.push_back(p);
+         c->pinned.back().buf.swap(frame);
+      }
+      c->out.pop_front();
+      c->pos = 0;
+      c->zc_front = false;
+   }
+}
+
+void EpollLoop::Private::onError(EpollConn* c)
+{
+   // Read zero-copy completions
+   int fd = c->conn.fd();
+   for(;;) {
+      char control[128];
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if(recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+         if(errno == EINTR)
+            continue;
+         break;
+      }
+
+      for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+         if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+            !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            continue;
+         sock_extended_err* err = (sock_extended_err*) CMSG_DATA(cm);
+         if(err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+
+         // Range of completed sends [ee_info, ee_data]
+         if((int32_t) (err->ee_data + 1 - c->zc_done) > 0)
+            c->zc_done = err->ee_data + 1;
+
+         // Kernel copied data anyway (e.g. loopback), stop pinning
+         if(err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            c->zerocopy = false;
+      }
+   }
+
+   // Release completed frames
+   while(!c->pinned.empty() && (int32_t) (c->pinned.front().seq - c->zc_done) < 0)
+      c->pinned.pop_front();
+
+   // Socket error
+   int err = 0;
+   socklen_t len = sizeof(err);
+   if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+      c->dead = true;
+}
+
+void EpollLoop::Private::onTimer()
+{
+   // Consume expirations
+   uint64_t n = 0;
+   if(::read(timer, &n, sizeof(n)) < 0)
+      return;
+
+   // Release memory held by idle clients
+   for(size_t i = 0; i < conns.size(); ++i) {
+      if(conns[i] != NULL)
+         conns[i]->conn.trim();
+   }
+
+   q->housekeeping();
+}
+
+void EpollLoop::Private::disconnect(EpollConn* c)
+{
+   int fd = c->conn.fd();
+   log_msg("Server: client disconnected (socket fd %d)", fd);
+   conns[fd] = NULL;
+   q->disconnected(fd);
+
+   // Closing descriptor removes it from epoll set
+   close(fd);
+   delete c;
+}
+
+EpollLoop::EpollLoop(ServerSocket* server)
+   : EventLoop(server), d(new Private(this))
+{
+}
+
+EpollLoop::~EpollLoop()
+{
+   // Close clients
+   for(size_t i = 0; i < d->conns.size(); ++i) {
+      if(d->conns[i] != NULL)
+         d->disconnect(d->conns[i]);
+   }
+
+   if(d->timer >= 0)
+      close(d->timer);
+   if(d->ep >= 0)
+      close(d->ep);
+   delete d;
+}
+
+bool EpollLoop::init()
+{
+   // Create epoll instance
+   if((d->ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+      debug_msg("epoll_create1: %s", strerror(errno));
+      return false;
+   }
+
+   // Create housekeeping timer
+   if((d->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+      debug_msg("timerfd_create: %s", strerror(errno));
+      return false;
+   }
+
+   itimerspec ts;
+   ts.it_interval.tv_sec = HousekeepingInterval / 1000;
+   ts.it_interval.tv_nsec = (HousekeepingInterval % 1000) * 1000000;
+   ts.it_value = ts.it_interval;
+   if(timerfd_settime(d->timer, 0, &ts, NULL) < 0)
+      return false;
+
+   // Watch server socket and timer
+   int sock = server()->sock();
+   fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+   epoll_event ev;
+   ev.events = EPOLLIN|EPOLLET;
+   ev.data.u64 = (uint32_t) sock;
+   if(epoll_ctl(d->ep, EPOLL_CTL_ADD, sock, &ev) < 0)
+      return false;
+
+   ev.events = EPOLLIN;
+   ev.data.u64 = (uint32_t) d->timer;
+   if(epoll_ctl(d->ep, EPOLL_CTL_ADD, d->timer, &ev) < 0)
+      return false;
+
+   ev.events = EPOLLIN;
+   ev.data.u64 = (uint32_t) wakefd();
+   if(epoll_ctl(d->ep, EPOLL_CTL_ADD, wakefd(), &ev) < 0)
+      return false;
+
+   return true;
+}
+
+void EpollLoop::run()
+{
+   log_msg("Server: listening on fd %d", server()->sock());
+
+   // Process event loop
+   epoll_event events[EPOLL_EVENTS];
+   while(server()->isOpen()) {
+
+      // Wait without timeout, close() wakes the engine up
+      int n = epoll_wait(d->ep, events, EPOLL_EVENTS, -1);
+      if(n < 0) {
+         if(errno == EINTR)
+            continue;
+         error_msg("Server: epoll_wait failed: %s", strerror(errno));
+         break;
+      }
+
+      for(int i = 0; i < n; ++i) {
+         int fd = (int) (events[i].data.u64 & 0xffffffff);
+         unsigned id = events[i].data.u64 >> 32;
+
+         // Server socket, timer and posted responses
+         if(id == 0) {
+            if(fd == server()->sock())
+               d->onAccept();
+            else if(fd == d->timer)
+               d->onTimer();
+            else if(fd == wakefd())
+               drain();
+            continue;
+         }
+
+         // Stale event for already closed descriptor
+         if((size_t) fd >= d->conns.size() || d->conns[fd] == NULL)
+            continue;
+         EpollConn* c = d->conns[fd];
+         if(c->conn.id() != id)
+            continue;
+
+         // Process readiness
+         uint32_t ev = events[i].events;
+         if(ev & EPOLLERR)
+            d->onError(c);
+         if(ev & EPOLLOUT)
+            d->onWrite(c);
+         if(ev & (EPOLLIN|EPOLLRDHUP|EPOLLHUP))
+            d->onRead(c);
+         if(ev & EPOLLHUP)
+            c->dead = true;
+
+         // Disconnect
+         if(c->dead)
+            d->disconnect(c);
+      }
+   }
+}
+
+int EpollLoop::send(int fd, ByteBuffer& frame)
+{
+   if(fd < 0 || (size_t) fd >= d->conns.size() || d->conns[fd] == NULL)
+      return -1;
+
+   EpollConn* c = d->conns[fd];
+   if(c->dead)
+      return -1;
+
+   // Queue frame without copying, keep ordering behind queued frames
+   int size = frame.size();
+   c->out.push_back(ByteBuffer());
+   c->out.back().swap(frame);
+   if(c->out.size() > 1)
+      return size;
+
+   // Send directly, remainder is sent when socket is writable
+   d->onWrite(c);
+   return c->dead ? -1 : size;
+}
+
+/** @} */
@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file epollloop.hpp
+    \brief Linux epoll event engine.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __epollloop_hpp__
+#define __epollloop_hpp__
+#include "eventloop.hpp"
+
+/** Linux epoll event engine.
+  * Non-blocking sockets with edge-triggered readiness, connections
+  * are indexed by descriptor for O(1) add and remove.
+  * Responses that don't fit into socket buffer are queued and flushed
+  * on writability, housekeeping is driven by timerfd so idle server
+  * doesn't wake up at all.
+  */
+class EpollLoop : public EventLoop
+{
+   public:
+   EpollLoop(ServerSocket* server);
+   ~EpollLoop();
+
+   const char* name() { return "epoll"; }
+   bool init();
+   void run();
+   int send(int fd, ByteBuffer& frame);
+
+   private:
+
+   /* Opaque pointer */
+   class Private;
+   Private* d;
+};
+
+#endif // __epollloop_hpp__
+/** @} */
@@ -0,0 +1,220 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file eventloop.cpp
+    \brief Event engine interface and client connection framing.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "eventloop.hpp"
+#include "serversocket.hpp"
+#include "pollloop.hpp"
+#include "epollloop.hpp"
+#include "uringloop.hpp"
+#include "common.h"
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+
+void Connection::feed(const char* data, size_t size)
+{
+   if(mOversized)
+      return;
+
+   // Drop consumed data before growing buffer
+   if(mPos > 0 && mPos == mIn.size()) {
+      mIn.clear();
+      mPos = mChecked = 0;
+   }
+
+   mIn.append(data, size);
+
+   // Check announced sizes before frames are buffered whole
+   while(mLimit > 0) {
+      size_t avail = mIn.size() - mChecked;
+      size_t fsize = Packet::frameSize(mIn.data() + mChecked, avail);
+      if(fsize > mLimit) {
+         error_msg("Server: %u B frame over %u B limit on socket fd %d", (unsigned) fsize, (unsigned) mLimit, mFd);
+         ByteBuffer().swap(mIn);
+         mPos = mChecked = 0;
+         mOversized = true;
+         return;
+      }
+      if(fsize == 0 || fsize > avail)
+         break;
+      mChecked += fsize;
+   }
+}
+
+bool Connection::next(Packet& pkt)
+{
+   if(mOversized)
+      return false;
+
+   // Check complete frame
+   size_t avail = mIn.size() - mPos;
+   size_t fsize = Packet::frameSize(mIn.data() + mPos, avail);
+   if(fsize == 0 || fsize > avail)
+      return false;
+
+   // Extract frame
+   pkt.assign(mIn.data() + mPos, fsize);
+   mPos += fsize;
+
+   // Compact buffer
+   if(mPos == mIn.size()) {
+      mIn.clear();
+      mPos = mChecked = 0;
+   }
+   else if(mPos > mIn.size() / 2) {
+      mIn.erase(0, mPos);
+      mChecked = (mChecked > mPos) ? mChecked - mPos : 0;
+      mPos = 0;
+   }
+
+   return true;
+}
+
+void Connection::trim()
+{
+   // Give buffer back to allocator
+   if(pending() == 0) {
+      ByteBuffer().swap(mIn);
+      mPos = mChecked = 0;
+   }
+}
+
+EventLoop::EventLoop(ServerSocket* server)
+   : mServer(server), mPostedBytes(0)
+{
+   pthread_mutex_init(&mLock, NULL);
+   mWake = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+}
+
+EventLoop::~EventLoop()
+{
+   if(mWake >= 0)
+      close(mWake);
+   pthread_mutex_destroy(&mLock);
+}
+
+void EventLoop::post(int fd, unsigned session, ByteBuffer& frame)
+{
+   pthread_mutex_lock(&mLock);
+   mPostedBytes += frame.size();
+   mPosted.push_back(Posted());
+   mPosted.back().fd = fd;
+   mPosted.back().session = session;
+   mPosted.back().frame.swap(frame);
+   pthread_mutex_unlock(&mLock);
+
+   // Wake up engine
+   wake();
+}
+
+void EventLoop::wake()
+{
+   uint64_t one = 1;
+   if(write(mWake, &one, sizeof(one)) < 0)
+      error_msg("Server: failed to wake up event engine");
+}
+
+void EventLoop::backlog(unsigned& frames, size_t& bytes)
+{
+   pthread_mutex_lock(&mLock);
+   frames = mPosted.size();
+   bytes = mPostedBytes;
+   pthread_mutex_unlock(&mLock);
+}
+
+void EventLoop::drain()
+{
+   // Reset wakeup counter
+   uint64_t n = 0;
+   if(read(mWake, &n, sizeof(n)) < 0 && errno != EAGAIN)
+      return;
+
+   // Take posted frames
+   std::deque<Posted> posted;
+   pthread_mutex_lock(&mLock);
+   posted.swap(mPosted);
+   mPostedBytes = 0;
+   pthread_mutex_unlock(&mLock);
+
+   // Deliver in order, skip frames to ended sessions
+   for(std::deque<Posted>::iterator it = posted.begin(); it != posted.end(); ++it) {
+      if(mServer->session(it->fd) == it->session)
+         send(it->fd, it->frame);
+   }
+}
+
+bool EventLoop::handle(int fd, Packet& pkt)
+{
+   // Request deadlines are relative to arrival
+   pkt.setStamp(now_us());
+   return mServer->handle(fd, pkt);
+}
+
+void EventLoop::housekeeping()
+{
+   mServer->housekeeping();
+}
+
+void EventLoop::disconnected(int fd)
+{
+   mServer->disconnected(fd);
+   mServer->endSession(fd);
+}
+
+EventLoop* EventLoop::create(const std::string& name, ServerSocket* server)
+{
+   // Engines in order of preference
+   EventLoop* engines[] = { new UringLoop(server), new EpollLoop(server), new PollLoop(server) };
+   const unsigned count = sizeof(engines) / sizeof(EventLoop*);
+
+   // Pick requested engine first, then fall back to first supported
+   EventLoop* engine = NULL;
+   bool tried[count] = { false };
+
+   for(unsigned pass = 0; pass < 2 && engine == NULL; ++pass) {
+      for(unsigned i = 0; i < count && engine == NULL; ++i) {
+
+         // Requested engine only in first pass
+         if(tried[i] || (pass == 0 && name != "auto" && name != engines[i]->name()))
+            continue;
+
+         tried[i] = true;
+         if(engines[i]->wakefd() >= 0 && engines[i]->init())
+            engine = engines[i];
+         else
+            log_msg("Server: %s event engine not supported", engines[i]->name());
+      }
+   }
+
+   // Free unused engines
+   for(unsigned i = 0; i < count; ++i) {
+      if(engines[i] != engine)
+         delete engines[i];
+   }
+
+   return engine;
+}
+
+/** @} */
@@ -0,0 +1,174 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file eventloop.hpp
+    \brief Event engine interface and client connection framing.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __eventloop_hpp__
+#define __eventloop_hpp__
+#include "protocol.hpp"
+#include <string>
+#include <deque>
+#include <pthread.h>
+using namespace Proto;
+
+class ServerSocket;
+
+/** Client connection with incoming frame reassembly.
+  * Engines feed received bytes and extract complete packets.
+  */
+class Connection
+{
+   public:
+   /** \param limit largest accepted frame size, 0 for no limit */
+   Connection(int fd, unsigned id = 0, size_t limit = 0)
+      : mFd(fd), mId(id), mPos(0), mChecked(0), mLimit(limit), mOversized(false) {
+   }
+
+   /** Return client socket descriptor. */
+   int fd() { return mFd; }
+
+   /** Return connection identifier (unique for engine lifetime). */
+   unsigned id() { return mId; }
+
+   /** Append received data, frame sizes are checked against limit. */
+   void feed(const char* data, size_t size);
+
+   /** Extract next complete packet.
+     * \return true if packet was extracted
+     */
+   bool next(Packet& pkt);
+
+   /** Return true if client announced frame over limit,
+     * no further packets are extracted and client should be disconnected.
+     */
+   bool oversized() { return mOversized; }
+
+   /** Return number of buffered bytes. */
+   size_t pending() { return mIn.size() - mPos; }
+
+   /** Release buffer memory if no data is pending. */
+   void trim();
+
+   private:
+   int mFd;
+   unsigned mId;
+   size_t mPos;
+   size_t mChecked; // Start of first frame with unchecked size
+   size_t mLimit;
+   bool mOversized;
+   ByteBuffer mIn;
+};
+
+/** Event engine driving ServerSocket.
+  * Engine accepts clients, reassembles incoming packets,
+  * passes them to server handler and delivers responses.
+  * Responses from other threads are posted to a queue and
+  * delivered by the engine thread when woken up.
+  */
+class EventLoop
+{
+   public:
+   EventLoop(ServerSocket* server);
+   virtual ~EventLoop();
+
+   /** Housekeeping period in milliseconds,
+     * minimum frame size sent with zero-copy (smaller frames are cheaper to copy).
+     */
+   enum {
+      HousekeepingInterval = 5000,
+      ZeroCopyMin = 32768
+   };
+
+   /** Return engine name. */
+   virtual const char* name() = 0;
+
+   /** Prepare engine resources.
+     * \return false if engine is not supported on this system
+     */
+   virtual bool init() = 0;
+
+   /** Process events until server socket is closed. */
+   virtual void run() = 0;
+
+   /** Deliver encoded frame to client, engine thread only.
+     * Engine may take over frame contents.
+     * \return number of bytes queued or sent, -1 on error
+     */
+   virtual int send(int fd, ByteBuffer& frame) = 0;
+
+   /** Queue encoded frame for delivery from engine thread.
+     * Safe to call from any thread, frame contents are taken over.
+     * Frame is dropped if the client session ends meanwhile.
+     * \see ServerSocket::session()
+     */
+   void post(int fd, unsigned session, ByteBuffer& frame);
+
+   /** Return number and size of posted frames not delivered yet. */
+   void backlog(unsigned& frames, size_t& bytes);
+
+   /** Interrupt engine waiting for events, safe from signal handlers. */
+   void wake();
+
+   /** Create engine by name ("auto", "uring", "epoll", "poll").
+     * Automatic selection falls back to the first supported engine.
+     * \return initialized engine or NULL
+     */
+   static EventLoop* create(const std::string& name, ServerSocket* server);
+
+   protected:
+
+   /** Pass incoming packet to server handler. */
+   bool handle(int fd, Packet& pkt);
+
+   /** Run periodic server maintenance. */
+   void housekeeping();
+
+   /** Notify server of client disconnect, call before closing socket. */
+   void disconnected(int fd);
+
+   /** Return descriptor signalled when frames are posted. */
+   int wakefd() { return mWake; }
+
+   /** Deliver posted frames. */
+   void drain();
+
+   /** Return served socket. */
+   ServerSocket* server() { return mServer; }
+
+   private:
+   ServerSocket* mServer;
+
+   // Posted frames
+   struct Posted {
+      int fd;
+      unsigned session;
+      ByteBuffer frame;
+   };
+   std::deque<Posted> mPosted;
+   size_t mPostedBytes;
+   pthread_mutex_t mLock;
+   int mWake;
+};
+
+#endif // __eventloop_hpp__
+/** @} */
@@ -0,0 +1,104 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file handletable.cpp
+    \brief Dense table of open device handles.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "handletable.hpp"
+
+int HandleTable::insert(usb_dev_handle* h, int owner)
+{
+   // Reuse free slot or grow
+   unsigned idx = 0;
+   if(!mFree.empty()) {
+      idx = mFree.back();
+      mFree.pop_back();
+   }
+   else {
+      if(mSlots.size() >= MaxSlots)
+         return -1;
+      Slot slot = { NULL, -1, 1 };
+      idx = mSlots.size();
+      mSlots.push_back(slot);
+   }
+
+   mSlots[idx].handle = h;
+   mSlots[idx].owner = owner;
+   return (mSlots[idx].gen << IndexBits) | idx;
+}
+
+usb_dev_handle* HandleTable::find(int id) const
+{
+   if(id < 0)
+      return NULL;
+
+   // Check index and generation
+   unsigned idx = id & (MaxSlots - 1);
+   if(idx >= mSlots.size() || mSlots[idx].gen != (unsigned) (id >> IndexBits))
+      return NULL;
+
+   return mSlots[idx].handle;
+}
+
+int HandleTable::owner(int id) const
+{
+   if(find(id) == NULL)
+      return -1;
+
+   return mSlots[id & (MaxSlots - 1)].owner;
+}
+
+void HandleTable::setOwner(int id, int owner)
+{
+   if(find(id) != NULL)
+      mSlots[id & (MaxSlots - 1)].owner = owner;
+}
+
+usb_dev_handle* HandleTable::remove(int id)
+{
+   usb_dev_handle* h = find(id);
+   if(h == NULL)
+      return NULL;
+
+   // Invalidate id and free slot
+   unsigned idx = id & (MaxSlots - 1);
+   Slot& slot = mSlots[idx];
+   slot.handle = NULL;
+   slot.owner = -1;
+   slot.gen = (slot.gen < MaxGeneration) ? slot.gen + 1 : 1;
+   mFree.push_back(idx);
+   return h;
+}
+
+std::vector<usb_dev_handle*> HandleTable::clear()
+{
+   std::vector<usb_dev_handle*> handles;
+   for(unsigned idx = 0; idx < mSlots.size(); ++idx) {
+      if(mSlots[idx].handle != NULL)
+         handles.push_back(mSlots[idx].handle);
+   }
+
+   mSlots.clear();
+   mFree.clear();
+   return handles;
+}
+
+/** @} */
@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file handletable.hpp
+    \brief Dense table of open device handles.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __handletable_hpp__
+#define __handletable_hpp__
+#include <usb.h>
+#include <stdint.h>
+#include <vector>
+
+/** Dense table of open device handles.
+  * Handle id encodes slot index and slot generation, lookup is a single
+  * indexed load. Generation is bumped on removal, so ids of closed
+  * devices are rejected even if the slot is reused.
+  * Table is not locked, caller serializes access.
+  */
+class HandleTable
+{
+   public:
+
+   /** Insert handle owned by given client.
+     * \return handle id or -1 if table is full
+     */
+   int insert(usb_dev_handle* h, int owner);
+
+   /** Return handle for id or NULL if id is stale or invalid. */
+   usb_dev_handle* find(int id) const;
+
+   /** Return owner of handle or -1 if id is stale or invalid. */
+   int owner(int id) const;
+
+   /** Change owner of handle. */
+   void setOwner(int id, int owner);
+
+   /** Remove handle.
+     * \return removed handle or NULL if id is stale or invalid
+     */
+   usb_dev_handle* remove(int id);
+
+   /** Remove all handles.
+     * \return removed handles
+     */
+   std::vector<usb_dev_handle*> clear();
+
+   enum {
+      IndexBits = 16,
+      MaxSlots = 1 << IndexBits,
+      MaxGeneration = 0x7fff
+   };
+
+   private:
+
+   struct Slot {
+      usb_dev_handle* handle;
+      int owner;
+      uint16_t gen;
+   };
+
+   std::vector<Slot> mSlots;
+   std::vector<unsigned> mFree;
+};
+
+#endif // __handletable_hpp__
+/** @} */
@@ -0,0 +1,172 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file pollloop.cpp
+    \brief Portable poll() event engine.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "pollloop.hpp"
+#include "serversocket.hpp"
+#include "common.h"
+#include <vector>
+#include <algorithm>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Closed client predicate. */
+static bool is_closed(const pollfd& p) {
+   return p.fd < 0;
+}
+
+PollLoop::PollLoop(ServerSocket* server)
+   : EventLoop(server)
+{
+}
+
+bool PollLoop::init()
+{
+   // Always supported
+   return true;
+}
+
+void PollLoop::run()
+{
+   // Append self to clients vector
+   std::vector<pollfd> clients;
+   std::vector<pollfd>::iterator it;
+   std::vector<pollfd> incoming;
+   struct pollfd self;
+   self.events = POLLIN; // Only reading
+   self.fd = server()->sock(); // Server fd
+   incoming.push_back(self);
+   self.fd = wakefd(); // Posted responses
+   incoming.push_back(self);
+   long long next_housekeeping = now_ms() + HousekeepingInterval;
+
+   // Process event loop
+   while(server()->isOpen()) {
+
+      // Evaluate incoming sockets
+      if(!incoming.empty()) {
+         for(it = incoming.begin(); it != incoming.end(); ++it) {
+            if(it->fd == server()->sock()) {
+               log_msg("Server: listening on fd %d", it->fd);
+            }
+            else if(it->fd != wakefd()) {
+               log_msg("Server: client connected (socket fd %d)", it->fd);
+            }
+            clients.push_back(*it);
+         }
+         incoming.clear();
+      }
+
+      // Poll clients
+      // Contiguity for std::vector is mandated by the standard [See 23.2.4./1]
+      int timeout = next_housekeeping - now_ms();
+      if(poll(&clients[0], clients.size(), timeout > 0 ? timeout : 0) > 0)
+      {
+         // Check server for read
+         bool closed = false;
+         for(it = clients.begin(); it != clients.end(); ++it) {
+
+            // Incoming
+            if(it->revents & POLLIN) {
+
+               // Server socket
+               if(it->fd == clients[0].fd) {
+
+                  struct pollfd client;
+                  client.events = POLLIN;
+                  client.fd = server()->accept();
+                  client.revents = 0;
+
+                  // Accept client
+                  if(client.fd > 0) {
+                     incoming.push_back(client);
+                  }
+               }
+               // Posted responses
+               else if(it->fd == wakefd()) {
+                  drain();
+               }
+               else {
+                  if(!read(it->fd))
+                     it->revents |= POLLHUP;
+               }
+            }
+
+            // Disconnect, removed after scan
+            if(it->revents & POLLHUP) {
+               log_msg("Server: client disconnected (socket fd %d)", it->fd);
+               disconnected(it->fd);
+               close(it->fd);
+               it->fd = -1;
+               closed = true;
+            }
+         }
+
+         // Remove closed clients in one pass
+         if(closed)
+            clients.erase(std::remove_if(clients.begin(), clients.end(), is_closed), clients.end());
+      }
+
+      // Periodic maintenance
+      if(now_ms() >= next_housekeeping) {
+         housekeeping();
+         next_housekeeping = now_ms() + HousekeepingInterval;
+      }
+   }
+}
+
+int PollLoop::send(int fd, ByteBuffer& frame)
+{
+   // Blocking send
+   size_t sent = 0;
+   while(sent < frame.size()) {
+      ssize_t len = ::send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+      if(len < 0) {
+         if(errno == EINTR)
+            continue;
+         return -1;
+      }
+      sent += len;
+   }
+
+   return sent;
+}
+
+bool PollLoop::read(int fd)
+{
+   Packet pkt;
+
+   // Read packet, frames over limit disconnect client
+   if(pkt.recv(fd, server()->maxFrame()) < 0) {
+      return false;
+   }
+
+   // Handle incoming packet
+   handle(fd, pkt);
+
+   return true;
+}
+
+/** @} */
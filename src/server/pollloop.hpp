@@ -0,0 +1,52 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file pollloop.hpp
+    \brief Portable poll() event engine.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __pollloop_hpp__
+#define __pollloop_hpp__
+#include "eventloop.hpp"
+
+/** Portable poll() event engine.
+  * Packets are received and sent with blocking calls.
+  */
+class PollLoop : public EventLoop
+{
+   public:
+   PollLoop(ServerSocket* server);
+
+   const char* name() { return "poll"; }
+   bool init();
+   void run();
+   int send(int fd, ByteBuffer& frame);
+
+   protected:
+
+   /** Receive and handle incoming packet.
+     * \return false on disconnect
+     */
+   bool read(int fd);
+};
+
+#endif // __pollloop_hpp__
+/** @} */
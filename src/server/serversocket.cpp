@@ -23,111 +23,181 @@
     @{
   */
 #include "serversocket.hpp"
+#include "eventloop.hpp"
 #include "common.h"
-#include <sys/poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <vector>
+
+/* Session replies of this thread are bound to. */
+static __thread int tBoundFd = -1;
+static __thread unsigned tBoundSession = 0;
 
 class ServerSocket::Private
 {
    public:
-   std::vector<struct pollfd> clients;
+   std::string engineName;
+   EventLoop* engine;
+   pthread_t thread;      // Engine thread
+   pthread_mutex_t lock;  // Engine lifetime and sessions lock
+   std::vector<unsigned> sessions; // Client sessions by socket
+   size_t maxFrame;       // Request frame limit
 };
 
 ServerSocket::ServerSocket(int fd)
    : Socket(fd), d(new Private)
 {
+   d->engineName = "auto";
+   d->engine = NULL;
+   d->thread = pthread_self();
+   d->maxFrame = 8 << 20;
+   pthread_mutex_init(&d->lock, NULL);
 }
 
 ServerSocket::~ServerSocket()
 {
+   pthread_mutex_destroy(&d->lock);
    delete d;
 }
 
+void ServerSocket::setEngine(const std::string& name)
+{
+   d->engineName = name;
+}
+
 void ServerSocket::run()
 {
-   log_msg("Server: running at %s:%d", host().c_str(), port());
+   // Disable TCP buffering, inherited by accepted clients
+   int flag = 1;
+   setsockopt(sock(), IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+
+   // Create event engine
+   EventLoop* engine = EventLoop::create(d->engineName, this);
+   if(engine == NULL) {
+      error_msg("Server: no usable event engine");
+      return;
+   }
 
-   // Append self to clients vector
-   std::vector<pollfd>::iterator it;
-   std::vector<pollfd> incoming;
-   struct pollfd self;
-   self.events = POLLIN; // Only reading
-   self.fd = sock();     // Server fd
-   incoming.push_back(self);
+   log_msg("Server: running at %s:%d (%s engine)", host().c_str(), port(), engine->name());
+
+   pthread_mutex_lock(&d->lock);
+   d->thread = pthread_self();
+   d->engine = engine;
+   pthread_mutex_unlock(&d->lock);
 
    // Process event loop
-   while(isOpen()) {
-
-      // Evaluate incoming sockets
-      if(!incoming.empty()) {
-         for(it = incoming.begin(); it != incoming.end(); ++it) {
-            if(it->fd == sock()) {
-               log_msg("Server: listening on fd %d", it->fd);
-            }
-            else {
-               log_msg("Server: client connected (socket fd %d)", it->fd);
-            }
-            d->clients.push_back(*it);
-         }
-         incoming.clear();
-      }
-
-      // Poll clients
-      // Contiguity for std::vector is mandated by the standard [See 23.2.4./1]
-      if(poll(&d->clients[0], d->clients.size(), 1000) > 0)
-      {
-         // Check server for read
-         for(it = d->clients.begin(); it != d->clients.end(); ++it) {
-
-            // Incoming
-            if(it->revents & POLLIN) {
-
-               // Server socket
-               if(it->fd == d->clients[0].fd) {
-
-                  struct pollfd client;
-                  client.events = POLLIN;
-                  client.fd = accept();
-                  client.revents = 0;
-
-                  // Accept client
-                  if(client.fd > 0) {
-                     incoming.push_back(client);
-                  }
-               }
-               else {
-                  if(!read(it->fd))
-                     it->revents |= POLLHUP;
-               }
-            }
-
-            // Disconnect
-            if(it->revents & POLLHUP) {
-               log_msg("Server: client disconnected (socket fd %d)", it->fd);
-               d->clients.erase(it);
-               it = d->clients.begin();
-               continue;
-            }
-         }
-      }
-   }
+   engine->run();
 
    // Stop server
+   pthread_mutex_lock(&d->lock);
+   d->engine = NULL;
+   pthread_mutex_unlock(&d->lock);
+   delete engine;
    log_msg("Server: stopped");
 }
 
-bool ServerSocket::read(int fd)
+int ServerSocket::close()
+{
+   int ret = Socket::close();
+
+   // Engine may be blocked waiting for events, no locking here
+   // as the engine is released only after run() returns
+   EventLoop* engine = d->engine;
+   if(engine != NULL)
+      engine->wake();
+
+   return ret;
+}
+
+void ServerSocket::setMaxFrame(size_t bytes)
+{
+   d->maxFrame = bytes;
+}
+
+size_t ServerSocket::maxFrame()
+{
+   return d->maxFrame;
+}
+
+unsigned ServerSocket::session(int fd)
 {
-   Packet pkt;
+   unsigned res = 0;
+   pthread_mutex_lock(&d->lock);
+   if(fd >= 0 && (size_t) fd < d->sessions.size())
+      res = d->sessions[fd];
+   pthread_mutex_unlock(&d->lock);
+   return res;
+}
+
+void ServerSocket::endSession(int fd)
+{
+   pthread_mutex_lock(&d->lock);
+   if((size_t) fd >= d->sessions.size())
+      d->sessions.resize(fd + 1, 0);
+   ++d->sessions[fd];
+   pthread_mutex_unlock(&d->lock);
+}
+
+void ServerSocket::bind(int fd, unsigned session)
+{
+   tBoundFd = fd;
+   tBoundSession = session;
+}
+
+int ServerSocket::reply(int fd, Packet& pkt)
+{
+   ByteBuffer frame;
+   pkt.take(frame);
+   return reply(fd, frame);
+}
 
-   // Read packet
-   if(pkt.recv(fd) < 0) {
-      return false;
+int ServerSocket::reply(int fd, ByteBuffer& frame)
+{
+   // Internal request, no client to respond to
+   if(fd < 0)
+      return 0;
+
+   // Client of bound session is gone, socket may belong to a new one
+   unsigned current = session(fd);
+   unsigned s = (fd == tBoundFd) ? tBoundSession : current;
+   if(s != current) {
+      debug_msg("dropped response to ended session of fd %d", fd);
+      return 0;
    }
 
-   // Handle incoming packet
-   handle(fd, pkt);
+   responded(fd, frame.size());
+
+   // Engine thread, deliver directly
+   if(pthread_equal(d->thread, pthread_self()) && d->engine != NULL)
+      return d->engine->send(fd, frame);
+
+   // Other thread, post to engine
+   bool posted = false;
+   int res = -1;
+   pthread_mutex_lock(&d->lock);
+   if(d->engine != NULL) {
+      res = frame.size();
+      d->engine->post(fd, s, frame);
+      posted = true;
+   }
+   pthread_mutex_unlock(&d->lock);
 
-   return true;
+   // Engine not running
+   if(!posted)
+      res = ::send(fd, frame.data(), frame.size(), MSG_NOSIGNAL);
+
+   return res;
+}
+
+void ServerSocket::backlog(unsigned& frames, size_t& bytes)
+{
+   frames = 0;
+   bytes = 0;
+   pthread_mutex_lock(&d->lock);
+   if(d->engine != NULL)
+      d->engine->backlog(frames, bytes);
+   pthread_mutex_unlock(&d->lock);
 }
 
 /** @} */
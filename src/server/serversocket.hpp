@@ -27,8 +27,11 @@
 #define __serversocket_hpp__
 #include "socket.hpp"
 #include "protocol.hpp"
+#include <string>
 using namespace Proto;
 
+class EventLoop;
+
 /** Server socket reimplementation. */
 class ServerSocket : public Socket
 {
@@ -37,16 +40,58 @@ class ServerSocket : public Socket
    ServerSocket(int fd = -1);
    ~ServerSocket();
 
+   /** Select event engine ("auto", "uring", "epoll", "poll").
+     * Unsupported engine falls back to automatic selection.
+     */
+   void setEngine(const std::string& name);
+
+   /** Set largest accepted request frame, clients sending larger
+     * frames are disconnected. Must be called before run().
+     */
+   void setMaxFrame(size_t bytes);
+
+   /** Return largest accepted request frame. */
+   size_t maxFrame();
+
    /** Run event loop and process client requests.
      */
    void run();
 
+   /** Close server socket and wake up the running event engine,
+     * so run() returns. Safe to call from a signal handler.
+     */
+   int close();
+
+   /** Return session of client socket, changes when the client disconnects.
+     * Socket and session identify the client, as descriptors are reused.
+     */
+   unsigned session(int fd);
+
+   /** Attribute replies to fd from calling thread to given session,
+     * replies to a session that has ended are dropped.
+     * \param fd client socket, -1 unbinds
+     */
+   static void bind(int fd, unsigned session);
+
    protected:
 
-   /** Handle incoming data.
-     * \param fd
+   /** Send response through the running event engine.
+     * Safe to call from worker threads, response is then
+     * posted to the engine thread.
+     * \param fd client socket, responses to negative fd are dropped
+     * \param pkt response packet
      */
-   bool read(int fd);
+   int reply(int fd, Packet& pkt);
+
+   /** Send encoded frame, frame contents are taken over.
+     * \see reply(int, Packet&)
+     */
+   int reply(int fd, ByteBuffer& frame);
+
+   /** Return number and size of responses posted to the engine thread
+     * and not delivered yet.
+     */
+   void backlog(unsigned& frames, size_t& bytes);
 
    /** Handle incoming packet.
      * \param fd source fd
@@ -55,7 +100,28 @@ class ServerSocket : public Socket
      */
    virtual bool handle(int fd, Packet& pkt) = 0;
 
+   /** Periodic maintenance, called by event engine
+     * every EventLoop::HousekeepingInterval ms.
+     */
+   virtual void housekeeping() {}
+
+   /** Client disconnected, called by event engine before
+     * the socket is closed.
+     * \param fd client socket
+     */
+   virtual void disconnected(int fd) { (void) fd; }
+
+   /** Response is being sent, called by the replying thread.
+     * \param fd client socket
+     * \param size encoded frame size
+     */
+   virtual void responded(int fd, size_t size) { (void) fd; (void) size; }
+
    private:
+   friend class EventLoop;
+
+   /** End session of disconnected client. */
+   void endSession(int fd);
 
    /* Opaque pointer */
    class Private;
@@ -0,0 +1,197 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file servicestats.cpp
+    \brief Live service metrics.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "servicestats.hpp"
+#include "usbnet.h"
+#include "common.h"
+#include <string.h>
+
+/* Device served by current thread. */
+static __thread int tDevice = -1;
+
+RequestStats::RequestStats()
+   : bytesIn(0), bytesOut(0), pending(0)
+{
+   memset(requests, 0, sizeof(requests));
+   hist_init(&latency);
+}
+
+ServiceStats::ServiceStats()
+   : mStart(now_us()), mRequests(0), mBytesIn(0), mBytesOut(0), mShed(0)
+{
+   pthread_mutex_init(&mLock, NULL);
+}
+
+ServiceStats::~ServiceStats()
+{
+   pthread_mutex_destroy(&mLock);
+}
+
+void ServiceStats::count(RequestStats& s, Packet& pkt)
+{
+   unsigned idx = pkt.op() - CallType;
+   if(idx < RequestStats::Opcodes)
+      ++s.requests[idx];
+   s.bytesIn += pkt.size();
+   ++s.pending;
+}
+
+void ServiceStats::request(int fd, int devfd, Packet& pkt)
+{
+   pthread_mutex_lock(&mLock);
+   ++mRequests;
+   mBytesIn += pkt.size();
+   if(fd >= 0)
+      count(mClients[fd], pkt);
+   if(devfd >= 0)
+      count(mDevices[devfd], pkt);
+   pthread_mutex_unlock(&mLock);
+}
+
+void ServiceStats::processed(int fd, int devfd, Packet& pkt)
+{
+   // Arrival unknown for internal requests
+   long long elapsed = 0;
+   if(pkt.stamp() > 0)
+      elapsed = now_us() - pkt.stamp();
+
+   pthread_mutex_lock(&mLock);
+   std::map<int, RequestStats>::iterator s;
+   if(fd >= 0 && (s = mClients.find(fd)) != mClients.end()) {
+      if(s->second.pending > 0)
+         --s->second.pending;
+      if(pkt.stamp() > 0)
+         hist_record(&s->second.latency, elapsed);
+   }
+   if(devfd >= 0 && (s = mDevices.find(devfd)) != mDevices.end()) {
+      if(s->second.pending > 0)
+         --s->second.pending;
+      if(pkt.stamp() > 0)
+         hist_record(&s->second.latency, elapsed);
+   }
+   pthread_mutex_unlock(&mLock);
+}
+
+void ServiceStats::dropped(int devfd)
+{
+   pthread_mutex_lock(&mLock);
+   std::map<int, RequestStats>::iterator s = mDevices.find(devfd);
+   if(s != mDevices.end() && s->second.pending > 0)
+      --s->second.pending;
+   pthread_mutex_unlock(&mLock);
+}
+
+void ServiceStats::response(int fd, size_t size)
+{
+   pthread_mutex_lock(&mLock);
+   mBytesOut += size;
+   std::map<int, RequestStats>::iterator s = mClients.find(fd);
+   if(s != mClients.end())
+      s->second.bytesOut += size;
+   if(tDevice >= 0 && (s = mDevices.find(tDevice)) != mDevices.end())
+      s->second.bytesOut += size;
+   pthread_mutex_unlock(&mLock);
+}
+
+void ServiceStats::shed()
+{
+   pthread_mutex_lock(&mLock);
+   ++mShed;
+   pthread_mutex_unlock(&mLock);
+}
+
+void ServiceStats::removeClient(int fd)
+{
+   pthread_mutex_lock(&mLock);
+   mClients.erase(fd);
+   pthread_mutex_unlock(&mLock);
+}
+
+void ServiceStats::removeDevice(int devfd)
+{
+   pthread_mutex_lock(&mLock);
+   mDevices.erase(devfd);
+   pthread_mutex_unlock(&mLock);
+}
+
+void ServiceStats::setDevice(int devfd)
+{
+   tDevice = devfd;
+}
+
+void ServiceStats::encode(Packet& pkt, int kind, int id, RequestStats& s, unsigned queued)
+{
+   // Entry header
+   pkt.addUInt8(kind);
+   pkt.addInt32(id);
+   pkt.addUInt64(s.bytesIn);
+   pkt.addUInt64(s.bytesOut);
+   pkt.addUInt32(s.pending);
+   pkt.addUInt32(queued);
+
+   // Latency percentiles
+   pkt.addUInt32(hist_percentile(&s.latency, 50));
+   pkt.addUInt32(hist_percentile(&s.latency, 90));
+   pkt.addUInt32(hist_percentile(&s.latency, 99));
+   pkt.addUInt32(s.latency.max);
+
+   // Used opcodes as (op, count) pairs
+   unsigned ops = 0;
+   for(unsigned i = 0; i < RequestStats::Opcodes; ++i) {
+      if(s.requests[i] > 0)
+         ++ops;
+   }
+   pkt.addUInt8(ops);
+   for(unsigned i = 0; i < RequestStats::Opcodes; ++i) {
+      if(s.requests[i] > 0) {
+         pkt.addUInt8(CallType + i);
+         pkt.addUInt64(s.requests[i]);
+      }
+   }
+}
+
+void ServiceStats::encode(Packet& pkt, const std::map<int, unsigned>& queued)
+{
+   pthread_mutex_lock(&mLock);
+
+   // Totals
+   pkt.addUInt32((now_us() - mStart) / 1000000);
+   pkt.addUInt64(mRequests);
+   pkt.addUInt64(mBytesIn);
+   pkt.addUInt64(mBytesOut);
+   pkt.addUInt64(mShed);
+
+   // Clients, then devices
+   std::map<int, RequestStats>::iterator s;
+   for(s = mClients.begin(); s != mClients.end(); ++s)
+      encode(pkt, 0, s->first, s->second, 0);
+   for(s = mDevices.begin(); s != mDevices.end(); ++s) {
+      std::map<int, unsigned>::const_iterator q = queued.find(s->first);
+      encode(pkt, 1, s->first, s->second, (q != queued.end()) ? q->second : 0);
+   }
+
+   pthread_mutex_unlock(&mLock);
+}
+
+/** @} */
@@ -0,0 +1,104 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file servicestats.hpp
+    \brief Live service metrics.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __servicestats_hpp__
+#define __servicestats_hpp__
+#include "protocol.hpp"
+#include "histogram.h"
+#include <map>
+#include <pthread.h>
+using namespace Proto;
+
+/** Request counters of a client or an open device. */
+struct RequestStats
+{
+   enum { Opcodes = 32 };
+   uint64_t requests[Opcodes]; // Requests per opcode (op - CallType)
+   uint64_t bytesIn;           // Request bytes
+   uint64_t bytesOut;          // Response bytes
+   unsigned pending;           // Requests not processed yet
+   histogram_t latency;        // Arrival to processed (us)
+   RequestStats();
+};
+
+/** Live service metrics for UsbStats.
+  * Counts requests, bytes and latency per client socket and per open
+  * device, kept for as long as the client is connected or the device open.
+  * Totals are kept for server lifetime. All methods are thread-safe.
+  */
+class ServiceStats
+{
+   public:
+   ServiceStats();
+   ~ServiceStats();
+
+   /** Count incoming request.
+     * \param fd client socket, negative for internal requests
+     * \param devfd served device, negative if processed immediately
+     */
+   void request(int fd, int devfd, Packet& pkt);
+
+   /** Record request latency after it was processed. */
+   void processed(int fd, int devfd, Packet& pkt);
+
+   /** Forget request of gone client, its socket may serve a new client already. */
+   void dropped(int devfd);
+
+   /** Count response bytes, also accounted to device served by calling thread. */
+   void response(int fd, size_t size);
+
+   /** Count request shed past its deadline. */
+   void shed();
+
+   /** Forget disconnected client. */
+   void removeClient(int fd);
+
+   /** Forget closed device. */
+   void removeDevice(int devfd);
+
+   /** Set device served by calling thread, -1 for none. */
+   static void setDevice(int devfd);
+
+   /** Encode totals and per-client/device entries.
+     * \param queued device queue depths by device descriptor
+     */
+   void encode(Packet& pkt, const std::map<int, unsigned>& queued);
+
+   private:
+   void count(RequestStats& s, Packet& pkt);
+   void encode(Packet& pkt, int kind, int id, RequestStats& s, unsigned queued);
+
+   pthread_mutex_t mLock;
+   long long mStart;       // Server start (monotonic us)
+   uint64_t mRequests;     // Total requests
+   uint64_t mBytesIn;      // Total request bytes
+   uint64_t mBytesOut;     // Total response bytes
+   uint64_t mShed;         // Total shed requests
+   std::map<int, RequestStats> mClients;
+   std::map<int, RequestStats> mDevices;
+};
+
+#endif // __servicestats_hpp__
+/** @} */
@@ -0,0 +1,743 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file simbackend.cpp
+    \brief Simulated USB devices.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "simbackend.hpp"
+#include "common.h"
+#include <vector>
+#include <algorithm>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Strip whitespace from both ends. */
+static std::string trim(const std::string& s) {
+   size_t b = s.find_first_not_of(" \t\r\n");
+   if(b == std::string::npos)
+      return std::string();
+   size_t e = s.find_last_not_of(" \t\r\n");
+   return s.substr(b, e - b + 1);
+}
+
+/* Simulated endpoint. */
+struct SimEndpoint
+{
+   unsigned address;   // Endpoint address, direction bit included
+   unsigned type;      // USB_ENDPOINT_TYPE_BULK or USB_ENDPOINT_TYPE_INTERRUPT
+   unsigned maxpacket; // wMaxPacketSize, 0 for type default
+   unsigned interval;  // bInterval
+   unsigned latency;   // Transfer latency in us
+   unsigned rate;      // Throughput in bytes per second, 0 for unlimited
+   unsigned naktime;   // NAK retry interval in us
+   double nak;         // Probabilities in percent
+   double timeout;
+   double error;
+   double stall;
+   unsigned pattern;   // IN data byte
+   bool halted;
+
+   SimEndpoint(unsigned addr)
+      : address(addr), type(USB_ENDPOINT_TYPE_BULK), maxpacket(0), interval(0),
+        latency(125), rate(40000000), naktime(1000), nak(0.0), timeout(0.0),
+        error(0.0), stall(0.0), pattern(0xa5), halted(false)
+   {}
+};
+
+/* Simulated device. */
+struct SimDevice
+{
+   unsigned bus, address;
+   unsigned vid, pid, bcd;
+   std::string manufacturer, product, serial;
+   unsigned latency;   // Control transfer latency in us
+   double error;       // Control transfer probabilities in percent
+   double stall;
+   std::vector<SimEndpoint> endpoints;
+
+   /* Runtime state, guarded by lock */
+   pthread_mutex_t lock;
+   unsigned seed;
+   int configuration;
+
+   /* libusb view */
+   struct usb_device dev;
+   struct usb_config_descriptor config;
+   struct usb_interface iface;
+   struct usb_interface_descriptor alt;
+   std::vector<usb_endpoint_descriptor> epdesc;
+   std::string devraw, cfgraw; // Wire descriptors
+
+   SimDevice(unsigned num)
+      : bus(1), address(num + 2), vid(0x1234), pid(0x5678), bcd(0x0100),
+        manufacturer("usbnet"), product("Simulated device"),
+        latency(125), error(0.0), stall(0.0), seed(num + 1), configuration(0)
+   {
+      char buf[16];
+      snprintf(buf, sizeof(buf), "SIM%04u", num + 1);
+      serial = buf;
+      pthread_mutex_init(&lock, NULL);
+   }
+
+   ~SimDevice() {
+      pthread_mutex_destroy(&lock);
+   }
+
+   /* Return endpoint or NULL, caller holds lock. */
+   SimEndpoint* endpoint(unsigned ep) {
+      for(unsigned i = 0; i < endpoints.size(); ++i) {
+         if(endpoints[i].address == (ep & 0xff))
+            return &endpoints[i];
+      }
+      return NULL;
+   }
+
+   /* Random draw with given probability in percent, caller holds lock. */
+   bool draw(double percent) {
+      if(percent <= 0.0)
+         return false;
+      return rand_r(&seed) * 100.0 / ((double) RAND_MAX + 1.0) < percent;
+   }
+
+   /* Build libusb structures and wire descriptors. */
+   void build();
+};
+
+void SimDevice::build()
+{
+   // Endpoints
+   epdesc.resize(endpoints.size());
+   for(unsigned i = 0; i < endpoints.size(); ++i) {
+      SimEndpoint& e = endpoints[i];
+      if(e.maxpacket == 0)
+         e.maxpacket = (e.type == USB_ENDPOINT_TYPE_BULK) ? 512 : 64;
+      memset(&epdesc[i], 0, sizeof(usb_endpoint_descriptor));
+      epdesc[i].bLength = USB_DT_ENDPOINT_SIZE;
+      epdesc[i].bDescriptorType = USB_DT_ENDPOINT;
+      epdesc[i].bEndpointAddress = e.address;
+      epdesc[i].bmAttributes = e.type;
+      epdesc[i].wMaxPacketSize = e.maxpacket;
+      epdesc[i].bInterval = e.interval;
+   }
+
+   // Vendor specific interface
+   memset(&alt, 0, sizeof(alt));
+   alt.bLength = USB_DT_INTERFACE_SIZE;
+   alt.bDescriptorType = USB_DT_INTERFACE;
+   alt.bNumEndpoints = endpoints.size();
+   alt.bInterfaceClass = 0xff;
+   alt.endpoint = epdesc.empty() ? NULL : &epdesc[0];
+   iface.altsetting = &alt;
+   iface.num_altsetting = 1;
+
+   // Single configuration
+   memset(&config, 0, sizeof(config));
+   config.bLength = USB_DT_CONFIG_SIZE;
+   config.bDescriptorType = USB_DT_CONFIG;
+   config.wTotalLength = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE + USB_DT_ENDPOINT_SIZE * endpoints.size();
+   config.bNumInterfaces = 1;
+   config.bConfigurationValue = 1;
+   config.bmAttributes = 0x80;
+   config.MaxPower = 50;
+   config.interface = &iface;
+
+   // Device
+   memset(&dev, 0, sizeof(dev));
+   snprintf(dev.filename, sizeof(dev.filename), "%03u", address);
+   dev.devnum = address;
+   dev.dev = this;
+   dev.config = &config;
+   usb_device_descriptor& desc = dev.descriptor;
+   desc.bLength = USB_DT_DEVICE_SIZE;
+   desc.bDescriptorType = USB_DT_DEVICE;
+   desc.bcdUSB = 0x0200;
+   desc.bMaxPacketSize0 = 64;
+   desc.idVendor = vid;
+   desc.idProduct = pid;
+   desc.bcdDevice = bcd;
+   desc.iManufacturer = manufacturer.empty() ? 0 : 1;
+   desc.iProduct = product.empty() ? 0 : 2;
+   desc.iSerialNumber = serial.empty() ? 0 : 3;
+   desc.bNumConfigurations = 1;
+
+   // Wire descriptors, 16bit values are little endian
+   const unsigned char devbuf[] = {
+      desc.bLength, desc.bDescriptorType, 0x00, 0x02, 0x00, 0x00, 0x00, desc.bMaxPacketSize0,
+      (unsigned char) vid, (unsigned char) (vid >> 8), (unsigned char) pid, (unsigned char) (pid >> 8),
+      (unsigned char) bcd, (unsigned char) (bcd >> 8),
+      desc.iManufacturer, desc.iProduct, desc.iSerialNumber, desc.bNumConfigurations
+   };
+   devraw.assign((const char*) devbuf, sizeof(devbuf));
+
+   const unsigned char cfgbuf[] = {
+      config.bLength, config.bDescriptorType,
+      (unsigned char) config.wTotalLength, (unsigned char) (config.wTotalLength >> 8),
+      config.bNumInterfaces, config.bConfigurationValue, 0x00, config.bmAttributes, config.MaxPower,
+      alt.bLength, alt.bDescriptorType, 0x00, 0x00, alt.bNumEndpoints, alt.bInterfaceClass, 0x00, 0x00, 0x00
+   };
+   cfgraw.assign((const char*) cfgbuf, sizeof(cfgbuf));
+   for(unsigned i = 0; i < epdesc.size(); ++i) {
+      const usb_endpoint_descriptor& e = epdesc[i];
+      const unsigned char epbuf[] = {
+         e.bLength, e.bDescriptorType, e.bEndpointAddress, e.bmAttributes,
+         (unsigned char) e.wMaxPacketSize, (unsigned char) (e.wMaxPacketSize >> 8), e.bInterval
+      };
+      cfgraw.append((const char*) epbuf, sizeof(epbuf));
+   }
+}
+
+class SimBackend::Private
+{
+   public:
+   Private() : foundBusses(false), foundDevices(false), handles(0)
+   {}
+
+   ~Private() {
+      clear();
+   }
+
+   /* Free devices and busses. */
+   void clear() {
+      for(unsigned i = 0; i < devices.size(); ++i)
+         delete devices[i];
+      devices.clear();
+      for(unsigned i = 0; i < busses.size(); ++i)
+         delete busses[i];
+      busses.clear();
+   }
+
+   /* Build bus tree from devices, busses in order of appearance. */
+   void build() {
+      for(unsigned i = 0; i < devices.size(); ++i) {
+         SimDevice* sim = devices[i];
+         sim->build();
+
+         // Find or create bus
+         struct usb_bus* bus = NULL;
+         for(unsigned j = 0; j < busses.size(); ++j) {
+            if(busses[j]->location == sim->bus)
+               bus = busses[j];
+         }
+         if(bus == NULL) {
+            bus = new usb_bus;
+            memset(bus, 0, sizeof(usb_bus));
+            snprintf(bus->dirname, sizeof(bus->dirname), "%03u", sim->bus);
+            bus->location = sim->bus;
+            if(!busses.empty()) {
+               busses.back()->next = bus;
+               bus->prev = busses.back();
+            }
+            busses.push_back(bus);
+         }
+
+         // Append device
+         struct usb_device* dev = &sim->dev;
+         dev->bus = bus;
+         if(bus->devices == NULL) {
+            bus->devices = dev;
+         }
+         else {
+            struct usb_device* last = bus->devices;
+            while(last->next != NULL)
+               last = last->next;
+            last->next = dev;
+            dev->prev = last;
+         }
+      }
+   }
+
+   /* Parse configuration into devices. */
+   bool parse(FILE* fp, const char* path);
+
+   /* Device of open handle. */
+   static SimDevice* device(usb_dev_handle* h) {
+      return (SimDevice*) h->impl_info;
+   }
+
+   /* Endpoint transfer. */
+   static int transfer(usb_dev_handle* h, unsigned type, int ep, char* data, int size, int timeout);
+
+   std::vector<SimDevice*> devices;
+   std::vector<usb_bus*> busses;
+   bool foundBusses, foundDevices;
+   int handles;  // Opened handles, unique URB queue keys
+};
+
+bool SimBackend::Private::parse(FILE* fp, const char* path)
+{
+   unsigned seed = 0;
+   SimDevice* sim = NULL;
+   SimEndpoint* ep = NULL;
+   char buf[512];
+   for(unsigned line = 1; fgets(buf, sizeof(buf), fp) != NULL; ++line) {
+
+      // Strip comments and blank lines
+      std::string str(buf);
+      size_t comment = str.find('#');
+      if(comment != std::string::npos)
+         str.erase(comment);
+      str = trim(str);
+      if(str.empty())
+         continue;
+
+      // Sections
+      if(str[0] == '[') {
+         if(str == "[device]") {
+            sim = new SimDevice(devices.size());
+            sim->seed += seed;
+            devices.push_back(sim);
+            ep = NULL;
+            continue;
+         }
+         if(str.compare(0, 10, "[endpoint ") == 0 && sim != NULL) {
+            unsigned addr = strtoul(str.c_str() + 10, NULL, 0);
+            if(addr == 0 || (addr & 0x70) != 0) {
+               error_msg("SimBackend: %s:%u: invalid endpoint address", path, line);
+               return false;
+            }
+            sim->endpoints.push_back(SimEndpoint(addr));
+            ep = &sim->endpoints.back();
+            continue;
+         }
+         error_msg("SimBackend: %s:%u: unexpected section '%s'", path, line, str.c_str());
+         return false;
+      }
+
+      // Key = value
+      size_t eq = str.find('=');
+      if(eq == std::string::npos) {
+         error_msg("SimBackend: %s:%u: expected key = value", path, line);
+         return false;
+      }
+      std::string key = trim(str.substr(0, eq));
+      std::string val = trim(str.substr(eq + 1));
+      unsigned num = strtoul(val.c_str(), NULL, 0);
+      double pct = strtod(val.c_str(), NULL);
+      bool known = true;
+
+      if(sim == NULL) {
+         if(key == "seed")             seed = num;
+         else                          known = false;
+      }
+      else if(ep == NULL) {
+         if(key == "bus")              sim->bus = num;
+         else if(key == "address")     sim->address = num;
+         else if(key == "vid")         sim->vid = num;
+         else if(key == "pid")         sim->pid = num;
+         else if(key == "bcd")         sim->bcd = num;
+         else if(key == "manufacturer") sim->manufacturer = val;
+         else if(key == "product")     sim->product = val;
+         else if(key == "serial")      sim->serial = val;
+         else if(key == "latency")     sim->latency = num;
+         else if(key == "error")       sim->error = pct;
+         else if(key == "stall")       sim->stall = pct;
+         else                          known = false;
+      }
+      else {
+         if(key == "type") {
+            if(val == "bulk")
+               ep->type = USB_ENDPOINT_TYPE_BULK;
+            else if(val == "interrupt")
+               ep->type = USB_ENDPOINT_TYPE_INTERRUPT;
+            else {
+               error_msg("SimBackend: %s:%u: unsupported endpoint type '%s'", path, line, val.c_str());
+               return false;
+            }
+         }
+         else if(key == "maxpacket")   ep->maxpacket = num;
+         else if(key == "interval")    ep->interval = num;
+         else if(key == "latency")     ep->latency = num;
+         else if(key == "rate")        ep->rate = num;
+         else if(key == "nak")         ep->nak = pct;
+         else if(key == "naktime")     ep->naktime = num;
+         else if(key == "timeout")     ep->timeout = pct;
+         else if(key == "error")       ep->error = pct;
+         else if(key == "stall")       ep->stall = pct;
+         else if(key == "pattern")     ep->pattern = num & 0xff;
+         else                          known = false;
+      }
+
+      if(!known) {
+         error_msg("SimBackend: %s:%u: unknown key '%s'", path, line, key.c_str());
+         return false;
+      }
+   }
+
+   return true;
+}
+
+int SimBackend::Private::transfer(usb_dev_handle* h, unsigned type, int ep, char* data, int size, int timeout)
+{
+   SimDevice* sim = device(h);
+
+   // Draw outcome, device may be used by multiple handles
+   pthread_mutex_lock(&sim->lock);
+   SimEndpoint* e = sim->endpoint(ep);
+   if(e == NULL || e->type != type) {
+      pthread_mutex_unlock(&sim->lock);
+      return -ENOENT;
+   }
+   if(e->halted) {
+      pthread_mutex_unlock(&sim->lock);
+      return -EPIPE;
+   }
+
+   // NAKed until accepted or timed out
+   long long limit = (timeout > 0) ? (long long) timeout * 1000 : 1000000;
+   long long delay = 0;
+   int res = size;
+   while(sim->draw(e->nak) && res >= 0) {
+      delay += e->naktime;
+      if(delay >= limit)
+         res = -ETIMEDOUT;
+   }
+
+   if(res >= 0) {
+      if(sim->draw(e->timeout)) {
+         delay = limit;
+         res = -ETIMEDOUT;
+      }
+      else if(sim->draw(e->stall)) {
+         e->halted = true;
+         res = -EPIPE;
+      }
+      else if(sim->draw(e->error)) {
+         res = -EIO;
+      }
+   }
+
+   // Bus time
+   if(res == -ETIMEDOUT)
+      delay = limit;
+   else {
+      delay += e->latency;
+      if(res > 0 && e->rate > 0)
+         delay += (long long) res * 1000000 / e->rate;
+   }
+   unsigned pattern = e->pattern;
+   pthread_mutex_unlock(&sim->lock);
+
+   sleep_us(delay);
+   if(res > 0 && (ep & USB_ENDPOINT_IN))
+      memset(data, pattern, res);
+   return res;
+}
+
+SimBackend::SimBackend()
+   : d(new Private)
+{
+   // Default device
+   SimDevice* sim = new SimDevice(0);
+   sim->endpoints.push_back(SimEndpoint(0x81));
+   sim->endpoints.push_back(SimEndpoint(0x02));
+   sim->endpoints.push_back(SimEndpoint(0x83));
+   sim->endpoints.back().type = USB_ENDPOINT_TYPE_INTERRUPT;
+   sim->endpoints.back().interval = 1;
+   sim->endpoints.back().rate = 0;
+   d->devices.push_back(sim);
+   d->build();
+}
+
+SimBackend::~SimBackend()
+{
+   delete d;
+}
+
+bool SimBackend::load(const char* path)
+{
+   FILE* fp = fopen(path, "r");
+   if(fp == NULL) {
+      error_msg("SimBackend: can't open '%s': %s", path, strerror(errno));
+      return false;
+   }
+
+   // Parse into new device list
+   Private* p = new Private;
+   bool ok = p->parse(fp, path);
+   fclose(fp);
+   if(!ok) {
+      delete p;
+      return false;
+   }
+
+   p->build();
+   delete d;
+   d = p;
+   log_msg("SimBackend: %u devices from %s", (unsigned) d->devices.size(), path);
+   return true;
+}
+
+void SimBackend::init()
+{
+}
+
+int SimBackend::findBusses()
+{
+   // Number of changes since last call
+   if(d->foundBusses)
+      return 0;
+   d->foundBusses = true;
+   return d->busses.size();
+}
+
+int SimBackend::findDevices()
+{
+   if(d->foundDevices)
+      return 0;
+   d->foundDevices = true;
+   return d->devices.size();
+}
+
+struct usb_bus* SimBackend::busses()
+{
+   return d->busses.empty() ? NULL : d->busses.front();
+}
+
+void SimBackend::serials(SerialMap& map)
+{
+   for(unsigned i = 0; i < d->devices.size(); ++i) {
+      SimDevice* sim = d->devices[i];
+      if(!sim->serial.empty())
+         map[std::make_pair(sim->bus, sim->address)] = sim->serial;
+   }
+}
+
+usb_dev_handle* SimBackend::open(struct usb_device* dev)
+{
+   usb_dev_handle* h = new usb_dev_handle;
+   h->fd = d->handles++;
+   h->bus = dev->bus;
+   h->device = dev;
+   h->config = h->interface = h->altsetting = -1;
+   h->impl_info = dev->dev;
+   return h;
+}
+
+int SimBackend::close(usb_dev_handle* h)
+{
+   delete h;
+   return 0;
+}
+
+int SimBackend::setConfiguration(usb_dev_handle* h, int configuration)
+{
+   if(configuration != 0 && configuration != 1)
+      return -EINVAL;
+
+   SimDevice* sim = Private::device(h);
+   pthread_mutex_lock(&sim->lock);
+   sim->configuration = configuration;
+   pthread_mutex_unlock(&sim->lock);
+   h->config = configuration;
+   return 0;
+}
+
+int SimBackend::setAltInterface(usb_dev_handle* h, int alternate)
+{
+   if(h->interface < 0 || alternate != 0)
+      return -EINVAL;
+
+   h->altsetting = alternate;
+   return 0;
+}
+
+int SimBackend::resetEp(usb_dev_handle* h, unsigned ep)
+{
+   return clearHalt(h, ep);
+}
+
+int SimBackend::clearHalt(usb_dev_handle* h, unsigned ep)
+{
+   SimDevice* sim = Private::device(h);
+   pthread_mutex_lock(&sim->lock);
+   SimEndpoint* e = sim->endpoint(ep);
+   if(e != NULL)
+      e->halted = false;
+   pthread_mutex_unlock(&sim->lock);
+   return (e != NULL) ? 0 : -ENOENT;
+}
+
+int SimBackend::reset(usb_dev_handle* h)
+{
+   SimDevice* sim = Private::device(h);
+   pthread_mutex_lock(&sim->lock);
+   for(unsigned i = 0; i < sim->endpoints.size(); ++i)
+      sim->endpoints[i].halted = false;
+   sim->configuration = 0;
+   pthread_mutex_unlock(&sim->lock);
+   return 0;
+}
+
+int SimBackend::claimInterface(usb_dev_handle* h, int index)
+{
+   if(index != 0)
+      return -EINVAL;
+
+   h->interface = index;
+   return 0;
+}
+
+int SimBackend::releaseInterface(usb_dev_handle* h, int index)
+{
+   if(index != h->interface)
+      return -EINVAL;
+
+   h->interface = -1;
+   h->altsetting = -1;
+   return 0;
+}
+
+int SimBackend::getKernelDriver(usb_dev_handle*, int, char*, unsigned)
+{
+   // Never bound to kernel driver
+   return -ENODATA;
+}
+
+int SimBackend::detachKernelDriver(usb_dev_handle*, int)
+{
+   return -ENODATA;
+}
+
+int SimBackend::controlMsg(usb_dev_handle* h, int reqtype, int request, int value, int index,
+                           char* data, int size, int)
+{
+   SimDevice* sim = Private::device(h);
+   if(size < 0)
+      return -EINVAL;
+
+   // Injected failures
+   pthread_mutex_lock(&sim->lock);
+   int res = size;
+   if(sim->draw(sim->stall))
+      res = -EPIPE;
+   else if(sim->draw(sim->error))
+      res = -EIO;
+   unsigned latency = sim->latency;
+   pthread_mutex_unlock(&sim->lock);
+
+   sleep_us(latency);
+   if(res < 0)
+      return res;
+
+   // Class and vendor requests succeed, IN returns zeroes
+   if((reqtype & (0x03 << 5)) != USB_TYPE_STANDARD) {
+      if(reqtype & USB_ENDPOINT_IN)
+         memset(data, 0, size);
+      return size;
+   }
+
+   // Standard requests
+   std::string reply;
+   switch(request) {
+   case USB_REQ_GET_DESCRIPTOR:
+      switch(value >> 8) {
+      case USB_DT_DEVICE:
+         reply = sim->devraw;
+         break;
+      case USB_DT_CONFIG:
+         if((value & 0xff) != 0)
+            return -EPIPE;
+         reply = sim->cfgraw;
+         break;
+      case USB_DT_STRING: {
+         // Language table or ASCII string as UTF-16LE
+         const std::string* str = NULL;
+         switch(value & 0xff) {
+         case 0: reply.assign("\x04\x03\x09\x04", 4); break;
+         case 1: str = &sim->manufacturer; break;
+         case 2: str = &sim->product; break;
+         case 3: str = &sim->serial; break;
+         default: return -EPIPE;
+         }
+         if(str != NULL) {
+            // bLength is a byte, at most 126 UTF-16 characters fit
+            unsigned chars = std::min<size_t>(str->size(), 126);
+            reply.push_back((char) (2 + 2 * chars));
+            reply.push_back((char) USB_DT_STRING);
+            for(unsigned i = 0; i < chars; ++i) {
+               reply.push_back((*str)[i]);
+               reply.push_back('\0');
+            }
+         }
+         }
+         break;
+      default:
+         return -EPIPE;
+      }
+      break;
+   case USB_REQ_GET_STATUS: {
+      // Endpoint halt status, self powered otherwise
+      char status = 0;
+      if((reqtype & 0x1f) == USB_RECIP_ENDPOINT) {
+         pthread_mutex_lock(&sim->lock);
+         SimEndpoint* e = sim->endpoint(index);
+         status = (e != NULL && e->halted) ? 1 : 0;
+         pthread_mutex_unlock(&sim->lock);
+      }
+      reply.push_back(status);
+      reply.push_back('\0');
+      }
+      break;
+   case USB_REQ_GET_CONFIGURATION:
+      pthread_mutex_lock(&sim->lock);
+      reply.push_back((char) sim->configuration);
+      pthread_mutex_unlock(&sim->lock);
+      break;
+   case USB_REQ_SET_CONFIGURATION:
+      return setConfiguration(h, value);
+   case USB_REQ_CLEAR_FEATURE:
+      if((reqtype & 0x1f) == USB_RECIP_ENDPOINT && value == 0)
+         return clearHalt(h, index);
+      return 0;
+   default:
+      return (reqtype & USB_ENDPOINT_IN) ? -EPIPE : 0;
+   }
+
+   // Truncate to requested length
+   int len = ((int) reply.size() < size) ? reply.size() : size;
+   memcpy(data, reply.data(), len);
+   return len;
+}
+
+int SimBackend::bulkRead(usb_dev_handle* h, int ep, char* data, int size, int timeout)
+{
+   return Private::transfer(h, USB_ENDPOINT_TYPE_BULK, ep | USB_ENDPOINT_IN, data, size, timeout);
+}
+
+int SimBackend::bulkWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout)
+{
+   return Private::transfer(h, USB_ENDPOINT_TYPE_BULK, ep & ~USB_ENDPOINT_IN, data, size, timeout);
+}
+
+int SimBackend::interruptRead(usb_dev_handle* h, int ep, char* data, int size, int timeout)
+{
+   return Private::transfer(h, USB_ENDPOINT_TYPE_INTERRUPT, ep | USB_ENDPOINT_IN, data, size, timeout);
+}
+
+int SimBackend::interruptWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout)
+{
+   return Private::transfer(h, USB_ENDPOINT_TYPE_INTERRUPT, ep & ~USB_ENDPOINT_IN, data, size, timeout);
+}
+
+/** @} */
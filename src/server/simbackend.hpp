@@ -0,0 +1,94 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file simbackend.hpp
+    \brief Simulated USB devices.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __simbackend_hpp__
+#define __simbackend_hpp__
+#include "usbbackend.hpp"
+
+/** Simulated USB devices.
+  * Stand-in for libusb, allows running the service without hardware.
+  * Each device has single configuration with one vendor interface,
+  * standard GET_DESCRIPTOR requests are answered from its descriptors,
+  * other control requests succeed. Endpoint transfers pay configured
+  * latency and throughput, may be NAKed, time out, fail or stall.
+  * IN transfers return pattern data, OUT transfers are dropped.
+  * Without configuration single device 1234:5678 is provided on bus 1
+  * with bulk endpoints 0x81, 0x02 and interrupt endpoint 0x83.
+  * Unlike SimUsbfs, which only replaces kernel URB processing under real
+  * libusb devices, this replaces the whole backend: enumeration,
+  * descriptors, control and interrupt transfers and failure injection.
+  * Handles have no usbfs descriptor, fd is an unique key instead, so
+  * bulk transfers are queued as URBs only to simulated usbfs (-u sim),
+  * which then replaces endpoint timing and failure injection.
+  */
+class SimBackend : public UsbBackend
+{
+   public:
+   SimBackend();
+   ~SimBackend();
+
+   /** Load devices from configuration file, replaces current devices.
+     * Must not be called while handles are open.
+     * \return false on parse error, current devices are kept
+     */
+   bool load(const char* path);
+
+   const char* name() { return "sim"; }
+   bool usbfs() { return false; }
+
+   void init();
+   int findBusses();
+   int findDevices();
+   struct usb_bus* busses();
+   void serials(SerialMap& map);
+
+   usb_dev_handle* open(struct usb_device* dev);
+   int close(usb_dev_handle* h);
+   int setConfiguration(usb_dev_handle* h, int configuration);
+   int setAltInterface(usb_dev_handle* h, int alternate);
+   int resetEp(usb_dev_handle* h, unsigned ep);
+   int clearHalt(usb_dev_handle* h, unsigned ep);
+   int reset(usb_dev_handle* h);
+   int claimInterface(usb_dev_handle* h, int index);
+   int releaseInterface(usb_dev_handle* h, int index);
+   int getKernelDriver(usb_dev_handle* h, int index, char* name, unsigned namelen);
+   int detachKernelDriver(usb_dev_handle* h, int index);
+
+   int controlMsg(usb_dev_handle* h, int reqtype, int request, int value, int index,
+                  char* data, int size, int timeout);
+   int bulkRead(usb_dev_handle* h, int ep, char* data, int size, int timeout);
+   int bulkWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout);
+   int interruptRead(usb_dev_handle* h, int ep, char* data, int size, int timeout);
+   int interruptWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout);
+
+   private:
+
+   /* Opaque pointer */
+   class Private;
+   Private* d;
+};
+
+#endif // __simbackend_hpp__
+/** @} */
@@ -0,0 +1,163 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file simusbfs.cpp
+    \brief Simulated usbfs device.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "simusbfs.hpp"
+#include "common.h"
+#include <map>
+#include <deque>
+#include <pthread.h>
+#include <errno.h>
+
+/* Submitted URB. */
+struct SimUrb
+{
+   usbdevfs_urb* urb;
+   long long done;  // Completion time
+};
+
+/* Simulated device queue. */
+struct SimQueue
+{
+   SimQueue() : busy(0) {}
+   std::deque<SimUrb> urbs;
+   long long busy;  // Bus busy until
+};
+
+class SimUsbfs::Private
+{
+   public:
+   unsigned rate;
+   unsigned latency;
+   pthread_mutex_t lock;
+   std::map<int, SimQueue> queues;
+};
+
+SimUsbfs::SimUsbfs(unsigned rate, unsigned latency)
+   : d(new Private)
+{
+   d->rate = rate;
+   d->latency = latency;
+   pthread_mutex_init(&d->lock, NULL);
+}
+
+SimUsbfs::~SimUsbfs()
+{
+   pthread_mutex_destroy(&d->lock);
+   delete d;
+}
+
+int SimUsbfs::submit(int fd, usbdevfs_urb* urb)
+{
+   if(urb->type != USBDEVFS_URB_TYPE_BULK || urb->buffer_length < 0)
+      return -EINVAL;
+
+   pthread_mutex_lock(&d->lock);
+   SimQueue& q = d->queues[fd];
+
+   // Idle bus pays turnaround latency
+   long long now = now_us();
+   long long start = q.busy;
+   if(start < now + d->latency)
+      start = now + d->latency;
+
+   SimUrb u;
+   u.urb = urb;
+   u.done = start + (long long) urb->buffer_length * 1000000 / d->rate;
+   q.busy = u.done;
+   q.urbs.push_back(u);
+   urb->status = -EINPROGRESS;
+   pthread_mutex_unlock(&d->lock);
+   return 0;
+}
+
+int SimUsbfs::discard(int fd, usbdevfs_urb* urb)
+{
+   int res = -EINVAL;
+   pthread_mutex_lock(&d->lock);
+   SimQueue& q = d->queues[fd];
+   for(std::deque<SimUrb>::iterator it = q.urbs.begin(); it != q.urbs.end(); ++it) {
+      if(it->urb == urb && urb->status == -EINPROGRESS) {
+         urb->status = -ENOENT;
+         it->done = 0;
+         res = 0;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&d->lock);
+   return res;
+}
+
+int SimUsbfs::reap(int fd, usbdevfs_urb** urb, int timeout)
+{
+   long long deadline = now_us() + (long long) timeout * 1000;
+   for(;;) {
+      pthread_mutex_lock(&d->lock);
+      SimQueue& q = d->queues[fd];
+      if(q.urbs.empty()) {
+         pthread_mutex_unlock(&d->lock);
+         return -EAGAIN;
+      }
+
+      // Cancelled URBs complete immediately
+      std::deque<SimUrb>::iterator it = q.urbs.begin();
+      for(; it != q.urbs.end(); ++it) {
+         if(it->done == 0)
+            break;
+      }
+      if(it == q.urbs.end())
+         it = q.urbs.begin();
+
+      // Wait for completion
+      long long now = now_us();
+      long long wait = it->done - now;
+      if(wait <= 0) {
+         usbdevfs_urb* u = it->urb;
+         q.urbs.erase(it);
+         if(u->status == -EINPROGRESS) {
+            u->status = 0;
+            u->actual_length = u->buffer_length;
+            if(u->endpoint & 0x80)
+               memset(u->buffer, u->endpoint, u->buffer_length);
+         }
+         if(q.urbs.empty())
+            q.busy = 0;
+         pthread_mutex_unlock(&d->lock);
+         *urb = u;
+         return 0;
+      }
+      pthread_mutex_unlock(&d->lock);
+
+      // Timeout
+      if(timeout > 0) {
+         if(now >= deadline)
+            return -ETIMEDOUT;
+         if(wait > deadline - now)
+            wait = deadline - now;
+      }
+
+      sleep_us(wait);
+   }
+}
+
+/** @} */
@@ -0,0 +1,62 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file simusbfs.hpp
+    \brief Simulated usbfs device.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __simusbfs_hpp__
+#define __simusbfs_hpp__
+#include "urbqueue.hpp"
+
+/** Simulated usbfs URB processing.
+  * Stand-in for kernel usbfs, allows testing URB queueing without
+  * hardware. URBs on each descriptor are processed serially by a
+  * simulated bus with given throughput, each URB scheduled on idle
+  * bus pays a turnaround latency. IN transfers return pattern data,
+  * OUT transfers are accepted and dropped.
+  * Descriptors are only queue keys, so it also queues bulk transfers
+  * of SimBackend devices, which allows testing without hardware.
+  */
+class SimUsbfs : public UsbfsOps
+{
+   public:
+   /** \param rate bus throughput in bytes per second
+     * \param latency turnaround latency in microseconds
+     */
+   SimUsbfs(unsigned rate = 40000000, unsigned latency = 125);
+   ~SimUsbfs();
+
+   const char* name() { return "sim"; }
+   bool simulated() { return true; }
+   int submit(int fd, usbdevfs_urb* urb);
+   int discard(int fd, usbdevfs_urb* urb);
+   int reap(int fd, usbdevfs_urb** urb, int timeout);
+
+   private:
+
+   /* Opaque pointer */
+   class Private;
+   Private* d;
+};
+
+#endif // __simusbfs_hpp__
+/** @} */
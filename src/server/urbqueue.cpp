@@ -0,0 +1,194 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file urbqueue.cpp
+    \brief Pipelined usbfs URB transfers.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "urbqueue.hpp"
+#include "common.h"
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <stdint.h>
+
+/** Kernel usbfs implementation. */
+class KernelUsbfs : public UsbfsOps
+{
+   public:
+   const char* name() { return "kernel"; }
+
+   int submit(int fd, usbdevfs_urb* urb) {
+      if(ioctl(fd, USBDEVFS_SUBMITURB, urb) < 0)
+         return -errno;
+      return 0;
+   }
+
+   int discard(int fd, usbdevfs_urb* urb) {
+      if(ioctl(fd, USBDEVFS_DISCARDURB, urb) < 0)
+         return -errno;
+      return 0;
+   }
+
+   int reap(int fd, usbdevfs_urb** urb, int timeout) {
+      long long deadline = now_ms() + timeout;
+      for(;;) {
+         if(ioctl(fd, USBDEVFS_REAPURBNDELAY, urb) == 0)
+            return 0;
+         if(errno != EAGAIN)
+            return -errno;
+
+         // Completed URB makes descriptor writable
+         int wait = -1;
+         if(timeout > 0) {
+            if((wait = deadline - now_ms()) <= 0)
+               return -ETIMEDOUT;
+         }
+         pollfd p = { fd, POLLOUT, 0 };
+         if(poll(&p, 1, wait) < 0 && errno != EINTR)
+            return -errno;
+      }
+   }
+};
+
+UsbfsOps* UsbfsOps::kernel()
+{
+   return new KernelUsbfs();
+}
+
+UrbQueue::UrbQueue(UsbfsOps* ops, int fd, unsigned depth, unsigned chunk)
+   : mOps(ops), mFd(fd), mDepth(depth), mChunk(chunk), mUrbs(new usbdevfs_urb[depth]),
+     mEp(0), mData(NULL), mSize(0), mCount(0), mSubmitted(0), mInFlight(0)
+{
+}
+
+UrbQueue::~UrbQueue()
+{
+   delete [] mUrbs;
+}
+
+int UrbQueue::submit(unsigned idx)
+{
+   usbdevfs_urb* urb = &mUrbs[idx % mDepth];
+   memset(urb, 0, sizeof(usbdevfs_urb));
+   urb->type = USBDEVFS_URB_TYPE_BULK;
+   urb->endpoint = mEp;
+   urb->buffer = mData + idx * mChunk;
+   urb->buffer_length = (idx + 1 < mCount) ? mChunk : mSize - idx * mChunk;
+   urb->usercontext = (void*) (uintptr_t) idx;
+
+   // Short IN packet stops the endpoint queue,
+   // following URBs are cancelled instead of reading past it
+   if(mEp & 0x80) {
+      if(idx > 0)
+         urb->flags |= USBDEVFS_URB_BULK_CONTINUATION;
+      if(idx + 1 < mCount)
+         urb->flags |= USBDEVFS_URB_SHORT_NOT_OK;
+   }
+
+   int res = mOps->submit(mFd, urb);
+   if(res == 0)
+      ++mInFlight;
+   return res;
+}
+
+void UrbQueue::cancel()
+{
+   // Discard from the newest, so that older URBs don't complete in between
+   for(unsigned i = mSubmitted; i > mSubmitted - mInFlight; --i)
+      mOps->discard(mFd, &mUrbs[(i - 1) % mDepth]);
+}
+
+int UrbQueue::bulk(int ep, char* data, int size, int timeout)
+{
+   mEp = ep;
+   mData = data;
+   mSize = size;
+   mCount = (size + mChunk - 1) / mChunk;
+   mSubmitted = 0;
+   mInFlight = 0;
+
+   int total = 0;
+   int error = 0;
+   bool stop = false;
+   long long deadline = now_ms() + timeout;
+   while(!stop || mInFlight > 0) {
+
+      // Keep queue full
+      while(!stop && mInFlight < mDepth && mSubmitted < mCount) {
+         int res = submit(mSubmitted);
+         if(res < 0) {
+            if(mSubmitted == 0 && (res == -ENOTTY || res == -EBADF))
+               return NotSupported;
+            error = res;
+            stop = true;
+            cancel();
+            break;
+         }
+         ++mSubmitted;
+      }
+
+      // Transfer complete
+      if(mInFlight == 0)
+         break;
+
+      // Reap completion, URBs complete in submission order
+      int wait = 0;
+      if(!stop && timeout > 0) {
+         if((wait = deadline - now_ms()) <= 0)
+            wait = -1;
+      }
+      usbdevfs_urb* urb = NULL;
+      int res = (wait < 0) ? -ETIMEDOUT : mOps->reap(mFd, &urb, wait);
+      if(res < 0) {
+         // Cancel and collect remaining URBs
+         if(!stop) {
+            error = res;
+            stop = true;
+            cancel();
+            continue;
+         }
+         error_msg("UrbQueue: failed to reap cancelled URBs on fd %d (%d)", mFd, res);
+         return (error < 0) ? error : res;
+      }
+
+      --mInFlight;
+      if(stop)
+         continue;
+
+      // Evaluate completion
+      total += urb->actual_length;
+      if(urb->status == 0 || urb->status == -EREMOTEIO) {
+         if(urb->actual_length < urb->buffer_length) {
+            stop = true;
+            cancel();
+         }
+      }
+      else {
+         error = urb->status;
+         stop = true;
+         cancel();
+      }
+   }
+
+   return (error < 0) ? error : total;
+}
+
+/** @} */
@@ -0,0 +1,110 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file urbqueue.hpp
+    \brief Pipelined usbfs URB transfers.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __urbqueue_hpp__
+#define __urbqueue_hpp__
+#include <linux/usbdevice_fs.h>
+
+/** Interface to usbfs URB operations.
+  * Allows replacing kernel usbfs with simulated device.
+  */
+class UsbfsOps
+{
+   public:
+   virtual ~UsbfsOps() {}
+
+   /** Return implementation name. */
+   virtual const char* name() = 0;
+
+   /** Return true if URBs never reach a device, any handle fd may be queued. */
+   virtual bool simulated() { return false; }
+
+   /** Submit URB.
+     * \return 0 on success, negative errno on error
+     */
+   virtual int submit(int fd, usbdevfs_urb* urb) = 0;
+
+   /** Cancel submitted URB, it still has to be reaped.
+     * \return 0 on success, negative errno on error
+     */
+   virtual int discard(int fd, usbdevfs_urb* urb) = 0;
+
+   /** Wait for completed URB.
+     * \param timeout timeout in ms, 0 for infinite
+     * \return 0 on success, -ETIMEDOUT on timeout, negative errno on error
+     */
+   virtual int reap(int fd, usbdevfs_urb** urb, int timeout) = 0;
+
+   /** Create kernel usbfs implementation. */
+   static UsbfsOps* kernel();
+};
+
+/** Bulk transfer split into URBs with configurable queue depth.
+  * Keeps up to depth URBs in flight, so the device is never idle
+  * waiting for the next submission. Short IN transfer terminates
+  * the queue like synchronous transfer would.
+  * All URBs on given fd must be submitted and reaped from one thread.
+  */
+class UrbQueue
+{
+   public:
+   UrbQueue(UsbfsOps* ops, int fd, unsigned depth, unsigned chunk);
+   ~UrbQueue();
+
+   /** Process bulk transfer, direction is given by endpoint.
+     * \return transferred bytes or negative errno,
+     *         NotSupported if fd doesn't support usbfs URBs
+     */
+   int bulk(int ep, char* data, int size, int timeout);
+
+   enum {
+      NotSupported = -1024
+   };
+
+   private:
+
+   /** Submit URB for given chunk. */
+   int submit(unsigned idx);
+
+   /** Cancel URBs in flight. */
+   void cancel();
+
+   UsbfsOps* mOps;
+   int mFd;
+   unsigned mDepth;
+   unsigned mChunk;
+   usbdevfs_urb* mUrbs;
+
+   // Current transfer
+   int mEp;
+   char* mData;
+   int mSize;
+   unsigned mCount;     // Number of chunks
+   unsigned mSubmitted; // Next chunk to submit
+   unsigned mInFlight;  // URBs in flight
+};
+
+#endif // __urbqueue_hpp__
+/** @} */
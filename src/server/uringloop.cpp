@@ -0,0 +1,694 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file uringloop.cpp
+    \brief Linux io_uring event engine.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "uringloop.hpp"
+#include "serversocket.hpp"
+#include "common.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+/* Ring dimensions. */
+#define URING_ENTRIES  256   // Submission queue entries
+#define URING_BUFFERS  64    // Provided receive buffers (power of 2)
+#define URING_BUFSIZE  16384 // Provided receive buffer size
+#define URING_BGID     0     // Provided buffer group id
+
+/* Completion tags stored in low bits of user_data. */
+enum {
+   TagAccept = 1,
+   TagRecv   = 2,
+   TagSend   = 3,
+   TagTimer  = 4,
+   TagWake   = 5,
+   TagMask   = 7
+};
+
+/* Raw system calls, liburing is not required. */
+static int sys_uring_setup(unsigned entries, io_uring_params* p) {
+   return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags) {
+   return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned op, void* arg, unsigned nr) {
+   return (int) syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/* Send operation, owns sent frame until completion.
+ * Zero-copy send completes twice, frame is released on notification.
+ */
+struct SendOp
+{
+   int fd;
+   unsigned id;
+   ByteBuffer buf;
+};
+
+/* Client connection state. */
+struct UringConn
+{
+   UringConn(int fd, unsigned id, size_t limit)
+      : conn(fd, id, limit), inflight(0) {
+   }
+
+   Connection conn;
+   std::deque<SendOp*> queued; // Waiting for submission
+   unsigned inflight;          // Sends in submitted chain
+};
+
+class UringLoop::Private
+{
+   public:
+   Private(UringLoop* loop)
+      : q(loop), ring(-1), sq_local(0), sqes(NULL), cqes(NULL),
+        sq_ptr(NULL), cq_ptr(NULL), sqes_ptr(NULL), sq_len(0), cq_len(0), sqes_len(0),
+        br(NULL), br_len(0), br_tail(0), bufs(NULL),
+        multishot_accept(true), multishot_recv(true), send_zc(false), next_id(0)
+   {
+      interval.tv_sec = HousekeepingInterval / 1000;
+      interval.tv_nsec = (HousekeepingInterval % 1000) * 1000000;
+   }
+
+   UringLoop* q;
+   int ring;
+
+   // Submission queue
+   unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+   unsigned sq_entries, sq_local;
+   io_uring_sqe* sqes;
+
+   // Completion queue
+   unsigned *cq_head, *cq_tail, *cq_mask;
+   io_uring_cqe* cqes;
+
+   // Ring mappings
+   void *sq_ptr, *cq_ptr, *sqes_ptr;
+   size_t sq_len, cq_len, sqes_len;
+
+   // Provided buffer ring, tail overlays the first entry
+   io_uring_buf* br;
+   size_t br_len;
+   unsigned br_tail;
+   char* bufs;
+
+   // Kernel capabilities
+   bool multishot_accept;
+   bool multishot_recv;
+   bool send_zc;
+
+   // Connections indexed by fd
+   std::vector<UringConn*> conns;
+   unsigned next_id;
+
+   // Housekeeping period
+   __kernel_timespec interval;
+
+   /* Ring management. */
+   unsigned sq_free();
+   io_uring_sqe* sqe();
+   int enter(unsigned wait);
+   void provide(unsigned bid);
+   void publish();
+
+   /* Requests. */
+   void armAccept();
+   void armRecv(UringConn* c);
+   void armTimer();
+   void armWake();
+   void flush(UringConn* c);
+
+   /* Completions. */
+   void complete(const io_uring_cqe& cqe);
+   void onAccept(const io_uring_cqe& cqe);
+   void onRecv(const io_uring_cqe& cqe);
+   void onSend(const io_uring_cqe& cqe);
+   void onTimer(const io_uring_cqe& cqe);
+   void onWake(const io_uring_cqe& cqe);
+
+   /* Connections. */
+   UringConn* lookup(int fd, unsigned id);
+   void disconnect(UringConn* c);
+};
+
+unsigned UringLoop::Private::sq_free()
+{
+   return sq_entries - (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+}
+
+io_uring_sqe* UringLoop::Private::sqe()
+{
+   // Flush pending submissions if ring is full
+   if(sq_free() == 0)
+      enter(0);
+   if(sq_free() == 0) {
+      error_msg("Server: io_uring submission queue overflow");
+      return NULL;
+   }
+
+   // Claim entry
+   unsigned idx = sq_local & *sq_mask;
+   io_uring_sqe* s = &sqes[idx];
+   memset(s, 0, sizeof(io_uring_sqe));
+   sq_array[idx] = idx;
+   ++sq_local;
+   return s;
+}
+
+int UringLoop::Private::enter(unsigned wait)
+{
+   // Publish claimed entries
+   unsigned submit = sq_local - *sq_tail;
+   __atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+   if(submit == 0 && wait == 0)
+      return 0;
+
+   unsigned flags = (wait > 0) ? IORING_ENTER_GETEVENTS : 0;
+   return sys_uring_enter(ring, submit, wait, flags);
+}
+
+void UringLoop::Private::provide(unsigned bid)
+{
+   io_uring_buf* b = &br[br_tail & (URING_BUFFERS - 1)];
+   b->addr = (uintptr_t) (bufs + bid * URING_BUFSIZE);
+   b->len = URING_BUFSIZE;
+   b->bid = bid;
+   ++br_tail;
+}
+
+void UringLoop::Private::publish()
+{
+   // Don't use io_uring_buf_ring::bufs, the flexible array
+   // is misplaced in C++ due to non-zero sized empty struct
+   __atomic_store_n(&br[0].resv, (uint16_t) br_tail, __ATOMIC_RELEASE);
+}
+
+void UringLoop::Private::armAccept()
+{
+   io_uring_sqe* s = sqe();
+   if(s == NULL)
+      return;
+
+   s->opcode = IORING_OP_ACCEPT;
+   s->fd = q->server()->sock();
+   if(multishot_accept)
+      s->ioprio = IORING_ACCEPT_MULTISHOT;
+   s->user_data = TagAccept;
+}
+
+void UringLoop::Private::armRecv(UringConn* c)
+{
+   io_uring_sqe* s = sqe();
+   if(s == NULL)
+      return;
+
+   // Receive into provided buffers
+   s->opcode = IORING_OP_RECV;
+   s->fd = c->conn.fd();
+   s->flags = IOSQE_BUFFER_SELECT;
+   s->buf_group = URING_BGID;
+   if(multishot_recv)
+      s->ioprio = IORING_RECV_MULTISHOT;
+   else
+      s->len = URING_BUFSIZE;
+   s->user_data = ((uint64_t) c->conn.id() << 32) | ((uint64_t) c->conn.fd() << 3) | TagRecv;
+}
+
+void UringLoop::Private::armTimer()
+{
+   io_uring_sqe* s = sqe();
+   if(s == NULL)
+      return;
+
+   s->opcode = IORING_OP_TIMEOUT;
+   s->fd = -1;
+   s->addr = (uintptr_t) &interval;
+   s->len = 1;
+   s->user_data = TagTimer;
+}
+
+void UringLoop::Private::armWake()
+{
+   io_uring_sqe* s = sqe();
+   if(s == NULL)
+      return;
+
+   // Counter is read by drain()
+   s->opcode = IORING_OP_POLL_ADD;
+   s->fd = q->wakefd();
+   s->poll32_events = POLLIN;
+   s->user_data = TagWake;
+}
+
+void UringLoop::Private::flush(UringConn* c)
+{
+   // Ordering between separate chains is not guaranteed,
+   // wait until the submitted chain completes
+   if(c->inflight > 0 || c->queued.empty())
+      return;
+
+   // Chain must not be split between submissions
+   if(sq_free() == 0)
+      enter(0);
+
+   unsigned n = c->queued.size();
+   if(n > sq_free())
+      n = sq_free();
+
+   // Submit linked send chain
+   for(unsigned i = 0; i < n; ++i) {
+      SendOp* op = c->queued.front();
+      c->queued.pop_front();
+
+      io_uring_sqe* s = sqe();
+      s->opcode = IORING_OP_SEND;
+#ifdef IORING_CQE_F_NOTIF
+      if(send_zc && op->buf.size() >= ZeroCopyMin)
+         s->opcode = IORING_OP_SEND_ZC;
+#endif
+      s->fd = op->fd;
+      s->addr = (uintptr_t) op->buf.data();
+      s->len = op->buf.size();
+      s->msg_flags = MSG_WAITALL|MSG_NOSIGNAL;
+      if(i + 1 < n)
+         s->flags = IOSQE_IO_LINK;
+      s->user_data = ((uint64_t) (uintptr_t) op) | TagSend;
+      ++c->inflight;
+   }
+}
+
+void UringLoop::Private::complete(const io_uring_cqe& cqe)
+{
+   switch(cqe.user_data & TagMask) {
+   case TagAccept: onAccept(cqe); break;
+   case TagRecv:   onRecv(cqe);   break;
+   case TagSend:   onSend(cqe);   break;
+   case TagTimer:  onTimer(cqe);  break;
+   case TagWake:   onWake(cqe);   break;
+   default: break;
+   }
+}
+
+void UringLoop::Private::onAccept(const io_uring_cqe& cqe)
+{
+   // Accept client
+   if(cqe.res >= 0) {
+      int fd = cqe.res;
+      UringConn* c = new UringConn(fd, ++next_id, q->server()->maxFrame());
+      if((size_t) fd >= conns.size())
+         conns.resize(fd + 1, NULL);
+      conns[fd] = c;
+      log_msg("Server: client connected (socket fd %d)", fd);
+      armRecv(c);
+   }
+   else if(cqe.res == -EINVAL && multishot_accept) {
+      debug_msg("multishot accept not supported, falling back to single-shot");
+      multishot_accept = false;
+   }
+
+   // Rearm terminated accept
+   if(!(cqe.flags & IORING_CQE_F_MORE) && q->server()->isOpen())
+      armAccept();
+}
+
+void UringLoop::Private::onRecv(const io_uring_cqe& cqe)
+{
+   int fd = (cqe.user_data >> 3) & 0x1fffffff;
+   UringConn* c = lookup(fd, cqe.user_data >> 32);
+   bool more = cqe.flags & IORING_CQE_F_MORE;
+
+   // Consume and recycle provided buffer
+   if(cqe.flags & IORING_CQE_F_BUFFER) {
+      unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if(c != NULL && cqe.res > 0)
+         c->conn.feed(bufs + bid * URING_BUFSIZE, cqe.res);
+      provide(bid);
+   }
+
+   // Stale completion
+   if(c == NULL)
+      return;
+
+   // Handle complete packets
+   if(cqe.res > 0) {
+      Packet pkt;
+      while(c->conn.next(pkt))
+         q->handle(fd, pkt);
+
+      // Client announced frame over limit
+      if(c->conn.oversized()) {
+         disconnect(c);
+         return;
+      }
+
+      if(!more)
+         armRecv(c);
+      return;
+   }
+
+   // Provided buffers exhausted, retry with recycled buffers
+   if(cqe.res == -ENOBUFS) {
+      if(!more)
+         armRecv(c);
+      return;
+   }
+
+   // Multishot receive not supported
+   if(cqe.res == -EINVAL && multishot_recv) {
+      debug_msg("multishot recv not supported, falling back to single-shot");
+      multishot_recv = false;
+      armRecv(c);
+      return;
+   }
+
+   // EOF or error
+   disconnect(c);
+}
+
+void UringLoop::Private::onSend(const io_uring_cqe& cqe)
+{
+   SendOp* op = (SendOp*) (uintptr_t) (cqe.user_data & ~((uint64_t) TagMask));
+
+#ifdef IORING_CQE_F_NOTIF
+   // Zero-copy frame is no longer referenced
+   if(cqe.flags & IORING_CQE_F_NOTIF) {
+      delete op;
+      return;
+   }
+#endif
+
+   UringConn* c = lookup(op->fd, op->id);
+   if(c != NULL) {
+      --c->inflight;
+
+      // Failed or cancelled link
+      if(cqe.res < 0 || (size_t) cqe.res < op->buf.size()) {
+         debug_msg("send failed on fd %d (%d)", op->fd, cqe.res);
+         disconnect(c);
+      }
+      else if(c->inflight == 0) {
+         flush(c);
+      }
+   }
+
+   // Zero-copy frame is held until notification
+   if(!(cqe.flags & IORING_CQE_F_MORE))
+      delete op;
+}
+
+void UringLoop::Private::onTimer(const io_uring_cqe&)
+{
+   // Release memory held by idle clients
+   for(size_t i = 0; i < conns.size(); ++i) {
+      if(conns[i] != NULL)
+         conns[i]->conn.trim();
+   }
+
+   q->housekeeping();
+
+   if(q->server()->isOpen())
+      armTimer();
+}
+
+void UringLoop::Private::onWake(const io_uring_cqe&)
+{
+   q->drain();
+
+   if(q->server()->isOpen())
+      armWake();
+}
+
+UringConn* UringLoop::Private::lookup(int fd, unsigned id)
+{
+   if(fd < 0 || (size_t) fd >= conns.size())
+      return NULL;
+
+   UringConn* c = conns[fd];
+   if(c == NULL || c->conn.id() != id)
+      return NULL;
+
+   return c;
+}
+
+void UringLoop::Private::disconnect(UringConn* c)
+{
+   int fd = c->conn.fd();
+   log_msg("Server: client disconnected (socket fd %d)", fd);
+   conns[fd] = NULL;
+   q->disconnected(fd);
+
+   // Terminate pending receive and close
+   shutdown(fd, SHUT_RDWR);
+   close(fd);
+
+   // Free unsent data, submitted operations are freed on completion
+   while(!c->queued.empty()) {
+      delete c->queued.front();
+      c->queued.pop_front();
+   }
+
+   delete c;
+}
+
+UringLoop::UringLoop(ServerSocket* server)
+   : EventLoop(server), d(new Private(this))
+{
+}
+
+UringLoop::~UringLoop()
+{
+   // Close clients
+   for(size_t i = 0; i < d->conns.size(); ++i) {
+      if(d->conns[i] != NULL)
+         d->disconnect(d->conns[i]);
+   }
+
+   // Unmap rings
+   if(d->sqes_ptr != NULL)
+      munmap(d->sqes_ptr, d->sqes_len);
+   if(d->cq_ptr != NULL && d->cq_ptr != d->sq_ptr)
+      munmap(d->cq_ptr, d->cq_len);
+   if(d->sq_ptr != NULL)
+      munmap(d->sq_ptr, d->sq_len);
+   if(d->ring >= 0)
+      close(d->ring);
+
+   // Free buffers
+   if(d->br != NULL)
+      munmap(d->br, d->br_len);
+   free(d->bufs);
+   delete d;
+}
+
+bool UringLoop::init()
+{
+   // Create ring
+   io_uring_params p;
+   memset(&p, 0, sizeof(p));
+   p.flags = IORING_SETUP_SUBMIT_ALL|IORING_SETUP_COOP_TASKRUN;
+   if((d->ring = sys_uring_setup(URING_ENTRIES, &p)) < 0) {
+      memset(&p, 0, sizeof(p));
+      if((d->ring = sys_uring_setup(URING_ENTRIES, &p)) < 0) {
+         debug_msg("io_uring_setup: %s", strerror(errno));
+         return false;
+      }
+   }
+
+   // Map submission and completion rings
+   d->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+   d->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+   if(p.features & IORING_FEAT_SINGLE_MMAP) {
+      if(d->cq_len > d->sq_len)
+         d->sq_len = d->cq_len;
+      d->cq_len = d->sq_len;
+   }
+
+   void* ptr = mmap(NULL, d->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring, IORING_OFF_SQ_RING);
+   if(ptr == MAP_FAILED)
+      return false;
+   d->sq_ptr = d->cq_ptr = ptr;
+
+   if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+      ptr = mmap(NULL, d->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring, IORING_OFF_CQ_RING);
+      if(ptr == MAP_FAILED) {
+         d->cq_ptr = NULL;
+         return false;
+      }
+      d->cq_ptr = ptr;
+   }
+
+   d->sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+   ptr = mmap(NULL, d->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, d->ring, IORING_OFF_SQES);
+   if(ptr == MAP_FAILED)
+      return false;
+   d->sqes_ptr = ptr;
+   d->sqes = (io_uring_sqe*) ptr;
+
+   // Resolve ring fields
+   char* sq = (char*) d->sq_ptr;
+   d->sq_head  = (unsigned*) (sq + p.sq_off.head);
+   d->sq_tail  = (unsigned*) (sq + p.sq_off.tail);
+   d->sq_mask  = (unsigned*) (sq + p.sq_off.ring_mask);
+   d->sq_array = (unsigned*) (sq + p.sq_off.array);
+   d->sq_entries = p.sq_entries;
+   d->sq_local = *d->sq_tail;
+
+   char* cq = (char*) d->cq_ptr;
+   d->cq_head = (unsigned*) (cq + p.cq_off.head);
+   d->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+   d->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+   d->cqes    = (io_uring_cqe*) (cq + p.cq_off.cqes);
+
+   // Register provided buffer ring
+   d->br_len = URING_BUFFERS * sizeof(io_uring_buf);
+   ptr = mmap(NULL, d->br_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+   if(ptr == MAP_FAILED)
+      return false;
+   d->br = (io_uring_buf*) ptr;
+
+   io_uring_buf_reg reg;
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uintptr_t) d->br;
+   reg.ring_entries = URING_BUFFERS;
+   reg.bgid = URING_BGID;
+   if(sys_uring_register(d->ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      debug_msg("provided buffer ring not supported: %s", strerror(errno));
+      return false;
+   }
+
+   // Provide receive buffers
+   if((d->bufs = (char*) malloc(URING_BUFFERS * URING_BUFSIZE)) == NULL)
+      return false;
+   for(unsigned bid = 0; bid < URING_BUFFERS; ++bid)
+      d->provide(bid);
+   d->publish();
+
+#ifdef IORING_CQE_F_NOTIF
+   // Probe zero-copy send
+   size_t probe_len = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+   io_uring_probe* probe = (io_uring_probe*) calloc(1, probe_len);
+   if(probe != NULL && sys_uring_register(d->ring, IORING_REGISTER_PROBE, probe, 256) == 0) {
+      d->send_zc = probe->last_op >= IORING_OP_SEND_ZC &&
+                   (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+   }
+   free(probe);
+   debug_msg("zero-copy send %s", d->send_zc ? "supported" : "not supported");
+#endif
+
+   return true;
+}
+
+void UringLoop::run()
+{
+   log_msg("Server: listening on fd %d", server()->sock());
+   d->armAccept();
+   d->armTimer();
+   d->armWake();
+
+   // Process event loop
+   while(server()->isOpen()) {
+
+      // Submit queued requests and wait for completions
+      if(d->enter(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+         error_msg("Server: io_uring_enter failed: %s", strerror(errno));
+         break;
+      }
+
+      // Reap completions in batch
+      unsigned head = *d->cq_head;
+      unsigned tail = __atomic_load_n(d->cq_tail, __ATOMIC_ACQUIRE);
+      for(; head != tail; ++head) {
+         io_uring_cqe cqe = d->cqes[head & *d->cq_mask];
+         d->complete(cqe);
+      }
+      __atomic_store_n(d->cq_head, head, __ATOMIC_RELEASE);
+
+      // Return recycled buffers to kernel
+      d->publish();
+   }
+}
+
+int UringLoop::send(int fd, ByteBuffer& frame)
+{
+   if(fd < 0 || (size_t) fd >= d->conns.size() || d->conns[fd] == NULL)
+      return -1;
+
+   // Queue frame, submitted with next io_uring_enter()
+   UringConn* c = d->conns[fd];
+   SendOp* op = new SendOp;
+   op->fd = fd;
+   op->id = c->conn.id();
+   op->buf.swap(frame);
+
+   int size = op->buf.size();
+   c->queued.push_back(op);
+   d->flush(c);
+   return size;
+}
+
+#else // HAVE_IO_URING
+
+class UringLoop::Private
+{
+};
+
+UringLoop::UringLoop(ServerSocket* server)
+   : EventLoop(server), d(NULL)
+{
+}
+
+UringLoop::~UringLoop()
+{
+}
+
+bool UringLoop::init()
+{
+   // Built without io_uring support
+   return false;
+}
+
+void UringLoop::run()
+{
+}
+
+int UringLoop::send(int fd, ByteBuffer& frame)
+{
+   return -1;
+}
+
+#endif // HAVE_IO_URING
+/** @} */
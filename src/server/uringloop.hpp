@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file uringloop.hpp
+    \brief Linux io_uring event engine.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __uringloop_hpp__
+#define __uringloop_hpp__
+#include "eventloop.hpp"
+
+/** Linux io_uring event engine.
+  * Uses multishot accept and multishot recv into a provided buffer ring,
+  * responses are submitted as linked send chains and completions
+  * are reaped in batches with a single io_uring_enter() per iteration.
+  * Engine is not supported (init() fails) if built without io_uring
+  * headers or if running kernel lacks provided buffer rings.
+  */
+class UringLoop : public EventLoop
+{
+   public:
+   UringLoop(ServerSocket* server);
+   ~UringLoop();
+
+   const char* name() { return "uring"; }
+   bool init();
+   void run();
+   int send(int fd, ByteBuffer& frame);
+
+   private:
+
+   /* Opaque pointer */
+   class Private;
+   Private* d;
+};
+
+#endif // __uringloop_hpp__
+/** @} */
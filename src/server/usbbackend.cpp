@@ -0,0 +1,134 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file usbbackend.cpp
+    \brief USB device backend interface.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#include "usbbackend.hpp"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Device attributes directory. */
+#define SYSFS_PATH "/sys/bus/usb/devices"
+
+/* Read first line of sysfs attribute. */
+static std::string read_attr(const std::string& dir, const char* name) {
+   char buf[256] = { 0 };
+   std::string path = dir + "/" + name;
+   FILE* fp = fopen(path.c_str(), "r");
+   if(fp != NULL) {
+      if(fgets(buf, sizeof(buf), fp) != NULL)
+         buf[strcspn(buf, "\n")] = '\0';
+      fclose(fp);
+   }
+   return buf;
+}
+
+/** libusb implementation. */
+class LibusbBackend : public UsbBackend
+{
+   public:
+   const char* name() { return "libusb"; }
+   bool usbfs() { return true; }
+
+   void init() { ::usb_init(); }
+   int findBusses() { return ::usb_find_busses(); }
+   int findDevices() { return ::usb_find_devices(); }
+   struct usb_bus* busses() { return ::usb_get_busses(); }
+
+   void serials(SerialMap& map) {
+      // Serials are read from sysfs, libusb-0.1 can't read them without opening device
+      DIR* dir = opendir(SYSFS_PATH);
+      while(dir != NULL) {
+         dirent* e = readdir(dir);
+         if(e == NULL)
+            break;
+         if(e->d_name[0] == '.' || strchr(e->d_name, ':') != NULL)
+            continue; // Interfaces
+
+         std::string path = std::string(SYSFS_PATH "/") + e->d_name;
+         std::string serial = read_attr(path, "serial");
+         if(!serial.empty()) {
+            unsigned bus = atoi(read_attr(path, "busnum").c_str());
+            unsigned devnum = atoi(read_attr(path, "devnum").c_str());
+            map[std::make_pair(bus, devnum)] = serial;
+         }
+      }
+      if(dir != NULL)
+         closedir(dir);
+   }
+
+   usb_dev_handle* open(struct usb_device* dev) { return ::usb_open(dev); }
+   int close(usb_dev_handle* h) { return ::usb_close(h); }
+   int setConfiguration(usb_dev_handle* h, int configuration) { return ::usb_set_configuration(h, configuration); }
+   int setAltInterface(usb_dev_handle* h, int alternate) { return ::usb_set_altinterface(h, alternate); }
+   int resetEp(usb_dev_handle* h, unsigned ep) { return ::usb_resetep(h, ep); }
+   int clearHalt(usb_dev_handle* h, unsigned ep) { return ::usb_clear_halt(h, ep); }
+   int reset(usb_dev_handle* h) { return ::usb_reset(h); }
+   int claimInterface(usb_dev_handle* h, int index) { return ::usb_claim_interface(h, index); }
+   int releaseInterface(usb_dev_handle* h, int index) { return ::usb_release_interface(h, index); }
+
+   int getKernelDriver(usb_dev_handle* h, int index, char* name, unsigned namelen) {
+#if LIBUSB_HAS_GET_DRIVER_NP
+      return ::usb_get_driver_np(h, index, name, namelen);
+#else
+      return -1;
+#endif
+   }
+
+   int detachKernelDriver(usb_dev_handle* h, int index) {
+#if LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
+      return ::usb_detach_kernel_driver_np(h, index);
+#else
+      return 0;
+#endif
+   }
+
+   int controlMsg(usb_dev_handle* h, int reqtype, int request, int value, int index,
+                  char* data, int size, int timeout) {
+      return ::usb_control_msg(h, reqtype, request, value, index, data, size, timeout);
+   }
+
+   int bulkRead(usb_dev_handle* h, int ep, char* data, int size, int timeout) {
+      return ::usb_bulk_read(h, ep, data, size, timeout);
+   }
+
+   int bulkWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout) {
+      return ::usb_bulk_write(h, ep, data, size, timeout);
+   }
+
+   int interruptRead(usb_dev_handle* h, int ep, char* data, int size, int timeout) {
+      return ::usb_interrupt_read(h, ep, data, size, timeout);
+   }
+
+   int interruptWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout) {
+      return ::usb_interrupt_write(h, ep, data, size, timeout);
+   }
+};
+
+UsbBackend* UsbBackend::libusb()
+{
+   return new LibusbBackend();
+}
+
+/** @} */
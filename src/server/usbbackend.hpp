@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file usbbackend.hpp
+    \brief USB device backend interface.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    \addtogroup server
+    @{
+  */
+#pragma once
+#ifndef __usbbackend_hpp__
+#define __usbbackend_hpp__
+#include "usbnet.h"
+#include <map>
+#include <string>
+
+/** Serial numbers by (bus, device number). */
+typedef std::map<std::pair<unsigned, unsigned>, std::string> SerialMap;
+
+/** Interface to USB devices.
+  * Mirrors libusb-0.1 calls used by the service, so devices may be
+  * provided by libusb or simulated. Bus list is guarded by caller,
+  * calls on one handle are made from one thread at a time.
+  */
+class UsbBackend
+{
+   public:
+   virtual ~UsbBackend() {}
+
+   /** Return implementation name. */
+   virtual const char* name() = 0;
+
+   /** Return true if handle fd is usbfs descriptor suitable for URB queueing. */
+   virtual bool usbfs() = 0;
+
+   /* Enumeration. */
+   virtual void init() = 0;
+   virtual int findBusses() = 0;
+   virtual int findDevices() = 0;
+   virtual struct usb_bus* busses() = 0;
+
+   /** Fill serial numbers of enumerated devices. */
+   virtual void serials(SerialMap& map) = 0;
+
+   /* Device controls, return values follow libusb. */
+   virtual usb_dev_handle* open(struct usb_device* dev) = 0;
+   virtual int close(usb_dev_handle* h) = 0;
+   virtual int setConfiguration(usb_dev_handle* h, int configuration) = 0;
+   virtual int setAltInterface(usb_dev_handle* h, int alternate) = 0;
+   virtual int resetEp(usb_dev_handle* h, unsigned ep) = 0;
+   virtual int clearHalt(usb_dev_handle* h, unsigned ep) = 0;
+   virtual int reset(usb_dev_handle* h) = 0;
+   virtual int claimInterface(usb_dev_handle* h, int index) = 0;
+   virtual int releaseInterface(usb_dev_handle* h, int index) = 0;
+   virtual int getKernelDriver(usb_dev_handle* h, int index, char* name, unsigned namelen) = 0;
+   virtual int detachKernelDriver(usb_dev_handle* h, int index) = 0;
+
+   /* Transfers, return transferred bytes or negative errno. */
+   virtual int controlMsg(usb_dev_handle* h, int reqtype, int request, int value, int index,
+                          char* data, int size, int timeout) = 0;
+   virtual int bulkRead(usb_dev_handle* h, int ep, char* data, int size, int timeout) = 0;
+   virtual int bulkWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout) = 0;
+   virtual int interruptRead(usb_dev_handle* h, int ep, char* data, int size, int timeout) = 0;
+   virtual int interruptWrite(usb_dev_handle* h, int ep, char* data, int size, int timeout) = 0;
+
+   /** Create libusb implementation. */
+   static UsbBackend* libusb();
+};
+
+#endif // __usbbackend_hpp__
+/** @} */
@@ -23,8 +23,11 @@
     @{
   */
 #include "usbservice.hpp"
+#include "simusbfs.hpp"
+#include "simbackend.hpp"
 #include "cmdflags.hpp"
 #include "common.h"
+#include "usbcap.h"
 #include <csignal>
 #include <cstdlib>
 
@@ -44,10 +47,32 @@ int main(int argc, char* argv[])
 {
    // Command line options
    int host = ServerSocket::All;
+   int port = 22222;
+   std::string engine("auto");
+   std::string backend("libusb");
+   std::string simConfig;
+   std::string usbfs("kernel");
+   unsigned urbDepth = 8;
+   unsigned urbSize = 16384;
+   unsigned enumTtl = 1000;
+   unsigned chunkWindow = 4 << 20;
+   std::string capture;
+   unsigned snaplen = USBCAP_SNAPLEN;
 
    // Parse command line arguments
    CmdFlags cmd(argc, argv);
-   cmd.add('l', "local", "Bind to localhost only.")
+   cmd.add('l', "local", "Bind to localhost only.", "", false)
+      .add('p', "port",  "Listening port.", "22222")
+      .add('e', "engine", "Event engine (auto, uring, epoll, poll).", "auto")
+      .add('b', "backend", "Device backend (libusb, sim).", "libusb")
+      .add('m', "sim-config", "Simulated devices configuration file.")
+      .add('u', "usbfs",  "Bulk transfer backend (kernel, sim).", "kernel")
+      .add('D', "urb-depth", "URBs in flight per bulk transfer, 0 for synchronous.", "8")
+      .add('S', "urb-size", "URB size in bytes.", "16384")
+      .add('T', "enum-ttl", "Enumeration snapshot lifetime in ms, 0 to rescan on each request.", "1000")
+      .add('W', "chunk-window", "Bytes of write chunks queued per transfer.", "4194304")
+      .add('c', "capture", "Write USB transfers to pcap file (usbmon format).")
+      .add('s', "snaplen", "Captured bytes of transfer data.", "65536")
       .add('q', "quiet", "Quiet output", "", false)
       .add('?', "help",  "Print help",   "", false);
 
@@ -65,6 +90,39 @@ int main(int argc, char* argv[])
       case 'l':
          host = ServerSocket::Local;
          break;
+      case 'p':
+         port = atoi(m.second.c_str());
+         break;
+      case 'e':
+         engine = m.second;
+         break;
+      case 'b':
+         backend = m.second;
+         break;
+      case 'm':
+         simConfig = m.second;
+         break;
+      case 'u':
+         usbfs = m.second;
+         break;
+      case 'D':
+         urbDepth = atoi(m.second.c_str());
+         break;
+      case 'S':
+         urbSize = atoi(m.second.c_str());
+         break;
+      case 'T':
+         enumTtl = atoi(m.second.c_str());
+         break;
+      case 'W':
+         chunkWindow = atoi(m.second.c_str());
+         break;
+      case 'c':
+         capture = m.second;
+         break;
+      case 's':
+         snaplen = atoi(m.second.c_str());
+         break;
       case '?':
          cmd.printHelp();
          return EXIT_SUCCESS;
@@ -84,7 +142,26 @@ int main(int argc, char* argv[])
 
    // Create server socket
    UsbService service;
-   if(service.listen(22222, host) != Socket::Ok) {
+   service.setEngine(engine);
+   if(backend == "sim") {
+      SimBackend* sim = new SimBackend();
+      if(!simConfig.empty() && !sim->load(simConfig.c_str())) {
+         delete sim;
+         return EXIT_FAILURE;
+      }
+      service.setBackend(sim);
+   }
+   else if(backend != "libusb") {
+      error_msg("Server: unknown device backend '%s'", backend.c_str());
+      return EXIT_FAILURE;
+   }
+   if(usbfs == "sim")
+      service.setUrbQueue(new SimUsbfs(), urbDepth, urbSize);
+   else
+      service.setUrbQueue(UsbfsOps::kernel(), urbDepth, urbSize);
+   service.setEnumTtl(enumTtl);
+   service.setChunkWindow(chunkWindow);
+   if(service.listen(port, host) != Socket::Ok) {
       return EXIT_FAILURE;
    }
 
@@ -96,8 +173,13 @@ int main(int argc, char* argv[])
    sa.sa_flags = 0;
    sigaction(SIGINT, &sa, NULL);
 
+   // Start capture
+   if(!capture.empty() && usbcap_open(capture.c_str(), snaplen) != 0)
+      return EXIT_FAILURE;
+
    // Process client requests
    service.run();
+   usbcap_close();
 
    // Close socket
    if(service.close() != Socket::Ok) {
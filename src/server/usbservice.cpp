@@ -23,26 +23,193 @@
     @{
   */
 #include "usbservice.hpp"
+#include "deviceworker.hpp"
+#include "enumcache.hpp"
+#include "urbqueue.hpp"
+#include "usbbackend.hpp"
 #include "protocol.hpp"
-#include <netinet/tcp.h>
+#include "usbcap.h"
+#include "common.h"
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <vector>
+
+/* Request frame limit over chunk window, for headers and writes of
+ * clients that don't fit writes in it.
+ */
+static const size_t FrameSlack = 4 << 20;
 
 UsbService::UsbService(int fd)
    : ServerSocket(fd)
 {
-   // Disable TCP buffering
-   int flag = 1;
-   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int));
+   pthread_mutex_init(&mLock, NULL);
+   pthread_mutex_init(&mBusLock, NULL);
+   mEnum = new EnumCache(this);
+   mBackend = UsbBackend::libusb();
+
+   // Default URB queueing
+   mUsbfs = UsbfsOps::kernel();
+   mUrbDepth = 8;
+   mUrbSize = 16384;
+
+   // Default chunk window
+   mChunkWindow = 4 << 20;
+   setMaxFrame(mChunkWindow + FrameSlack);
 }
 
 UsbService::~UsbService()
 {
+   // Stop device workers, retired workers stay mapped until finished
+   std::map<int, DeviceWorker*>::iterator w;
+   for(w = mWorkers.begin(); w != mWorkers.end(); ++w) {
+      if(std::find(mRetired.begin(), mRetired.end(), w->second) == mRetired.end())
+         delete w->second;
+   }
+   mWorkers.clear();
+   std::list<DeviceWorker*>::iterator r;
+   for(r = mRetired.begin(); r != mRetired.end(); ++r)
+      delete *r;
+   mRetired.clear();
+
    // Close open devices
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
+   std::vector<usb_dev_handle*> handles = mHandles.clear();
+   std::vector<usb_dev_handle*>::iterator i;
+   for(i = handles.begin(); i != handles.end(); ++i) {
       log_msg("UsbService: closing open device %p", *i);
-      ::usb_close(*i);
+      mBackend->close(*i);
+   }
+   delete mEnum;
+   pthread_mutex_destroy(&mLock);
+   pthread_mutex_destroy(&mBusLock);
+   delete mUsbfs;
+   delete mBackend;
+}
+
+void UsbService::setBackend(UsbBackend* backend)
+{
+   delete mBackend;
+   mBackend = backend;
+   log_msg("UsbService: %s device backend", backend->name());
+}
+
+void UsbService::setUrbQueue(UsbfsOps* ops, unsigned depth, unsigned size)
+{
+   delete mUsbfs;
+   mUsbfs = ops;
+   mUrbDepth = depth;
+   mUrbSize = (size > 0) ? size : 16384;
+   log_msg("UsbService: %s usbfs, %u URBs of %u bytes in flight", ops->name(), mUrbDepth, mUrbSize);
+}
+
+void UsbService::setEnumTtl(unsigned ms)
+{
+   mEnum->setTtl(ms);
+   log_msg("UsbService: enumeration snapshot expires after %u ms", ms);
+}
+
+void UsbService::setChunkWindow(size_t bytes)
+{
+   // Clients send larger writes in chunks, other requests are small
+   mChunkWindow = (bytes > 0) ? bytes : 4 << 20;
+   setMaxFrame(mChunkWindow + FrameSlack);
+   log_msg("UsbService: %u bytes of write chunks queued per transfer", (unsigned) mChunkWindow);
+}
+
+bool UsbService::deadline(Packet& in, int& timeout)
+{
+   // No timeout or arrival unknown
+   if(timeout <= 0 || in.stamp() == 0)
+      return true;
+
+   // Shed or shorten
+   long long left = (in.stamp() + (long long) timeout * 1000 - now_us()) / 1000;
+   if(left <= 0) {
+      debug_msg("request 0x%02x shed %lld ms past deadline", in.op(), -left);
+      mStats.shed();
+      return false;
    }
-   mOpenList.clear();
+
+   timeout = left;
+   return true;
+}
+
+/* Prepare captured transfer, return false if capture is off. */
+static bool capture(usbcap_urb_t* urb, usb_dev_handle* h, int xfer, int ep, const uint8_t* setup = NULL) {
+   if(!usbcap_enabled())
+      return false;
+
+   struct usb_device* dev = h->device;
+   int busnum = (dev != NULL && dev->bus != NULL) ? atoi(dev->bus->dirname) : 0;
+   usbcap_urb(urb, xfer, ep, busnum, (dev != NULL) ? dev->devnum : 0, setup);
+   return true;
+}
+
+int UsbService::bulk_transfer(usb_dev_handle* h, int ep, char* data, int size, int timeout)
+{
+   usbcap_urb_t urb;
+   bool captured = capture(&urb, h, UsbCapBulk, ep);
+   if(captured)
+      usbcap_submit(&urb, data, size);
+
+   // Pipelined URBs
+   int res = UrbQueue::NotSupported;
+   if(mUrbDepth > 0 && (mBackend->usbfs() || mUsbfs->simulated())) {
+      UrbQueue queue(mUsbfs, h->fd, mUrbDepth, mUrbSize);
+      res = queue.bulk(ep, data, size, timeout);
+   }
+
+   // Synchronous transfer
+   if(res == UrbQueue::NotSupported) {
+      if(ep & USB_ENDPOINT_IN)
+         res = mBackend->bulkRead(h, ep, data, size, timeout);
+      else
+         res = mBackend->bulkWrite(h, ep, data, size, timeout);
+   }
+
+   if(captured)
+      usbcap_complete(&urb, data, res);
+   return res;
+}
+
+int UsbService::control_transfer(usb_dev_handle* h, int reqtype, int request, int value, int index,
+                                 char* data, int size, int timeout)
+{
+   // Setup packet in wire order
+   uint8_t setup[8] = { (uint8_t) reqtype, (uint8_t) request,
+                        (uint8_t) value, (uint8_t) (value >> 8),
+                        (uint8_t) index, (uint8_t) (index >> 8),
+                        (uint8_t) size, (uint8_t) (size >> 8) };
+   usbcap_urb_t urb;
+   bool captured = capture(&urb, h, UsbCapControl, reqtype & USB_ENDPOINT_IN, setup);
+   if(captured)
+      usbcap_submit(&urb, data, size);
+
+   int res = mBackend->controlMsg(h, reqtype, request, value, index, data, size, timeout);
+
+   if(captured)
+      usbcap_complete(&urb, data, res);
+   return res;
+}
+
+int UsbService::interrupt_transfer(usb_dev_handle* h, int ep, char* data, int size, int timeout)
+{
+   usbcap_urb_t urb;
+   bool captured = capture(&urb, h, UsbCapInterrupt, ep);
+   if(captured)
+      usbcap_submit(&urb, data, size);
+
+   int res;
+   if(ep & USB_ENDPOINT_IN)
+      res = mBackend->interruptRead(h, ep, data, size, timeout);
+   else
+      res = mBackend->interruptWrite(h, ep, data, size, timeout);
+
+   if(captured)
+      usbcap_complete(&urb, data, res);
+   return res;
 }
 
 bool UsbService::handle(int fd, Packet& pkt)
@@ -51,15 +218,149 @@ bool UsbService::handle(int fd, Packet& pkt)
    if(pkt.size() <= 0)
       return false;
 
+   // Enumeration and open are processed immediately
+   switch(pkt.op())
+   {
+      case NullRequest:
+      case UsbInit:
+      case UsbFindBusses:
+      case UsbFindDevices:
+      case UsbOpen:
+      case UsbStats:
+         return serve(fd, pkt);
+      default:
+         break;
+   }
+
+   // Device requests begin with device fd
+   Iterator it(pkt);
+   if(it.type() != IntegerType)
+      return serve(fd, pkt);
+
+   // Unknown or foreign device, respond immediately
+   int devfd = it.getInt();
+   std::map<int, DeviceWorker*>::iterator w = mWorkers.find(devfd);
+   if(w == mWorkers.end() || device(fd, devfd) == NULL)
+      return serve(fd, pkt);
+
+   // Queue to device worker
+   DeviceWorker* worker = w->second;
+   mStats.request(fd, devfd, pkt);
+   if(!worker->push(fd, pkt)) {
+
+      // Worker exited after close meanwhile, handle is gone
+      bool res = process(fd, pkt);
+      mStats.processed(fd, devfd, pkt);
+      return res;
+   }
+
+   // Retire worker after close, it stays mapped until finished,
+   // so later requests are queued behind the close
+   if(pkt.op() == UsbClose && std::find(mRetired.begin(), mRetired.end(), worker) == mRetired.end()) {
+      worker->finish();
+      mRetired.push_back(worker);
+   }
+
+   return true;
+}
+
+void UsbService::housekeeping()
+{
+   // Join finished workers
+   std::list<DeviceWorker*>::iterator i = mRetired.begin();
+   while(i != mRetired.end()) {
+      if((*i)->isFinished()) {
+         std::map<int, DeviceWorker*>::iterator w = mWorkers.find((*i)->devfd());
+         if(w != mWorkers.end() && w->second == *i)
+            mWorkers.erase(w);
+         mStats.removeDevice((*i)->devfd());
+         delete *i;
+         i = mRetired.erase(i);
+      }
+      else
+         ++i;
+   }
+}
+
+bool UsbService::serve(int fd, Packet& pkt)
+{
+   mStats.request(fd, -1, pkt);
+   bool res = process(fd, pkt);
+   mStats.processed(fd, -1, pkt);
+   return res;
+}
+
+void UsbService::responded(int fd, size_t size)
+{
+   mStats.response(fd, size);
+}
+
+usb_dev_handle* UsbService::device(int fd, int devfd)
+{
+   pthread_mutex_lock(&mLock);
+   usb_dev_handle* h = mHandles.find(devfd);
+   if(h != NULL && fd >= 0 && mHandles.owner(devfd) != fd)
+      h = NULL;
+   pthread_mutex_unlock(&mLock);
+   return h;
+}
+
+void UsbService::disconnected(int fd)
+{
+   // Drop pending enumeration and metrics
+   mEnum->cancel(fd);
+   mStats.removeClient(fd);
+
+   // Take session over
+   Session session;
+   pthread_mutex_lock(&mLock);
+   std::map<int, Session>::iterator s = mSessions.find(fd);
+   if(s != mSessions.end()) {
+      session = s->second;
+      mSessions.erase(s);
+   }
+
+   // Handles are unreachable for new client reusing the fd
+   std::set<int>::iterator h;
+   for(h = session.handles.begin(); h != session.handles.end(); ++h)
+      mHandles.setOwner(*h, -1);
+   pthread_mutex_unlock(&mLock);
+
+   if(!session.handles.empty())
+      log_msg("UsbService: releasing %d handles of client fd %d", (int) session.handles.size(), fd);
+
+   // Release claimed interfaces, then close handles
+   // Requests are queued behind pending requests of device workers
+   std::set< std::pair<int, int> >::iterator i;
+   for(i = session.interfaces.begin(); i != session.interfaces.end(); ++i) {
+      Packet pkt(UsbReleaseInterface);
+      pkt.addInt32(i->first);
+      pkt.addInt32(i->second);
+      pkt.finalize();
+      handle(-1, pkt);
+   }
+   for(h = session.handles.begin(); h != session.handles.end(); ++h) {
+      Packet pkt(UsbClose);
+      pkt.addInt32(*h);
+      pkt.finalize();
+      handle(-1, pkt);
+   }
+}
+
+bool UsbService::process(int fd, Packet& pkt)
+{
    // Packet handling
    switch(pkt.op())
    {
+      case NullRequest:    null_request(fd, pkt);     break;
       case UsbInit:        usb_init(fd, pkt);         break;
       case UsbFindBusses:  usb_find_busses(fd, pkt);  break;
       case UsbFindDevices: usb_find_devices(fd, pkt); break;
+      case UsbStats:       usb_stats(fd, pkt);        break;
       case UsbOpen:        usb_open(fd, pkt);         break;
       case UsbClose:       usb_close(fd, pkt);        break;
       case UsbControlMsg:  usb_control_msg(fd, pkt);  break;
+      case UsbControlBatch: usb_control_batch(fd, pkt); break;
       case UsbClaimInterface: usb_claim_interface(fd, pkt); break;
       case UsbReleaseInterface: usb_release_interface(fd, pkt); break;
       case UsbGetKernelDriver: usb_get_kernel_driver(fd, pkt); break;
@@ -73,6 +374,11 @@ bool UsbService::handle(int fd, Packet& pkt)
       case UsbReset:       usb_reset(fd, pkt); break;
       case UsbInterruptWrite: usb_interrupt_write(fd, pkt); break;
       case UsbInterruptRead: usb_interrupt_read(fd, pkt); break;
+      case UsbStreamOpen:
+      case UsbStreamCredit:
+      case UsbStreamClose: usb_stream(fd, pkt); break;
+      case UsbBulkWriteAsync: usb_bulk_write_async(fd, pkt); break;
+      case UsbDataChunk:   usb_data_chunk(fd, pkt); break;
       default:
          log_msg("%s: unhandled call type: 0x%02x (socket fd %d)", __func__, pkt.op(), fd);
          return false;
@@ -82,49 +388,81 @@ bool UsbService::handle(int fd, Packet& pkt)
    return true;
 }
 
+void UsbService::null_request(int fd, Packet&)
+{
+   // Ping, answered immediately
+   Packet pkt(NullRequest);
+   reply(fd, pkt);
+}
+
 void UsbService::usb_init(int fd, Packet& in)
 {
    // Call, no ACK
    debug_msg("called");
-   ::usb_init();
+   mBackend->init();
 }
 
 void UsbService::usb_find_busses(int fd, Packet& in)
 {
    // Call
    // Can't guarantee correct number in case of multi-client environment
-   int res = ::usb_find_busses();
+   pthread_mutex_lock(&mBusLock);
+   int res = mBackend->findBusses();
+   pthread_mutex_unlock(&mBusLock);
    debug_msg("returned %d", res);
 
    // Send result
    Packet pkt(UsbFindBusses);
    pkt.addInt32(res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_find_devices(int fd, Packet& in)
+{
+   // Optional device filter
+   std::string filter;
+   Iterator it(in);
+   if(it.type() == OctetType) {
+      uint32_t len = it.length();
+      const char* expr = it.getByteArray();
+      filter.assign(expr, strnlen(expr, len));
+   }
+
+   // Answered from shared snapshot
+   mEnum->request(fd, filter);
+}
+
+void UsbService::scan_devices(EnumSnapshot& snapshot)
 {
    // Can't guarantee correct result in case of multi-client environment,
    // but anything >=0 should be fine.
-   int res = ::usb_find_devices();
+   pthread_mutex_lock(&mBusLock);
+   int res = mBackend->findDevices();
    debug_msg("returned %d", res);
-
-   // Prepare result packet
-   Packet pkt(UsbFindDevices);
-   pkt.addInt32(res);
+   snapshot.result = res;
 
    // Add existing busses and devices
    struct usb_bus* bus = 0;
-   for(bus = ::usb_get_busses(); bus; bus = bus->next) {
+   for(bus = mBackend->busses(); bus; bus = bus->next) {
 
-      Struct block = pkt.writeBlock(StructureType);
-      block.addString(bus->dirname);
-      block.addUInt32(bus->location);
+      snapshot.busses.push_back(EnumBus());
+      EnumBus& sbus = snapshot.busses.back();
+      sbus.dirname = bus->dirname;
+      sbus.location = bus->location;
 
       //! \todo Implement device children ptrs.
       for(struct usb_device* dev = bus->devices; dev; dev = dev->next) {
 
-         Struct devBlock = block.writeBlock(SequenceType);
+         sbus.devices.push_back(EnumDevice());
+         EnumDevice& sdev = sbus.devices.back();
+         sdev.bus = bus->location;
+         sdev.devnum = dev->devnum;
+         sdev.vid = dev->descriptor.idVendor;
+         sdev.pid = dev->descriptor.idProduct;
+
+         // Encode device block standalone
+         Struct top(sdev.block, 0);
+         Struct devBlock = top.writeBlock(SequenceType);
          devBlock.addString(dev->filename);
          devBlock.addUInt8(dev->devnum);
 
@@ -184,13 +522,40 @@ void UsbService::usb_find_devices(int fd, Packet& in)
 
          devBlock.finalize();
       }
-
-      // Finalize block
-      block.finalize();
    }
 
-   // Send result
-   pkt.send(fd);
+   pthread_mutex_unlock(&mBusLock);
+}
+
+void UsbService::usb_stats(int fd, Packet&)
+{
+   // Allocator usage
+   uint64_t heap_used = 0, heap_total = 0;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+   struct mallinfo2 mi = mallinfo2();
+   heap_used = mi.uordblks + mi.hblkhd;
+   heap_total = mi.arena + mi.hblkhd;
+#endif
+
+   // Responses waiting for engine thread
+   unsigned frames = 0;
+   size_t bytes = 0;
+   backlog(frames, bytes);
+
+   // Device queue depths
+   std::map<int, unsigned> queued;
+   std::map<int, DeviceWorker*>::iterator w;
+   for(w = mWorkers.begin(); w != mWorkers.end(); ++w)
+      queued[w->first] = w->second->queued();
+
+   // Server block, totals and entries
+   Packet pkt(UsbStats);
+   pkt.addUInt64(heap_used);
+   pkt.addUInt64(heap_total);
+   pkt.addUInt32(frames);
+   pkt.addUInt64(bytes);
+   mStats.encode(pkt, queued);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_open(int fd, Packet& in)
@@ -199,9 +564,10 @@ void UsbService::usb_open(int fd, Packet& in)
    unsigned busid = it.getUInt();
    unsigned devid = it.getUInt();
 
-   // Find device
+   // Find device, bus list is not rescanned meanwhile
+   pthread_mutex_lock(&mBusLock);
    struct usb_device* rdev = NULL;
-   for(struct usb_bus* bus = ::usb_get_busses(); bus; bus = bus->next) {
+   for(struct usb_bus* bus = mBackend->busses(); bus; bus = bus->next) {
 
       // Find bus
       if(bus->location == busid) {
@@ -224,23 +590,44 @@ void UsbService::usb_open(int fd, Packet& in)
    int res = -1;
    int openfd = -1;
    usb_dev_handle* udev = NULL;
-   if(rdev != NULL) {
-      // Check successful open
-      if((udev = ::usb_open(rdev)) != NULL) {
-         mOpenList.push_back(udev);
-         res = 0;
-         openfd = udev->fd;
+   if(rdev != NULL)
+      udev = mBackend->open(rdev);
+   pthread_mutex_unlock(&mBusLock);
+
+   // Check successful open
+   if(udev != NULL) {
+      pthread_mutex_lock(&mLock);
+      openfd = mHandles.insert(udev, fd);
+      if(openfd >= 0)
+         mSessions[fd].handles.insert(openfd);
+      pthread_mutex_unlock(&mLock);
+
+      // Handle table is full
+      if(openfd < 0) {
+         mBackend->close(udev);
+         udev = NULL;
       }
    }
 
+   if(udev != NULL) {
+      res = 0;
+
+      // Start device worker, process inline on failure
+      DeviceWorker* worker = new DeviceWorker(this, openfd);
+      if(worker->start())
+         mWorkers[openfd] = worker;
+      else
+         delete worker;
+   }
 
    debug_msg("bus_id %u, dev_id %u = %d (fd %d)", busid, devid, res, openfd);
 
-   // Return result
+   // Return result and chunk window, clients fit chunked writes in it
    Packet pkt(UsbOpen);
    pkt.addInt8(res);
    pkt.addInt32(openfd);
-   pkt.send(fd);
+   pkt.addInt32(mChunkWindow);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_close(int fd, Packet& in)
@@ -249,23 +636,33 @@ void UsbService::usb_close(int fd, Packet& in)
    int devfd = it.getInt();
 
    // Find open device
-   int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         mOpenList.erase(i);
-         res = ::usb_close(h);
-         break;
+   usb_dev_handle* h = NULL;
+   pthread_mutex_lock(&mLock);
+   int owner = mHandles.owner(devfd);
+   if(mHandles.find(devfd) != NULL && (fd < 0 || owner == fd)) {
+      h = mHandles.remove(devfd);
+
+      // Drop handle and its interfaces from session
+      std::map<int, Session>::iterator s = mSessions.find(owner);
+      if(s != mSessions.end()) {
+         std::set< std::pair<int, int> >& ifaces = s->second.interfaces;
+         s->second.handles.erase(devfd);
+         ifaces.erase(ifaces.lower_bound(std::make_pair(devfd, INT_MIN)),
+                      ifaces.lower_bound(std::make_pair(devfd + 1, INT_MIN)));
       }
    }
+   pthread_mutex_unlock(&mLock);
+
+   int res = -1;
+   if(h != NULL)
+      res = mBackend->close(h);
 
    debug_msg("fd %d = %d", devfd, res);
 
    // Return result
    Packet pkt(UsbClose);
    pkt.addInt8(res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_set_configuration(int fd, Packet &in)
@@ -276,14 +673,10 @@ void UsbService::usb_set_configuration(int fd, Packet &in)
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_set_configuration(h, configuration);
-         configuration = h->config;
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->setConfiguration(h, configuration);
+      configuration = h->config;
    }
 
    debug_msg("fd %d, configuration %d = %d", devfd, configuration, res);
@@ -292,7 +685,7 @@ void UsbService::usb_set_configuration(int fd, Packet &in)
    Packet pkt(UsbSetConfiguration);
    pkt.addInt32(res);
    pkt.addInt32(configuration);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_set_altinterface(int fd, Packet &in)
@@ -303,14 +696,10 @@ void UsbService::usb_set_altinterface(int fd, Packet &in)
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_set_altinterface(h, alternate);
-         alternate = h->altsetting;
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->setAltInterface(h, alternate);
+      alternate = h->altsetting;
    }
 
    debug_msg("fd %d, alternate %d = %d", devfd, alternate, res);
@@ -319,7 +708,7 @@ void UsbService::usb_set_altinterface(int fd, Packet &in)
    Packet pkt(UsbSetAltInterface);
    pkt.addInt32(res);
    pkt.addInt32(alternate);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_resetep(int fd, Packet &in)
@@ -330,13 +719,9 @@ void UsbService::usb_resetep(int fd, Packet &in)
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_resetep(h, ep);
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->resetEp(h, ep);
    }
 
    debug_msg("fd %d, ep %d = %d", devfd, ep, res);
@@ -344,7 +729,7 @@ void UsbService::usb_resetep(int fd, Packet &in)
    // Return result
    Packet pkt(UsbResetEp);
    pkt.addInt32(res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_clear_halt(int fd, Packet &in)
@@ -355,13 +740,9 @@ void UsbService::usb_clear_halt(int fd, Packet &in)
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_clear_halt(h, ep);
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->clearHalt(h, ep);
    }
 
    debug_msg("fd %d, ep %d = %d", devfd, ep, res);
@@ -369,7 +750,7 @@ void UsbService::usb_clear_halt(int fd, Packet &in)
    // Return result
    Packet pkt(UsbClearHalt);
    pkt.addInt32(res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_reset(int fd, Packet &in)
@@ -379,13 +760,9 @@ void UsbService::usb_reset(int fd, Packet &in)
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_reset(h);
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->reset(h);
    }
 
    debug_msg("fd %d = %d", devfd, res);
@@ -393,7 +770,7 @@ void UsbService::usb_reset(int fd, Packet &in)
    // Return result
    Packet pkt(UsbReset);
    pkt.addInt32(res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_claim_interface(int fd, Packet &in)
@@ -404,13 +781,18 @@ void UsbService::usb_claim_interface(int fd, Packet &in)
    int res = -1;
 
    // Find open device
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_claim_interface(h, index);
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->claimInterface(h, index);
+   }
+
+   // Remember claimed interface
+   if(res == 0) {
+      pthread_mutex_lock(&mLock);
+      std::map<int, Session>::iterator s = mSessions.find(mHandles.owner(devfd));
+      if(s != mSessions.end())
+         s->second.interfaces.insert(std::make_pair(devfd, index));
+      pthread_mutex_unlock(&mLock);
    }
 
    debug_msg("fd %d = %d", devfd, res);
@@ -418,7 +800,7 @@ void UsbService::usb_claim_interface(int fd, Packet &in)
    // Return result
    Packet pkt(UsbClaimInterface);
    pkt.addInt32((int32_t) res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_release_interface(int fd, Packet &in)
@@ -429,14 +811,16 @@ void UsbService::usb_release_interface(int fd, Packet &in)
    int res = -1;
 
    // Find open device
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-         res = ::usb_release_interface(h, index);
-         res = 0;
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->releaseInterface(h, index);
+      res = 0;
+
+      pthread_mutex_lock(&mLock);
+      std::map<int, Session>::iterator s = mSessions.find(mHandles.owner(devfd));
+      if(s != mSessions.end())
+         s->second.interfaces.erase(std::make_pair(devfd, index));
+      pthread_mutex_unlock(&mLock);
    }
 
    debug_msg("fd %d = %d", devfd, res);
@@ -444,7 +828,7 @@ void UsbService::usb_release_interface(int fd, Packet &in)
    // Return result
    Packet pkt(UsbReleaseInterface);
    pkt.addInt32((int32_t) res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_get_kernel_driver(int fd, Packet &in)
@@ -460,17 +844,9 @@ void UsbService::usb_get_kernel_driver(int fd, Packet &in)
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-#if LIBUSB_HAS_GET_DRIVER_NP
-         res = ::usb_get_driver_np(h, index, (char*) buf.data(), namelen);
-#else
-         res = -1;
-#endif
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->getKernelDriver(h, index, (char*) buf.data(), namelen);
    }
 
    buf.at(namelen - 1) = '\0';
@@ -480,7 +856,7 @@ void UsbService::usb_get_kernel_driver(int fd, Packet &in)
    Packet pkt(UsbGetKernelDriver);
    pkt.addInt32((int32_t) res);
    pkt.addString(buf.data());
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_detach_kernel_driver(int fd, Packet &in)
@@ -491,17 +867,9 @@ void UsbService::usb_detach_kernel_driver(int fd, Packet &in)
 
    // Find open device
    int res = -1;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      usb_dev_handle* h = *i;
-      if(h->fd == devfd) {
-#if LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP
-         res = ::usb_detach_kernel_driver_np(h, index);
-#else
-         res = 0;
-#endif
-         break;
-      }
+   usb_dev_handle* h = device(fd, devfd);
+   if(h != NULL) {
+      res = mBackend->detachKernelDriver(h, index);
    }
 
    debug_msg("fd %d, index %d = %d", devfd, index, res);
@@ -509,7 +877,7 @@ void UsbService::usb_detach_kernel_driver(int fd, Packet &in)
    // Return result
    Packet pkt(UsbDetachKernelDriver);
    pkt.addInt32((int32_t) res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_control_msg(int fd, Packet& in)
@@ -518,14 +886,7 @@ void UsbService::usb_control_msg(int fd, Packet& in)
    int devfd = it.getInt();
 
    // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
-         break;
-      }
-   }
+   usb_dev_handle* h = device(fd, devfd);
 
    // Device not found
    int res = -1;
@@ -541,55 +902,259 @@ void UsbService::usb_control_msg(int fd, Packet& in)
       data  = (char*) it.getByteArray();
       int timeout = it.getInt();
 
-      res = ::usb_control_msg(h, reqtype, request, value, index, data, size, timeout);
+      res = -ETIMEDOUT;
+      if(deadline(in, timeout))
+         res = control_transfer(h, reqtype, request, value, index, data, size, timeout);
       debug_msg("fd %d = %d", devfd, res);
    }
 
    // Return packet
    Packet pkt(UsbControlMsg);
    pkt.addInt32(res);
-   pkt.addData(data, (res < 0) ? 0 : res, OctetType);
-   pkt.send(fd);
+   pkt.addData((res > 0) ? data : NULL, (res > 0) ? res : 0, OctetType);
+   reply(fd, pkt);
 }
 
-void UsbService::usb_bulk_read(int fd, Packet &in)
+void UsbService::usb_control_batch(int fd, Packet& in)
 {
    Iterator it(in);
    int devfd = it.getInt();
+   int count = it.getInt();
 
    // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
+   usb_dev_handle* h = device(fd, devfd);
+
+   // Device not found or oversized batch fails the first transfer
+   Packet pkt(UsbControlBatch);
+   bool valid = (count <= USBNET_BATCH_MAX);
+   if(h == NULL || !valid) {
+      pkt.addInt32((h == NULL) ? -ENODEV : -EINVAL);
+      pkt.addData(NULL, 0, OctetType);
+   }
+
+   // Execute in order, stop on error
+   // Response carries result and IN data of each executed transfer
+   std::vector<char> buf;
+   for(int i = 0; h != NULL && valid && i < count; ++i) {
+
+      // Truncated or malformed entry fails the transfer
+      if(it.type() != IntegerType) {
+         pkt.addInt32(-EINVAL);
+         pkt.addData(NULL, 0, OctetType);
+         debug_msg("fd %d [%d/%d] malformed", devfd, i + 1, count);
          break;
       }
+      int reqtype = it.getInt();
+      int request = it.getInt();
+      int value   = it.getInt();
+      int index   = it.getInt();
+      int size    = it.getInt();
+      int timeout = 0;
+
+      // Data stage item may be missing
+      char* data = NULL;
+      uint32_t len = 0;
+      if(it.type() == OctetType) {
+         len = it.length();
+         data = (char*) it.getByteArray();
+      }
+      if(it.type() == IntegerType)
+         timeout = it.getInt();
+
+      // IN data stage is not sent, wLength is 16 bits
+      bool input = reqtype & USB_ENDPOINT_IN;
+      if(input) {
+         size = (size < 0) ? 0 : (size > 0xffff) ? 0xffff : size;
+         buf.resize(size > 0 ? size : 1);
+         data = &buf[0];
+      }
+
+      // OUT data stage must carry size bytes
+      // Batch is shed if the first transfer is past its deadline
+      int res = -ETIMEDOUT;
+      if(!input && (size < 0 || size > 0xffff || (uint32_t) size > len))
+         res = -EINVAL;
+      else if(i > 0 || deadline(in, timeout))
+         res = control_transfer(h, reqtype, request, value, index, data, size, timeout);
+      pkt.addInt32(res);
+      if(input && res > 0)
+         pkt.addData(data, res, OctetType);
+      else
+         pkt.addData(NULL, 0, OctetType); // Zero size appends C string
+      debug_msg("fd %d [%d/%d] = %d", devfd, i + 1, count, res);
+      if(res < 0)
+         break;
    }
 
+   reply(fd, pkt);
+}
+
+void UsbService::usb_bulk_read(int fd, Packet &in)
+{
+   Iterator it(in);
+   int devfd = it.getInt();
+
+   // Find open device
+   usb_dev_handle* h = device(fd, devfd);
+
    // Device not found
    int res = -1;
-   char* data = NULL;
    int ep = it.getInt();
    int size = it.getInt();
    int timeout = it.getInt();
-   if(h != NULL && size > 0) {
 
-      // Call function
-      data = new char[size];
-      res = ::usb_bulk_read(h, ep, data, size, timeout);
+   // Client accepts chunked response
+   int chunk = 0;
+   if(it.type() == IntegerType)
+      chunk = it.getInt();
+
+   // Shed request past its deadline
+   if(!deadline(in, timeout)) {
+      res = -ETIMEDOUT;
+      h = NULL;
+   }
+
+   // Large reads are pushed in chunks as they complete
+   if(h != NULL && size > 0 && chunk > 0 && size > chunk) {
+      res = bulk_read_chunked(fd, h, devfd, ep, size, timeout, chunk);
+      debug_msg("fd %d = %d (chunked)", devfd, res);
+      Packet pkt(UsbBulkRead);
+      pkt.addInt32(res);
+      reply(fd, pkt);
+      return;
+   }
+
+   // Read straight into response payload
+   Packet pkt(UsbBulkRead);
+   pkt.reserveHeader();
+   int pos = pkt.currentPos();
+   pkt.addInt32(res);
+   char* data = pkt.reserveData((h != NULL && size > 0) ? size : 0, OctetType);
+   if(h != NULL && size > 0) {
+      res = bulk_transfer(h, ep, data, size, timeout);
       debug_msg("fd %d = %d", devfd, res);
+      pkt.setInt32(pos, res);
    }
 
    // Return packet
-   Packet pkt(UsbBulkRead);
+   pkt.shrinkData((res > 0) ? res : 0);
+   reply(fd, pkt);
+}
+
+int UsbService::bulk_read_chunked(int fd, usb_dev_handle* h, int devfd, int ep, int size, int timeout, int chunk)
+{
+   // Read chunk by chunk, short chunk ends the transfer
+   // Timeout applies to the whole transfer
+   long long start = now_ms();
+   int total = 0;
+   while(total < size) {
+      int len = (size - total > chunk) ? chunk : size - total;
+      int left = timeout;
+      if(timeout > 0 && (left = timeout - (int) (now_ms() - start)) <= 0) {
+         total = -ETIMEDOUT;
+         break;
+      }
+
+      // Read straight into chunk payload
+      Packet pkt(UsbDataChunk);
+      pkt.reserveHeader();
+      pkt.addInt32(devfd);
+      pkt.addInt32(ep);
+      char* data = pkt.reserveData(len, OctetType);
+      int res = bulk_transfer(h, ep, data, len, left);
+      if(res < 0) {
+         total = res;
+         break;
+      }
+
+      pkt.shrinkData(res);
+      reply(fd, pkt);
+
+      total += res;
+      if(res < len)
+         break;
+   }
+
+   return total;
+}
+
+int UsbService::stream_read(int fd, int devfd, int ep, int size, int timeout, bool retry)
+{
+   // Find open device
+   usb_dev_handle* h = device(fd, devfd);
+
+   // Read straight into pushed payload
+   int res = -ENODEV;
+   Packet pkt(UsbStreamData);
+   pkt.reserveHeader();
+   pkt.addInt32(devfd);
+   pkt.addInt32(ep);
+   int pos = pkt.currentPos();
    pkt.addInt32(res);
-   pkt.addData(data, (res < 0) ? 0 : res, OctetType);
-   pkt.send(fd);
+   char* data = pkt.reserveData((h != NULL) ? size : 0, OctetType);
+   if(h != NULL) {
+      res = bulk_transfer(h, ep, data, size, timeout);
+      pkt.setInt32(pos, res);
+   }
 
-   // Free data
-   if(data != NULL)
-      delete data;
+   // Push result
+   if(retry && res == -ETIMEDOUT)
+      return res;
+   pkt.shrinkData((res > 0) ? res : 0);
+   reply(fd, pkt);
+   return res;
+}
+
+void UsbService::usb_stream(int fd, Packet &in)
+{
+   // Streams are served by device workers
+   Iterator it(in);
+   int devfd = it.getInt();
+   debug_msg("fd %d has no worker", devfd);
+
+   // Credits need no response
+   if(in.op() == UsbStreamCredit)
+      return;
+
+   Packet pkt(in.op());
+   pkt.addInt32(-ENODEV);
+   reply(fd, pkt);
+}
+
+void UsbService::usb_bulk_write_async(int fd, Packet &in)
+{
+   // Write-behind is served by device workers
+   Iterator it(in);
+   int devfd = it.getInt();
+   int ep = it.getInt();
+   int seq = it.getInt();
+   debug_msg("fd %d has no worker", devfd);
+
+   Packet pkt(UsbWriteAck);
+   pkt.addInt32(devfd);
+   pkt.addInt32(ep);
+   pkt.addInt32(seq);
+   pkt.addInt32(-ENODEV);
+   reply(fd, pkt);
+}
+
+void UsbService::usb_data_chunk(int fd, Packet &in)
+{
+   // Chunked writes are served by device workers
+   Iterator it(in);
+   int devfd = it.getInt();
+   int ep = it.getInt();
+   int last = it.getInt();
+   debug_msg("fd %d has no worker", devfd);
+
+   // Acknowledge chunk or finish transfer
+   Packet pkt(last ? UsbBulkWrite : UsbDataChunk);
+   if(!last) {
+      pkt.addInt32(devfd);
+      pkt.addInt32(ep);
+   }
+   pkt.addInt32(-ENODEV);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_bulk_write(int fd, Packet &in)
@@ -598,14 +1163,7 @@ void UsbService::usb_bulk_write(int fd, Packet &in)
    int devfd = it.getInt();
 
    // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
-         break;
-      }
-   }
+   usb_dev_handle* h = device(fd, devfd);
 
    // Device not found
    int res = -1;
@@ -613,17 +1171,24 @@ void UsbService::usb_bulk_write(int fd, Packet &in)
    int size = it.length();
    char* data = (char*) it.getByteArray();
    int timeout = it.getInt();
+
+   // Shed request past its deadline
+   if(!deadline(in, timeout)) {
+      res = -ETIMEDOUT;
+      h = NULL;
+   }
+
    if(h != NULL && size > 0) {
 
       // Call function
-      res = ::usb_bulk_write(h, ep, data, size, timeout);
+      res = bulk_transfer(h, ep, data, size, timeout);
       debug_msg("fd %d = %d", devfd, res);
    }
 
    // Return packet
    Packet pkt(UsbBulkWrite);
    pkt.addInt32(res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_interrupt_write(int fd, Packet &in)
@@ -632,14 +1197,7 @@ void UsbService::usb_interrupt_write(int fd, Packet &in)
    int devfd = it.getInt();
 
    // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
-         break;
-      }
-   }
+   usb_dev_handle* h = device(fd, devfd);
 
    // Device not found
    int res = -1;
@@ -647,17 +1205,24 @@ void UsbService::usb_interrupt_write(int fd, Packet &in)
    int size = it.length();
    char* data = (char*) it.getByteArray();
    int timeout = it.getInt();
+
+   // Shed request past its deadline
+   if(!deadline(in, timeout)) {
+      res = -ETIMEDOUT;
+      h = NULL;
+   }
+
    if(h != NULL && size > 0) {
 
       // Call function
-      res = ::usb_interrupt_write(h, ep, data, size, timeout);
+      res = interrupt_transfer(h, ep, data, size, timeout);
       debug_msg("fd %d = %d", devfd, res);
    }
 
    // Return packet
    Packet pkt(UsbInterruptWrite);
    pkt.addInt32(res);
-   pkt.send(fd);
+   reply(fd, pkt);
 }
 
 void UsbService::usb_interrupt_read(int fd, Packet &in)
@@ -666,14 +1231,7 @@ void UsbService::usb_interrupt_read(int fd, Packet &in)
    int devfd = it.getInt();
 
    // Find open device
-   usb_dev_handle* h = NULL;
-   std::list<usb_dev_handle*>::iterator i;
-   for(i = mOpenList.begin(); i != mOpenList.end(); ++i) {
-      if((*i)->fd == devfd) {
-         h = *i;
-         break;
-      }
-   }
+   usb_dev_handle* h = device(fd, devfd);
 
    // Device not found
    int res = -1;
@@ -681,19 +1239,26 @@ void UsbService::usb_interrupt_read(int fd, Packet &in)
    int ep = it.getInt();
    int size = it.getInt();
    int timeout = it.getInt();
+
+   // Shed request past its deadline
+   if(!deadline(in, timeout)) {
+      res = -ETIMEDOUT;
+      h = NULL;
+   }
+
    if(h != NULL && size > 0) {
 
       // Call function
       data = new char[size];
-      res = ::usb_interrupt_read(h, ep, data, size, timeout);
+      res = interrupt_transfer(h, ep, data, size, timeout);
       debug_msg("fd %d = %d", devfd, res);
    }
 
    // Return packet
    Packet pkt(UsbInterruptRead);
    pkt.addInt32(res);
-   pkt.addData(data, (res < 0) ? 0 : res, OctetType);
-   pkt.send(fd);
+   pkt.addData((res > 0) ? data : NULL, (res > 0) ? res : 0, OctetType);
+   reply(fd, pkt);
 
    // Free data
    if(data != NULL)
@@ -25,10 +25,21 @@
 #ifndef __usbservice_hpp__
 #define __usbservice_hpp__
 #include "serversocket.hpp"
+#include "handletable.hpp"
+#include "servicestats.hpp"
 #include "usbnet.h"
 #include <list>
+#include <map>
+#include <set>
+#include <pthread.h>
 using namespace Proto;
 
+class DeviceWorker;
+class UsbfsOps;
+class UsbBackend;
+class EnumCache;
+struct EnumSnapshot;
+
 class UsbService : public ServerSocket
 {
    public:
@@ -36,18 +47,97 @@ class UsbService : public ServerSocket
    ~UsbService();
 
    /** Reimplemented packet handling.
+     * Requests for open devices are queued to device workers,
+     * other requests are processed immediately.
      */
    virtual bool handle(int fd, Packet& pkt);
 
+   /** Set device backend, ownership is taken.
+     * Must be called before serving clients.
+     */
+   void setBackend(UsbBackend* backend);
+
+   /** Set bulk transfer URB queueing.
+     * \param ops usbfs implementation, ownership is taken
+     * \param depth URBs in flight per transfer, 0 for synchronous backend calls
+     * \param size URB size in bytes
+     */
+   void setUrbQueue(UsbfsOps* ops, unsigned depth, unsigned size);
+
+   /** Set enumeration snapshot lifetime in milliseconds, 0 scans for each request. */
+   void setEnumTtl(unsigned ms);
+
+   /** Set bytes of write chunks queued per transfer, reported to clients on open.
+     * Larger chunks and chunks over it fail the transfer with -ENOBUFS.
+     */
+   void setChunkWindow(size_t bytes);
+
    protected:
 
+   /** Process request and send response. */
+   bool process(int fd, Packet& pkt);
+
+   /** Process request immediately and count it in service metrics. */
+   bool serve(int fd, Packet& pkt);
+
+   /** Return open device handle or NULL if handle id is stale
+     * or the handle is not owned by client fd.
+     * Negative fd is an internal request, ownership is not checked.
+     */
+   usb_dev_handle* device(int fd, int devfd);
+
+   /** Reap workers of closed devices. */
+   virtual void housekeeping();
+
+   /** Release interfaces and handles of disconnected client. */
+   virtual void disconnected(int fd);
+
+   /** Count response bytes in service metrics. */
+   virtual void responded(int fd, size_t size);
+
+   /** Rescan devices and encode each into snapshot. */
+   void scan_devices(EnumSnapshot& snapshot);
+
+   /** Shorten request timeout to time left until its deadline.
+     * Clients send timeout reduced by round-trip time, so it is
+     * relative to request arrival. Zero timeout has no deadline.
+     * \return false if deadline passed and request should be shed
+     */
+   bool deadline(Packet& in, int& timeout);
+
+   /** Bulk transfer through URB queue or backend, direction is given by endpoint.
+     * URB queue is used only if backend handles are usbfs descriptors
+     * or usbfs is simulated.
+     */
+   int bulk_transfer(usb_dev_handle* h, int ep, char* data, int size, int timeout);
+
+   /** Control transfer through backend. */
+   int control_transfer(usb_dev_handle* h, int reqtype, int request, int value, int index,
+                        char* data, int size, int timeout);
+
+   /** Interrupt transfer through backend, direction is given by endpoint. */
+   int interrupt_transfer(usb_dev_handle* h, int ep, char* data, int size, int timeout);
+
+   /** Read-ahead bulk IN transfer, result is pushed to client as UsbStreamData.
+     * \param retry timeout is not pushed, caller reads again
+     * \return transfer result
+     */
+   int stream_read(int fd, int devfd, int ep, int size, int timeout, bool retry = false);
+
+   /** Bulk IN transfer pushed to client as UsbDataChunk frames of at most chunk bytes.
+     * \return total bytes read or error
+     */
+   int bulk_read_chunked(int fd, usb_dev_handle* h, int devfd, int ep, int size, int timeout, int chunk);
+
    /* libusb implementations.
     */
 
    /* (1) Core functions. */
+   void null_request(int fd, Packet& in);
    void usb_init(int fd, Packet& in);
    void usb_find_busses(int fd, Packet& in);
    void usb_find_devices(int fd, Packet& in);
+   void usb_stats(int fd, Packet& in);
 
    /* (2) Device controls. */
    void usb_open(int fd, Packet& in);
@@ -62,10 +152,14 @@ class UsbService : public ServerSocket
 
    /* (3) Control transfers. */
    void usb_control_msg(int fd, Packet& in);
+   void usb_control_batch(int fd, Packet& in);
 
    /* (4) Bulk transfers. */
    void usb_bulk_read(int fd, Packet& in);
    void usb_bulk_write(int fd, Packet& in);
+   void usb_stream(int fd, Packet& in);
+   void usb_bulk_write_async(int fd, Packet& in);
+   void usb_data_chunk(int fd, Packet& in);
 
    /* (5) Interrupt transfers. */
    void usb_interrupt_read(int fd, Packet& in);
@@ -76,8 +170,41 @@ class UsbService : public ServerSocket
    void usb_detach_kernel_driver(int fd, Packet& in);
 
    private:
+   friend class DeviceWorker;
+   friend class EnumCache;
+
    /* libusb data storage */
-   std::list<usb_dev_handle*> mOpenList;
+   HandleTable mHandles;
+
+   /** Client session, released in bulk on disconnect. */
+   struct Session {
+      std::set<int> handles;                     // Open handle ids
+      std::set< std::pair<int, int> > interfaces; // Claimed (handle id, interface)
+   };
+   std::map<int, Session> mSessions;
+   pthread_mutex_t mLock; // Guards mHandles, mSessions
+
+   /* Enumeration */
+   EnumCache* mEnum;
+   pthread_mutex_t mBusLock; // Guards backend bus list
+
+   /* Device backend */
+   UsbBackend* mBackend;
+
+   /* Device workers */
+   std::map<int, DeviceWorker*> mWorkers;
+   std::list<DeviceWorker*> mRetired;
+
+   /* Service metrics */
+   ServiceStats mStats;
+
+   /* URB queueing */
+   UsbfsOps* mUsbfs;
+   unsigned mUrbDepth;
+   unsigned mUrbSize;
+
+   /* Chunked writes */
+   size_t mChunkWindow;
 };
 
 #endif // __usbservice_hpp__
@@ -1,4 +1,6 @@
 #include "common.h"
+#include <time.h>
+#include <errno.h>
 
 #ifdef DEBUG
 int sLogLevel = MsgError|MsgLog|MsgDebug;
@@ -17,3 +19,32 @@ int log_setlevel(int flags)
     sLogLevel = flags;
     return ret;
 }
+
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+long long now_us()
+{
+    return now_ns() / 1000;
+}
+
+long long now_ms()
+{
+    return now_ns() / 1000000;
+}
+
+void sleep_us(long long us)
+{
+    if(us <= 0)
+        return;
+
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
@@ -64,6 +64,22 @@ int log_level();
   */
 int log_setlevel(int flags);
 
+/** Monotonic time in nanoseconds.
+  */
+long long now_ns();
+
+/** Monotonic time in microseconds.
+  */
+long long now_us();
+
+/** Monotonic time in milliseconds.
+  */
+long long now_ms();
+
+/** Sleep for given microseconds, resumed if interrupted.
+  */
+void sleep_us(long long us);
+
 /** Log message.
   */
 #define log_msg(fmt, args...) \
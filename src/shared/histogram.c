@@ -0,0 +1,120 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file histogram.c
+    \brief Log-linear latency histogram.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    @{
+  */
+#include "histogram.h"
+#include <string.h>
+
+/* Return bucket of value. */
+static unsigned hist_bucket(uint64_t value) {
+
+   // Clamp to last bucket
+   if(value >> HIST_MAX_BITS)
+      return HIST_BUCKETS - 1;
+
+   // Exact values
+   if(value < (1 << (HIST_SUB_BITS + 1)))
+      return value;
+
+   // Shift to keep HIST_SUB_BITS below the most significant bit
+   unsigned shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+   return (shift << HIST_SUB_BITS) + (value >> shift);
+}
+
+/* Return middle value of bucket. */
+static uint64_t hist_value(unsigned idx) {
+   if(idx < (1 << (HIST_SUB_BITS + 1)))
+      return idx;
+
+   unsigned shift = (idx >> HIST_SUB_BITS) - 1;
+   uint64_t low = (uint64_t) (idx - (shift << HIST_SUB_BITS)) << shift;
+   return low + ((1ULL << shift) >> 1);
+}
+
+void hist_init(histogram_t* h)
+{
+   memset(h, 0, sizeof(histogram_t));
+}
+
+void hist_record(histogram_t* h, uint64_t value)
+{
+   if(h->count == 0 || value < h->min)
+      h->min = value;
+   if(value > h->max)
+      h->max = value;
+   ++h->count;
+   h->sum += value;
+   ++h->bucket[hist_bucket(value)];
+}
+
+void hist_merge(histogram_t* dst, const histogram_t* src)
+{
+   if(src->count == 0)
+      return;
+
+   if(dst->count == 0 || src->min < dst->min)
+      dst->min = src->min;
+   if(src->max > dst->max)
+      dst->max = src->max;
+   dst->count += src->count;
+   dst->sum += src->sum;
+
+   unsigned i;
+   for(i = 0; i < HIST_BUCKETS; ++i)
+      dst->bucket[i] += src->bucket[i];
+}
+
+uint64_t hist_percentile(const histogram_t* h, double p)
+{
+   if(h->count == 0)
+      return 0;
+
+   // Rank of requested value
+   uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+   if(rank < 1)
+      rank = 1;
+   if(rank >= h->count)
+      return h->max;
+
+   // Find bucket, keep within recorded range
+   uint64_t seen = 0;
+   unsigned i;
+   for(i = 0; i < HIST_BUCKETS; ++i) {
+      seen += h->bucket[i];
+      if(seen >= rank)
+         break;
+   }
+
+   uint64_t value = hist_value(i);
+   if(value < h->min)
+      value = h->min;
+   if(value > h->max)
+      value = h->max;
+   return value;
+}
+
+uint64_t hist_mean(const histogram_t* h)
+{
+   return (h->count > 0) ? h->sum / h->count : 0;
+}
+
+/** @} */
@@ -0,0 +1,75 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file histogram.h
+    \brief Log-linear latency histogram.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    @{
+  */
+#ifndef __histogram_h__
+#define __histogram_h__
+#include <stdint.h>
+
+/** Linear sub-buckets per power of two (2^HIST_SUB_BITS).
+  * Recorded values are kept with about 6% precision.
+  */
+#define HIST_SUB_BITS 4
+
+/** Largest power of two kept apart, larger values share the last bucket. */
+#define HIST_MAX_BITS 40
+
+/** Bucket count. */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** HDR-style histogram of unsigned values (f.e. nanoseconds).
+  * Values below 2^HIST_SUB_BITS are exact, each following power of two
+  * is split into 2^HIST_SUB_BITS equal buckets.
+  */
+typedef struct histogram_t {
+   uint64_t count;
+   uint64_t sum;
+   uint64_t min, max;
+   uint32_t bucket[HIST_BUCKETS];
+} histogram_t;
+
+/** Reset histogram. */
+void hist_init(histogram_t* h);
+
+/** Record value. */
+void hist_record(histogram_t* h, uint64_t value);
+
+/** Add recorded values of src to dst. */
+void hist_merge(histogram_t* dst, const histogram_t* src);
+
+/** Return value at percentile (0 - 100), 0 if empty. */
+uint64_t hist_percentile(const histogram_t* h, double p);
+
+/** Return mean value, 0 if empty. */
+uint64_t hist_mean(const histogram_t* h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __histogram_h__
+/** @} */
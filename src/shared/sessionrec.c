@@ -0,0 +1,94 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file sessionrec.c
+    \brief Client session recording.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    @{
+  */
+#include "sessionrec.h"
+#include "common.h"
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* Recording state. */
+static FILE* __srec_fp = NULL;
+static long long __srec_start = 0;
+static pthread_mutex_t __srec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int srec_open(const char* path)
+{
+   pthread_mutex_lock(&__srec_lock);
+   if(__srec_fp != NULL) {
+      pthread_mutex_unlock(&__srec_lock);
+      return -1;
+   }
+
+   FILE* fp = fopen(path, "wb");
+   if(fp == NULL || fwrite(SREC_MAGIC, strlen(SREC_MAGIC), 1, fp) != 1) {
+      error_msg("srec: can't open '%s': %s", path, strerror(errno));
+      if(fp != NULL)
+         fclose(fp);
+      pthread_mutex_unlock(&__srec_lock);
+      return -1;
+   }
+
+   __srec_fp = fp;
+   __srec_start = now_us();
+   pthread_mutex_unlock(&__srec_lock);
+   log_msg("srec: recording session to '%s'", path);
+   return 0;
+}
+
+void srec_close(void)
+{
+   pthread_mutex_lock(&__srec_lock);
+   if(__srec_fp != NULL) {
+      fclose(__srec_fp);
+      __srec_fp = NULL;
+   }
+   pthread_mutex_unlock(&__srec_lock);
+}
+
+int srec_enabled(void)
+{
+   return __srec_fp != NULL;
+}
+
+void srec_write(int dir, uint8_t op, const char* payload, uint32_t size)
+{
+   srec_entry_t e;
+   memset(&e, 0, sizeof(e));
+   e.time = now_us() - __srec_start;
+   e.length = size;
+   e.size = (dir == SRecResponse && size > SREC_RESPONSE_MAX) ? SREC_RESPONSE_MAX : size;
+   e.dir = dir;
+   e.op = op;
+
+   pthread_mutex_lock(&__srec_lock);
+   if(__srec_fp != NULL) {
+      fwrite(&e, sizeof(e), 1, __srec_fp);
+      if(e.size > 0)
+         fwrite(payload, e.size, 1, __srec_fp);
+   }
+   pthread_mutex_unlock(&__srec_lock);
+}
+
+/** @} */
@@ -0,0 +1,79 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file sessionrec.h
+    \brief Client session recording.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    @{
+  */
+#ifndef __sessionrec_h__
+#define __sessionrec_h__
+#include <stdint.h>
+
+/** Recording file magic. */
+#define SREC_MAGIC "USBNREC1"
+
+/** Recorded bytes of response payload at most.
+  * Responses are kept for pairing with requests and remapping device handles,
+  * their data is not needed for replay.
+  */
+#define SREC_RESPONSE_MAX 64
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** Recorded packet direction. */
+typedef enum {
+   SRecRequest  = '>',
+   SRecResponse = '<'
+} srec_dir_t;
+
+/** Recorded packet header, followed by size bytes of payload.
+  * Fields are in host byte order.
+  */
+typedef struct srec_entry_t {
+   uint64_t time;   // Microseconds since recording start
+   uint32_t size;   // Recorded payload bytes
+   uint32_t length; // Original payload length
+   uint8_t  dir;    // srec_dir_t
+   uint8_t  op;     // Opcode
+   uint8_t  pad[6];
+} srec_entry_t;
+
+/** Start recording to file.
+  * \return 0 on success, -1 on error
+  */
+int srec_open(const char* path);
+
+/** Finish recording. */
+void srec_close(void);
+
+/** Return nonzero if recording. */
+int srec_enabled(void);
+
+/** Record packet, response payload is truncated to SREC_RESPONSE_MAX. */
+void srec_write(int dir, uint8_t op, const char* payload, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __sessionrec_h__
+/** @} */
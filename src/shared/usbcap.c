@@ -0,0 +1,324 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file usbcap.c
+    \brief usbmon compatible pcap capture.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    @{
+  */
+#include "usbcap.h"
+#include "common.h"
+#include <sys/time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+/* pcap file header. */
+typedef struct {
+   uint32_t magic;
+   uint16_t version_major, version_minor;
+   int32_t  thiszone;
+   uint32_t sigfigs, snaplen, network;
+} pcap_hdr_t;
+
+/* pcap record header. */
+typedef struct {
+   uint32_t ts_sec, ts_usec;
+   uint32_t incl_len, orig_len;
+} pcap_rec_t;
+
+/* usbmon mmapped header (64 bytes, host byte order). */
+typedef struct {
+   uint64_t id;
+   uint8_t  type;        // 'S'ubmission, 'C'ompletion
+   uint8_t  xfer_type;
+   uint8_t  epnum;
+   uint8_t  devnum;
+   uint16_t busnum;
+   char     flag_setup;  // 0 if setup is present
+   char     flag_data;   // 0 if data is present
+   int64_t  ts_sec;
+   int32_t  ts_usec;
+   int32_t  status;
+   uint32_t length;      // Transfer length
+   uint32_t len_cap;     // Captured data following header
+   uint8_t  setup[8];
+   int32_t  interval;
+   int32_t  start_frame;
+   uint32_t xfer_flags;
+   uint32_t ndesc;
+} usbmon_hdr_t;
+
+/* Ring slot, sequence tells whether slot is free or filled for given position. */
+typedef struct {
+   uint64_t seq;
+   char* rec;
+} slot_t;
+
+/* Capture state.
+ * Producers claim slots by CAS on head and never block,
+ * the writer thread is the only consumer.
+ */
+static struct {
+   FILE* fp;
+   unsigned snaplen;
+   int enabled;
+   int running;
+   int producers;          // Producers past enabled check
+   pthread_t writer;
+   uint64_t head;          // Next position to fill
+   uint64_t tail;          // Next position to write (writer only)
+   uint64_t id;            // Last transfer id
+   unsigned long dropped;
+   slot_t ring[USBCAP_RING];
+} __cap;
+
+/* Queue record, return 0 if ring is full. */
+static int ring_push(char* rec) {
+   uint64_t pos = __atomic_load_n(&__cap.head, __ATOMIC_RELAXED);
+   for(;;) {
+      slot_t* s = &__cap.ring[pos % USBCAP_RING];
+      uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+      int64_t diff = (int64_t) (seq - pos);
+      if(diff == 0) {
+         if(__atomic_compare_exchange_n(&__cap.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            s->rec = rec;
+            __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+            return 1;
+         }
+      }
+      else if(diff < 0)
+         return 0;
+      else
+         pos = __atomic_load_n(&__cap.head, __ATOMIC_RELAXED);
+   }
+}
+
+/* Take next record, NULL if ring is empty. */
+static char* ring_pop() {
+   slot_t* s = &__cap.ring[__cap.tail % USBCAP_RING];
+   if(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != __cap.tail + 1)
+      return NULL;
+
+   char* rec = s->rec;
+   __atomic_store_n(&s->seq, __cap.tail + USBCAP_RING, __ATOMIC_RELEASE);
+   ++__cap.tail;
+   return rec;
+}
+
+/* Write queued records, return number of records written. */
+static int ring_drain() {
+   int n = 0;
+   char* rec;
+   while((rec = ring_pop()) != NULL) {
+      pcap_rec_t* hdr = (pcap_rec_t*) rec;
+      if(fwrite(rec, sizeof(pcap_rec_t) + hdr->incl_len, 1, __cap.fp) != 1)
+         error_msg("usbcap: write failed: %s", strerror(errno));
+      free(rec);
+      ++n;
+   }
+   return n;
+}
+
+/* Writer thread, polls ring and flushes when idle. */
+static void* writer(void* arg) {
+   (void) arg;
+   while(__atomic_load_n(&__cap.running, __ATOMIC_ACQUIRE)) {
+      if(ring_drain() == 0) {
+         fflush(__cap.fp);
+         usleep(1000);
+      }
+   }
+   return NULL;
+}
+
+/* Build and queue record of transfer event. */
+static void usbcap_queue(const usbcap_urb_t* urb, char type, int status, int len,
+                         const char* data, int datalen, char flag_data) {
+
+   // Truncate data to snap length
+   unsigned caplen = (data != NULL && datalen > 0) ? (unsigned) datalen : 0;
+   if(caplen > __cap.snaplen)
+      caplen = __cap.snaplen;
+
+   char* rec = malloc(sizeof(pcap_rec_t) + sizeof(usbmon_hdr_t) + caplen);
+   if(rec == NULL)
+      return;
+
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+
+   // pcap record
+   pcap_rec_t* prec = (pcap_rec_t*) rec;
+   prec->ts_sec = tv.tv_sec;
+   prec->ts_usec = tv.tv_usec;
+   prec->incl_len = sizeof(usbmon_hdr_t) + caplen;
+   prec->orig_len = sizeof(usbmon_hdr_t) + ((caplen > 0) ? (unsigned) datalen : 0);
+
+   // usbmon header
+   usbmon_hdr_t* hdr = (usbmon_hdr_t*) (rec + sizeof(pcap_rec_t));
+   memset(hdr, 0, sizeof(usbmon_hdr_t));
+   hdr->id = urb->id;
+   hdr->type = type;
+   hdr->xfer_type = urb->xfer;
+   hdr->epnum = urb->ep;
+   hdr->devnum = urb->devnum;
+   hdr->busnum = urb->busnum;
+   hdr->flag_setup = '-';
+   hdr->flag_data = (caplen > 0) ? 0 : flag_data;
+   hdr->ts_sec = tv.tv_sec;
+   hdr->ts_usec = tv.tv_usec;
+   hdr->status = status;
+   hdr->length = (len > 0) ? len : 0;
+   hdr->len_cap = caplen;
+   if(type == 'S' && urb->xfer == UsbCapControl) {
+      hdr->flag_setup = 0;
+      memcpy(hdr->setup, urb->setup, sizeof(hdr->setup));
+   }
+   if(caplen > 0)
+      memcpy(rec + sizeof(pcap_rec_t) + sizeof(usbmon_hdr_t), data, caplen);
+
+   // Never block the transfer
+   if(!ring_push(rec)) {
+      free(rec);
+      __atomic_add_fetch(&__cap.dropped, 1, __ATOMIC_RELAXED);
+   }
+}
+
+/* Queue record of transfer event if capture is still enabled. */
+static void usbcap_record(const usbcap_urb_t* urb, char type, int status, int len,
+                          const char* data, int datalen, char flag_data) {
+
+   // Closing waits for producers that saw capture enabled
+   __atomic_add_fetch(&__cap.producers, 1, __ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&__cap.enabled, __ATOMIC_SEQ_CST))
+      usbcap_queue(urb, type, status, len, data, datalen, flag_data);
+   __atomic_sub_fetch(&__cap.producers, 1, __ATOMIC_RELEASE);
+}
+
+int usbcap_open(const char* path, unsigned snaplen)
+{
+   if(__cap.enabled)
+      return -1;
+
+   FILE* fp = fopen(path, "wb");
+   if(fp == NULL) {
+      error_msg("usbcap: can't open '%s': %s", path, strerror(errno));
+      return -1;
+   }
+
+   // File header
+   pcap_hdr_t hdr;
+   hdr.magic = 0xa1b2c3d4;
+   hdr.version_major = 2;
+   hdr.version_minor = 4;
+   hdr.thiszone = 0;
+   hdr.sigfigs = 0;
+   hdr.snaplen = sizeof(usbmon_hdr_t) + (snaplen > 0 ? snaplen : USBCAP_SNAPLEN);
+   hdr.network = USBCAP_LINKTYPE;
+   fwrite(&hdr, sizeof(hdr), 1, fp);
+
+   // Empty ring
+   unsigned i;
+   for(i = 0; i < USBCAP_RING; ++i) {
+      __cap.ring[i].seq = i;
+      __cap.ring[i].rec = NULL;
+   }
+   __cap.head = __cap.tail = 0;
+   __cap.dropped = 0;
+   __cap.fp = fp;
+   __cap.snaplen = hdr.snaplen - sizeof(usbmon_hdr_t);
+
+   // Start writer
+   __cap.running = 1;
+   if(pthread_create(&__cap.writer, NULL, writer, NULL) != 0) {
+      error_msg("usbcap: failed to create writer thread");
+      __cap.running = 0;
+      fclose(fp);
+      return -1;
+   }
+
+   __atomic_store_n(&__cap.enabled, 1, __ATOMIC_RELEASE);
+   log_msg("usbcap: capturing to '%s'", path);
+   return 0;
+}
+
+void usbcap_close(void)
+{
+   if(!__cap.enabled)
+      return;
+
+   // Stop recording, wait for records in progress, then writer
+   __atomic_store_n(&__cap.enabled, 0, __ATOMIC_SEQ_CST);
+   while(__atomic_load_n(&__cap.producers, __ATOMIC_ACQUIRE) > 0)
+      sched_yield();
+   __atomic_store_n(&__cap.running, 0, __ATOMIC_RELEASE);
+   pthread_join(__cap.writer, NULL);
+
+   // Write remaining records
+   ring_drain();
+   fclose(__cap.fp);
+   __cap.fp = NULL;
+
+   if(__cap.dropped > 0)
+      log_msg("usbcap: %lu records dropped", __cap.dropped);
+}
+
+int usbcap_enabled(void)
+{
+   return __atomic_load_n(&__cap.enabled, __ATOMIC_ACQUIRE);
+}
+
+void usbcap_urb(usbcap_urb_t* urb, int xfer, int ep, int busnum, int devnum, const uint8_t* setup)
+{
+   urb->id = __atomic_add_fetch(&__cap.id, 1, __ATOMIC_RELAXED);
+   urb->xfer = xfer;
+   urb->ep = ep;
+   urb->busnum = busnum;
+   urb->devnum = devnum;
+   if(setup != NULL)
+      memcpy(urb->setup, setup, sizeof(urb->setup));
+   else
+      memset(urb->setup, 0, sizeof(urb->setup));
+}
+
+void usbcap_submit(const usbcap_urb_t* urb, const char* data, int len)
+{
+   // OUT data is known at submission
+   int out = !(urb->ep & 0x80);
+   usbcap_record(urb, 'S', -EINPROGRESS, len, out ? data : NULL, len, '<');
+}
+
+void usbcap_complete(const usbcap_urb_t* urb, const char* data, int res)
+{
+   // IN data is known at completion
+   int in = (urb->ep & 0x80);
+   int status = (res < 0) ? res : 0;
+   usbcap_record(urb, 'C', status, res, in ? data : NULL, res, '>');
+}
+
+unsigned long usbcap_dropped(void)
+{
+   return __atomic_load_n(&__cap.dropped, __ATOMIC_RELAXED);
+}
+
+/** @} */
@@ -0,0 +1,97 @@
+/***************************************************************************
+ *   Copyright (C) 2010 Marek Vavrusa <marek@vavrusa.com>                  *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.         *
+ ***************************************************************************/
+/*! \file usbcap.h
+    \brief usbmon compatible pcap capture.
+    \author Marek Vavrusa <marek@vavrusa.com>
+    @{
+  */
+#ifndef __usbcap_h__
+#define __usbcap_h__
+#include <stdint.h>
+
+/** pcap link type LINKTYPE_USB_LINUX_MMAPPED (64 byte usbmon header). */
+#define USBCAP_LINKTYPE 220
+
+/** Default captured bytes of transfer data. */
+#define USBCAP_SNAPLEN 65536
+
+/** Records queued for the writer at most, further records are dropped. */
+#define USBCAP_RING 4096
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/** usbmon transfer types. */
+typedef enum {
+   UsbCapIso       = 0,
+   UsbCapInterrupt = 1,
+   UsbCapControl   = 2,
+   UsbCapBulk      = 3
+} usbcap_xfer_t;
+
+/** Captured transfer, pairs submission with completion. */
+typedef struct usbcap_urb_t {
+   uint64_t id;         // Unique transfer id
+   uint8_t  xfer;       // Transfer type (usbcap_xfer_t)
+   uint8_t  ep;         // Endpoint address including direction
+   uint8_t  devnum;     // Device address
+   uint16_t busnum;     // Bus number
+   uint8_t  setup[8];   // Setup packet of control transfer
+} usbcap_urb_t;
+
+/** Start capture to pcap file, records are written by a background thread.
+  * \param snaplen captured bytes of transfer data, 0 for USBCAP_SNAPLEN
+  * \return 0 on success, -1 on error
+  */
+int usbcap_open(const char* path, unsigned snaplen);
+
+/** Stop capture, wait for records in progress and write pending records.
+  * Events of transfers still running are not recorded.
+  */
+void usbcap_close(void);
+
+/** Return nonzero if capture is running. */
+int usbcap_enabled(void);
+
+/** Prepare transfer with new id.
+  * \param setup control setup packet (8 bytes) or NULL
+  */
+void usbcap_urb(usbcap_urb_t* urb, int xfer, int ep, int busnum, int devnum, const uint8_t* setup);
+
+/** Record transfer submission, data is captured for OUT transfers.
+  * \param len requested length
+  */
+void usbcap_submit(const usbcap_urb_t* urb, const char* data, int len);
+
+/** Record transfer completion, data is captured for IN transfers.
+  * \param res transferred length or negative error
+  */
+void usbcap_complete(const usbcap_urb_t* urb, const char* data, int res);
+
+/** Return number of records dropped on full ring. */
+unsigned long usbcap_dropped(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __usbcap_h__
+/** @} */
@@ -27,8 +27,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include "usbnet.h"
 #include "protocol.h"
+#include "usbcap.h"
+#include "sessionrec.h"
+#include "common.h"
+#ifdef USE_CLIENT_STATS
+#include "histogram.h"
+#endif
 
 #ifdef USE_USB_CONST_BUFFERS
 typedef const char *usb_buf_t;
@@ -36,12 +43,6 @@ typedef const char *usb_buf_t;
 typedef char *usb_buf_t;
 #endif
 
-#ifdef MISSING_USB_DESTROY_CONFIGURATION 
-/** Imported from libusb-0.1/descriptors.c
- */
-static void usb_destroy_configuration(struct usb_device *dev);
-#endif
-
 //! Remote socket filedescriptor
 static int __remote_fd = -1;
 
@@ -50,8 +51,357 @@ static struct usb_bus* __orig_bus   = NULL;
 static struct usb_bus* __remote_bus = NULL;
 extern struct usb_bus* usb_busses;
 
+/** Arena block, allocated memory is freed with the arena. */
+typedef struct arena_t {
+   size_t used, size;
+   struct arena_t* next;
+   char data[];
+} arena_t;
+
+/** Virtual bus tree generation.
+  * Busses, devices and descriptors of a single usb_find_devices() are
+  * allocated in one arena. Replaced generation is freed at once
+  * when no open handle references it.
+  */
+typedef struct bus_gen_t {
+   unsigned id;           //! Generation number
+   int refs;              //! Open handles
+   unsigned long bytes;   //! Arena size
+   arena_t* arena;        //! Arena blocks, most recent first
+   struct usb_bus* busses;
+   struct bus_gen_t* next;
+} bus_gen_t;
+
+//! Bus tree generations, current first
+static bus_gen_t* __gens = NULL;
+static unsigned __gen_last = 0;
+
+//! Arena block size
+#define ARENA_BLOCK_SIZE 16384
+
+/** Read-ahead result. */
+typedef struct chunk_t {
+   int res;               //! Transfer result
+   int pos;               //! Consumed bytes
+   struct chunk_t* next;
+   char data[];
+} chunk_t;
+
+/** Bulk IN read-ahead stream.
+  * Server keeps reading into a window of \c depth results,
+  * credits are returned as the results are consumed.
+  */
+typedef struct stream_t {
+   int devfd, ep;
+   int size, timeout;     //! Last requested read
+   int depth;             //! Read-ahead window
+   int subscribed;        //! Opened by usbnet_stream_open(), parameters are fixed
+   int consumed;          //! Credits to return
+   chunk_t *head, *tail;
+   struct stream_t* next;
+} stream_t;
+
+//! Open read-ahead streams
+static stream_t* __streams = NULL;
+
+//! Read-ahead depth per IN endpoint number, parsed from USBNET_READAHEAD
+static int __readahead[16];
+
+/** Write-behind endpoint.
+  * Writes return once queued, up to \c window writes are unacknowledged.
+  * Server acks cumulatively, first failure is reported by the next write,
+  * usbnet_write_flush() or usb_close(), writes queued behind it are dropped.
+  */
+typedef struct wb_t {
+   int devfd, ep;
+   int window;            //! Unacknowledged writes limit
+   unsigned seq;          //! Last sent write
+   unsigned acked;        //! Last acknowledged write
+   int gen;               //! Failure generation
+   int error;             //! Unreported failure
+   struct wb_t* next;
+} wb_t;
+
+//! Write-behind endpoints
+static wb_t* __writes = NULL;
+
+//! Write-behind window per OUT endpoint number, parsed from USBNET_WRITEBEHIND
+static int __writebehind[16];
+
+/** Cached descriptor read. */
+typedef struct cache_t {
+   uint32_t bus;          //! Bus location
+   int devnum;            //! Device
+   int value, index;      //! wValue (type, index), wIndex (language)
+   int requesttype;       //! Recipient
+   int size;              //! Requested length
+   int res;               //! Returned length
+   struct cache_t* next;
+   char data[];
+} cache_t;
+
+//! Descriptor cache, most recent first
+static cache_t* __cache = NULL;
+static unsigned __cache_entries = 0;
+static unsigned long __cache_hits = 0, __cache_misses = 0;
+
+//! Descriptor cache capacity
+#define CACHE_MAX_ENTRIES 256
+
+/* Call statistics.
+ * Latency of each call is split into encoding requests, sending them,
+ * waiting for responses and decoding them, and recorded per opcode and
+ * device. Recorded if USBNET_STATS is set ("json" for JSON output),
+ * dumped to stderr on exit. Compiled out without USE_CLIENT_STATS.
+ */
+#ifdef USE_CLIENT_STATS
+
+/** Latency phases. */
+enum Phase {
+   PhaseEncode, PhaseSend, PhaseWait, PhaseDecode, PhaseTotal, PhaseCount
+};
+
+static const char* __phase_names[PhaseCount] = {
+   "encode", "send", "wait", "decode", "total"
+};
+
+/** Statistics of opcode and device. */
+typedef struct stats_t {
+   int op, devfd;         //! Opcode, device fd or -1
+   unsigned long long bytes_out, bytes_in;
+   histogram_t phase[PhaseCount];
+   struct stats_t* next;
+} stats_t;
+
+//! Recorded statistics, -1 if not configured, 1 text, 2 JSON
+static stats_t* __stats = NULL;
+static int __stats_mode = -1;
+
+/** Call in progress. */
+typedef struct call_t {
+   int op, devfd;         //! First request sent, -1 if none
+   long long start, mark; //! Call start, end of last phase (ns), 0 if idle
+   long long phase[PhaseCount];
+   unsigned long long bytes_out, bytes_in;
+} call_t;
+
+static call_t __call;
+
+/** Begin call. */
+static void stats_begin() {
+
+   // Check configuration once
+   if(__stats_mode < 0) {
+      const char* cfg = getenv("USBNET_STATS");
+      __stats_mode = 0;
+      if(cfg != NULL && *cfg != '\0' && strcmp(cfg, "0") != 0)
+         __stats_mode = (strcmp(cfg, "json") == 0) ? 2 : 1;
+   }
+
+   if(__stats_mode > 0) {
+      memset(&__call, 0, sizeof(call_t));
+      __call.op = __call.devfd = -1;
+      __call.start = __call.mark = now_ns();
+   }
+}
+
+/** Account time since last phase end. */
+static void stats_phase(enum Phase phase) {
+   if(__call.start > 0) {
+      long long now = now_ns();
+      __call.phase[phase] += now - __call.mark;
+      __call.mark = now;
+   }
+}
+
+/** Key call by its first request, pings don't count. */
+static void stats_request(Packet* pkt) {
+   if(__call.start == 0 || __call.op >= 0 || pkt_op(pkt) == NullRequest)
+      return;
+
+   __call.op = pkt_op(pkt);
+   switch(__call.op) {
+      case UsbInit:
+      case UsbFindBusses:
+      case UsbFindDevices:
+      case UsbGetBusses:
+      case UsbOpen:
+         break;
+      default:
+      {
+         // Device requests begin with device fd
+         Iterator it;
+         pkt_begin(pkt, &it);
+         if(it.type == IntegerType)
+            __call.devfd = iter_getint(&it);
+      }
+         break;
+   }
+}
+
+/** Finish call and record it. */
+static void stats_end() {
+   if(__call.start == 0)
+      return;
+
+   stats_phase(PhaseDecode);
+   __call.phase[PhaseTotal] = __call.mark - __call.start;
+   __call.start = 0;
+   if(__call.op < 0)
+      return;
+
+   // Find or create statistics
+   stats_t* s = __stats;
+   while(s != NULL && !(s->op == __call.op && s->devfd == __call.devfd))
+      s = s->next;
+   if(s == NULL) {
+      s = malloc(sizeof(stats_t));
+      memset(s, 0, sizeof(stats_t));
+      s->op = __call.op;
+      s->devfd = __call.devfd;
+      s->next = __stats;
+      __stats = s;
+   }
+
+   int i;
+   for(i = 0; i < PhaseCount; ++i)
+      hist_record(&s->phase[i], __call.phase[i]);
+   s->bytes_out += __call.bytes_out;
+   s->bytes_in += __call.bytes_in;
+}
+
+/** Dump and free recorded statistics. */
+static void stats_dump() {
+   FILE* fp = stderr;
+   int json = (__stats_mode == 2);
+   if(json)
+      fprintf(fp, "[");
+
+   stats_t* s;
+   for(s = __stats; s != NULL; s = s->next) {
+      if(json) {
+         fprintf(fp, "%s\n {\"op\": \"%s\", \"device\": %d, \"calls\": %llu, "
+                     "\"bytes_out\": %llu, \"bytes_in\": %llu",
+                 (s == __stats) ? "" : ",", call_name(s->op), s->devfd,
+                 (unsigned long long) s->phase[PhaseTotal].count, s->bytes_out, s->bytes_in);
+      }
+      else {
+         fprintf(fp, "%s device %d: %llu calls, %llu bytes out, %llu bytes in\n",
+                 call_name(s->op), s->devfd,
+                 (unsigned long long) s->phase[PhaseTotal].count, s->bytes_out, s->bytes_in);
+      }
+
+      // Latency in microseconds
+      int i;
+      for(i = 0; i < PhaseCount; ++i) {
+         histogram_t* h = &s->phase[i];
+         double p50 = hist_percentile(h, 50) / 1000.0, p90 = hist_percentile(h, 90) / 1000.0;
+         double p99 = hist_percentile(h, 99) / 1000.0, max = h->max / 1000.0;
+         double mean = hist_mean(h) / 1000.0;
+         if(json)
+            fprintf(fp, ", \"%s\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}",
+                    __phase_names[i], mean, p50, p90, p99, max);
+         else
+            fprintf(fp, "  %-6s mean %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  max %9.1f us\n",
+                    __phase_names[i], mean, p50, p90, p99, max);
+      }
+
+      if(json)
+         fprintf(fp, "}");
+   }
+
+   if(json)
+      fprintf(fp, "\n]\n");
+
+   // Free statistics
+   while(__stats != NULL) {
+      s = __stats;
+      __stats = s->next;
+      free(s);
+   }
+}
+#endif
+
+/** Send request. */
+static int session_send(Packet* pkt, int fd) {
+   if(srec_enabled())
+      srec_write(SRecRequest, pkt->op, pkt->buf, pkt->size);
+#ifdef USE_CLIENT_STATS
+   stats_phase(PhaseEncode);
+   stats_request(pkt);
+   int res = pkt_send(pkt, fd);
+   stats_phase(PhaseSend);
+   if(__call.start > 0 && res > 0)
+      __call.bytes_out += res;
+   return res;
+#else
+   return pkt_send(pkt, fd);
+#endif
+}
+
+/** Receive packet.
+  * Empty response has zero size, failure leaves opcode InvalidType.
+  * \return packet size
+  */
+static uint32_t session_read(int fd, Packet* pkt) {
+#ifdef USE_CLIENT_STATS
+   stats_phase(PhaseEncode);
+   uint32_t res = pkt_recv(fd, pkt);
+   stats_phase(PhaseWait);
+   if(__call.start > 0)
+      __call.bytes_in += res;
+#else
+   uint32_t res = pkt_recv(fd, pkt);
+#endif
+   if(srec_enabled() && pkt_op(pkt) != InvalidType)
+      srec_write(SRecResponse, pkt->op, pkt->buf, pkt->size);
+   return res;
+}
+
+/** Finish call, release shared packet. */
+static void session_release() {
+#ifdef USE_CLIENT_STATS
+   stats_end();
+#endif
+   pkt_release();
+}
+
+static void stream_free(stream_t* s);
+static void gen_free(bus_gen_t* gen);
+
 void session_teardown() {
 
+#ifdef USE_CLIENT_STATS
+   // Dump call statistics
+   stats_dump();
+#endif
+
+   // Write captured transfers and recorded session
+   usbcap_close();
+   srec_close();
+
+   // Free read-ahead streams
+   while(__streams != NULL) {
+      stream_t* s = __streams;
+      __streams = s->next;
+      stream_free(s);
+   }
+
+   // Free descriptor cache
+   debug_msg("descriptor cache: %lu hits, %lu misses", __cache_hits, __cache_misses);
+   while(__cache != NULL) {
+      cache_t* c = __cache;
+      __cache = c->next;
+      free(c);
+   }
+
+   // Free write-behind endpoints
+   while(__writes != NULL) {
+      wb_t* w = __writes;
+      __writes = w->next;
+      free(w);
+   }
+
    // Unhook global variable
    debug_msg("unhooking virtual bus ...");
    usb_busses = __orig_bus;
@@ -63,28 +413,11 @@ void session_teardown() {
 
    // Free busses
    debug_msg("freeing busses ...");
-   struct usb_bus* cur = NULL;
-   while(__remote_bus != NULL) {
-
-      // Shift bus ptr
-      cur = __remote_bus;
-      __remote_bus = cur->next;
-
-      // Free bus devices
-      struct usb_device* dev = NULL;
-      while(cur->devices != NULL) {
-         dev = cur->devices;
-         cur->devices = dev->next;
-
-         // Destroy configuration and free device
-         usb_destroy_configuration(dev);
-         if(dev->children != NULL)
-            free(dev->children);
-         free(dev);
-      }
-
-      // Free bus
-      free(cur);
+   __remote_bus = NULL;
+   while(__gens != NULL) {
+      bus_gen_t* gen = __gens;
+      __gens = gen->next;
+      gen_free(gen);
    }
 }
 
@@ -95,6 +428,16 @@ int session_get() {
    if(!exitf_hooked) {
       atexit(&session_teardown);
       exitf_hooked = 1;
+
+      // Start transfer capture
+      const char* cap = getenv("USBNET_CAPTURE");
+      if(cap != NULL && *cap != '\0')
+         usbcap_open(cap, 0);
+
+      // Start session recording
+      const char* rec = getenv("USBNET_RECORD");
+      if(rec != NULL && *rec != '\0')
+         srec_open(rec);
    }
 
    // Retrieve remote sock from SHM
@@ -107,9 +450,763 @@ int session_get() {
       exit(1);
    }
 
+#ifdef USE_CLIENT_STATS
+   // Begin call
+   stats_begin();
+#endif
    return __remote_fd;
 }
 
+/** Parse per-endpoint configuration "ep[:value][,ep[:value]...]".
+  * Endpoint address is in hex, only endpoints of given direction are used.
+  */
+static void parse_endpoints(const char* var, int dir, int def, int* table) {
+   const char* cfg = getenv(var);
+   while(cfg != NULL && *cfg != '\0') {
+      char* end = NULL;
+      int addr = strtol(cfg, &end, 16);
+      int val = def;
+      if(end == cfg)
+         break;
+      if(*end == ':')
+         val = strtol(end + 1, &end, 10);
+      if((addr & USB_ENDPOINT_DIR_MASK) == dir && val > 0)
+         table[addr & USB_ENDPOINT_ADDRESS_MASK] = val;
+      cfg = (*end == ',') ? end + 1 : end;
+   }
+}
+
+/* Bulk IN read-ahead.
+ * Enabled per endpoint with USBNET_READAHEAD="ep[:depth][,ep[:depth]...]",
+ * e.g. USBNET_READAHEAD="81:4,82". Results pushed by the server
+ * (UsbStreamData) may arrive between any request and its response,
+ * so every response is received through session_recv().
+ */
+
+/** Return configured read-ahead depth for endpoint, 0 if disabled. */
+static int readahead_depth(int ep) {
+
+   // Parse configuration once
+   static char parsed = 0;
+   if(!parsed) {
+      parse_endpoints("USBNET_READAHEAD", USB_ENDPOINT_IN, 4, __readahead);
+      parsed = 1;
+   }
+
+   if(!(ep & USB_ENDPOINT_IN))
+      return 0;
+
+   return __readahead[ep & USB_ENDPOINT_ADDRESS_MASK];
+}
+
+static stream_t* stream_find(int devfd, int ep) {
+   stream_t* s = __streams;
+   while(s != NULL && !(s->devfd == devfd && s->ep == ep))
+      s = s->next;
+
+   return s;
+}
+
+static void stream_free(stream_t* s) {
+   while(s->head != NULL) {
+      chunk_t* c = s->head;
+      s->head = c->next;
+      free(c);
+   }
+   free(s);
+}
+
+/** Unlink and free stream. */
+static void stream_remove(stream_t* s) {
+   stream_t** p = &__streams;
+   while(*p != s)
+      p = &(*p)->next;
+   *p = s->next;
+   stream_free(s);
+}
+
+/** Queue pushed read-ahead result.
+  * \return 0 if packet isn't read-ahead result
+  */
+static int stream_push(Packet* pkt) {
+   if(pkt_op(pkt) != UsbStreamData)
+      return 0;
+
+   // Find stream, results of closed streams are dropped
+   Iterator it;
+   pkt_begin(pkt, &it);
+   int devfd = iter_getint(&it);
+   int ep = iter_getint(&it);
+   int res = iter_getint(&it);
+   stream_t* s = stream_find(devfd, ep);
+   if(s == NULL)
+      return 1;
+
+   // Append result
+   int len = (res > 0) ? res : 0;
+   chunk_t* c = malloc(sizeof(chunk_t) + len);
+   c->res = res;
+   c->pos = 0;
+   c->next = NULL;
+   if(len > 0)
+      memcpy(c->data, it.val, len);
+   if(s->tail != NULL)
+      s->tail->next = c;
+   else
+      s->head = c;
+   s->tail = c;
+   return 1;
+}
+
+static wb_t* wb_find(int devfd, int ep) {
+   wb_t* w = __writes;
+   while(w != NULL && !(w->devfd == devfd && w->ep == ep))
+      w = w->next;
+
+   return w;
+}
+
+/** Update write-behind state from pushed ack.
+  * \return 0 if packet isn't write-behind ack
+  */
+static int wb_push(Packet* pkt) {
+   if(pkt_op(pkt) != UsbWriteAck)
+      return 0;
+
+   Iterator it;
+   pkt_begin(pkt, &it);
+   int devfd = iter_getint(&it);
+   int ep = iter_getint(&it);
+   unsigned seq = iter_getint(&it);
+   int error = iter_getint(&it);
+   wb_t* w = wb_find(devfd, ep);
+   if(w == NULL)
+      return 1;
+
+   // Keep first failure, server drops writes until client sees it
+   w->acked = seq;
+   if(error < 0) {
+      if(w->error == 0)
+         w->error = error;
+      ++w->gen;
+   }
+
+   return 1;
+}
+
+static int rtt_push(Packet* pkt);
+
+/** Process packet pushed by server.
+  * \return 0 if packet isn't pushed
+  */
+static int session_push(Packet* pkt) {
+   return stream_push(pkt) || wb_push(pkt) || rtt_push(pkt);
+}
+
+/** Receive response, process packets pushed in between.
+  * \return packet size on success, 0 on error
+  */
+static uint32_t session_recv(int fd, Packet* pkt) {
+   uint32_t res = 0;
+   do {
+      res = session_read(fd, pkt);
+      if(pkt_op(pkt) == InvalidType)
+         return 0;
+   } while(session_push(pkt));
+
+   return res;
+}
+
+/* Request deadlines.
+ * Transfer timeout is sent reduced by the measured round-trip time, so the
+ * server sees time left after the request arrives and sheds requests it
+ * can't start in time. Requests that can't finish fail locally.
+ * Enabled with USBNET_DEADLINE=1, servers that don't answer NullRequest
+ * in RTT_WAIT disable it.
+ */
+
+//! Smoothed round-trip time (us), -1 if not measured
+static long __rtt = -1;
+static long long __rtt_stamp = 0;
+
+//! Ping left unanswered, late response is dropped
+static int __rtt_lost = 0;
+
+//! Round-trip time refresh interval (us)
+#define RTT_INTERVAL 5000000
+
+//! Ping response wait limit (ms)
+#define RTT_WAIT 1000
+
+/** Drop late response to unanswered ping.
+  * \return 0 if packet isn't one
+  */
+static int rtt_push(Packet* pkt) {
+   if(!__rtt_lost || pkt_op(pkt) != NullRequest)
+      return 0;
+
+   __rtt_lost = 0;
+   return 1;
+}
+
+/** Receive response within given time, process packets pushed in between.
+  * \return 0 on error or timeout
+  */
+static int session_wait(int fd, Packet* pkt, int ms) {
+   long long end = now_us() + (long long) ms * 1000;
+   for(;;) {
+      struct pollfd p = { fd, POLLIN, 0 };
+      int left = (int) ((end - now_us()) / 1000);
+      if(left <= 0 || poll(&p, 1, left) <= 0)
+         return 0;
+
+      session_read(fd, pkt);
+      if(pkt_op(pkt) == InvalidType)
+         return 0;
+      if(!session_push(pkt))
+         return 1;
+   }
+}
+
+/** Return round-trip time in ms, measured with NullRequest when stale.
+  * \return round-trip time or 0 if disabled or unknown
+  */
+static int session_rtt(int fd, Packet* pkt) {
+
+   // Check configuration once
+   static int enabled = -1;
+   if(enabled < 0) {
+      const char* cfg = getenv("USBNET_DEADLINE");
+      enabled = (cfg != NULL && atoi(cfg) != 0);
+   }
+   if(!enabled)
+      return 0;
+
+   // Ping, servers without deadline support don't answer
+   long long start = now_us();
+   if(__rtt < 0 || start - __rtt_stamp > RTT_INTERVAL) {
+      pkt_init(pkt, NullRequest);
+      session_send(pkt, fd);
+      if(!session_wait(fd, pkt, RTT_WAIT) || pkt_op(pkt) != NullRequest) {
+         debug_msg("no ping response in %d ms, deadlines disabled", RTT_WAIT);
+         __rtt_lost = 1;
+         __rtt = -1;
+         enabled = 0;
+         return 0;
+      }
+
+      long sample = now_us() - start;
+      __rtt = (__rtt < 0) ? sample : (7 * __rtt + sample) / 8;
+      debug_msg("round-trip %ld us (sample %ld us)", __rtt, sample);
+      __rtt_stamp = now_us();
+   }
+
+   return (__rtt > 0) ? __rtt / 1000 : 0;
+}
+
+/** Reduce timeout by round-trip time, zero timeout has no deadline.
+  * \return 0 on success, -ETIMEDOUT if request can't finish in time
+  */
+static int session_deadline(int fd, Packet* pkt, int* timeout) {
+   if(*timeout <= 0)
+      return 0;
+
+   int left = *timeout - session_rtt(fd, pkt);
+   if(left <= 0) {
+      debug_msg("timeout %d ms expires in transit", *timeout);
+      return -ETIMEDOUT;
+   }
+
+   *timeout = left;
+   return 0;
+}
+
+/** Wait until at most \c pending writes are unacknowledged.
+  * \return 0 on success, -EIO on connection failure
+  */
+static int wb_wait(int fd, Packet* pkt, wb_t* w, unsigned pending) {
+   while(w->seq - w->acked > pending) {
+      session_read(fd, pkt);
+      if(pkt_op(pkt) == InvalidType)
+         return -EIO;
+      if(!session_push(pkt))
+         debug_msg("unexpected packet 0x%02x", pkt_op(pkt));
+   }
+
+   return 0;
+}
+
+/** Wait for all writes, return and clear unreported failure. */
+static int wb_flush(int fd, Packet* pkt, wb_t* w) {
+   int res = wb_wait(fd, pkt, w, 0);
+   if(w->error != 0) {
+      res = w->error;
+      w->error = 0;
+   }
+
+   return res;
+}
+
+/** Unlink and free write-behind endpoint. */
+static void wb_remove(wb_t* w) {
+   wb_t** p = &__writes;
+   while(*p != w)
+      p = &(*p)->next;
+   *p = w->next;
+   free(w);
+}
+
+/* Bulk OUT write-behind.
+ * Enabled per endpoint with USBNET_WRITEBEHIND="ep[:window][,ep[:window]...]",
+ * e.g. USBNET_WRITEBEHIND="02:16", or per handle with usbnet_write_behind().
+ */
+
+/** Return configured write-behind window for endpoint, 0 if disabled. */
+static int writebehind_window(int ep) {
+
+   // Parse configuration once
+   static char parsed = 0;
+   if(!parsed) {
+      parse_endpoints("USBNET_WRITEBEHIND", USB_ENDPOINT_OUT, 8, __writebehind);
+      parsed = 1;
+   }
+
+   if(ep & USB_ENDPOINT_IN)
+      return 0;
+
+   return __writebehind[ep & USB_ENDPOINT_ADDRESS_MASK];
+}
+
+static wb_t* wb_create(int devfd, int ep, int window) {
+   wb_t* w = malloc(sizeof(wb_t));
+   memset(w, 0, sizeof(wb_t));
+   w->devfd = devfd;
+   w->ep = ep;
+   w->window = window;
+   w->next = __writes;
+   __writes = w;
+   return w;
+}
+
+/** Queue write, report previous failure instead if any.
+  * \return size on success, negative errno on failure
+  */
+static int wb_write(int fd, Packet* pkt, wb_t* w, const char* bytes, int size, int timeout) {
+
+   // Wait for window
+   int res = wb_wait(fd, pkt, w, w->window - 1);
+   if(res < 0)
+      return res;
+
+   // Report failure, this write isn't issued
+   if(w->error != 0) {
+      res = w->error;
+      w->error = 0;
+      return res;
+   }
+
+   // Send request
+   pkt_init(pkt, UsbBulkWriteAsync);
+   pkt_addint(pkt, w->devfd);
+   pkt_addint(pkt, w->ep);
+   pkt_addint(pkt, (int) ++w->seq);
+   pkt_addint(pkt, w->gen);
+   pkt_addstr(pkt, size, bytes);
+   pkt_addint(pkt, timeout);
+   session_send(pkt, fd);
+   return size;
+}
+
+/** Open or update read-ahead stream.
+  * \return 0 on success, negative errno on error
+  */
+static int stream_open(int fd, Packet* pkt, usb_dev_handle* dev, int ep, int size, int timeout, int depth) {
+
+   // Send request
+   pkt_init(pkt, UsbStreamOpen);
+   pkt_addint(pkt, dev->fd);
+   pkt_addint(pkt, ep);
+   pkt_addint(pkt, size);
+   pkt_addint(pkt, timeout);
+   pkt_addint(pkt, depth);
+   session_send(pkt, fd);
+
+   // Get response
+   int res = -EIO;
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbStreamOpen) {
+      Iterator it;
+      pkt_begin(pkt, &it);
+      res = iter_getint(&it);
+   }
+
+   debug_msg("ep 0x%02x, %d x %dB returned %d", ep, depth, size, res);
+   stream_t* s = stream_find(dev->fd, ep);
+   if(res < 0) {
+      if(s != NULL)
+         stream_remove(s);
+      return res;
+   }
+
+   // Create stream
+   if(s == NULL) {
+      s = malloc(sizeof(stream_t));
+      memset(s, 0, sizeof(stream_t));
+      s->devfd = dev->fd;
+      s->ep = ep;
+      s->depth = depth;
+      s->next = __streams;
+      __streams = s;
+   }
+
+   s->size = size;
+   s->timeout = timeout;
+   return 0;
+}
+
+/** Stop read-ahead stream, unconsumed results are dropped. */
+static void stream_close(int fd, Packet* pkt, stream_t* s) {
+
+   // Send request
+   pkt_init(pkt, UsbStreamClose);
+   pkt_addint(pkt, s->devfd);
+   pkt_addint(pkt, s->ep);
+   session_send(pkt, fd);
+
+   // Results precede the response
+   session_recv(fd, pkt);
+   stream_remove(s);
+}
+
+/** Stop all device streams. */
+static void stream_close_all(int fd, Packet* pkt, int devfd) {
+   stream_t* s = __streams;
+   while(s != NULL) {
+      stream_t* next = s->next;
+      if(s->devfd == devfd)
+         stream_close(fd, pkt, s);
+      s = next;
+   }
+}
+
+/** Read from stream, preserve transfer boundaries and results.
+  * Result larger than requested size is consumed by subsequent reads.
+  */
+static int stream_read(int fd, Packet* pkt, stream_t* s, char* bytes, int size) {
+
+   // Wait for result
+   while(s->head == NULL) {
+      session_read(fd, pkt);
+      if(pkt_op(pkt) == InvalidType)
+         return -EIO;
+      if(!session_push(pkt))
+         debug_msg("unexpected packet 0x%02x", pkt_op(pkt));
+   }
+
+   // Consume result
+   chunk_t* c = s->head;
+   int status = c->res;
+   int res = status;
+   if(res > 0) {
+      res = c->res - c->pos;
+      if(res > size)
+         res = size;
+      memcpy(bytes, c->data + c->pos, res);
+      c->pos += res;
+      if(c->pos < c->res)
+         return res;
+   }
+
+   // Dequeue
+   s->head = c->next;
+   if(s->head == NULL)
+      s->tail = NULL;
+   free(c);
+
+   // Server stops on errors other than timeout
+   if(status < 0 && status != -ETIMEDOUT) {
+      stream_remove(s);
+      return res;
+   }
+
+   // Return credits in batches
+   if(++s->consumed >= (s->depth + 1) / 2) {
+      pkt_init(pkt, UsbStreamCredit);
+      pkt_addint(pkt, s->devfd);
+      pkt_addint(pkt, s->ep);
+      pkt_addint(pkt, s->consumed);
+      session_send(pkt, fd);
+      s->consumed = 0;
+   }
+
+   return res;
+}
+
+
+/* Chunked bulk transfers.
+ * Writes larger than USBNET_CHUNK_SIZE (default 32768, 0 disables) are
+ * sent in chunks, server writes each chunk to the device as it arrives.
+ * At most USBNET_CHUNK_WINDOW (default 4) chunks are unacknowledged.
+ * Chunk size and window are reduced to fit the chunk window the server
+ * reports on open, writes larger than it are chunked even if disabled.
+ * Reads of the same size are returned in chunks as they complete.
+ * Server applies the timeout to the whole transfer, not to each chunk.
+ */
+
+//! Server chunk window (bytes), servers that don't report it queue 4 MB
+static int __chunk_limit = 4 << 20;
+
+/** Return chunk size and window. */
+static void chunk_config(int* size, int* window) {
+
+   // Parse configuration once
+   static int chunk_size = -1, chunk_window = 4;
+   if(chunk_size < 0) {
+      const char* cfg = getenv("USBNET_CHUNK_SIZE");
+      chunk_size = (cfg != NULL) ? atoi(cfg) : 32768;
+      if(chunk_size < 0)
+         chunk_size = 32768;
+      if((cfg = getenv("USBNET_CHUNK_WINDOW")) != NULL && atoi(cfg) > 0)
+         chunk_window = atoi(cfg);
+   }
+
+   *size = chunk_size;
+   *window = chunk_window;
+}
+
+/** Fit chunks of write of given size in server chunk window. */
+static void chunk_fit(int size, int* chunk, int* window) {
+   if(*chunk <= 0 && size > __chunk_limit)
+      *chunk = __chunk_limit;
+   if(*chunk > __chunk_limit)
+      *chunk = __chunk_limit;
+   if(*chunk > 0 && (long long) *chunk * *window > __chunk_limit)
+      *window = __chunk_limit / *chunk;
+}
+
+/** Write in chunks, stop sending on first failed or short chunk.
+  * \return usb_bulk_write() result
+  */
+static int chunk_write(int fd, Packet* pkt, usb_dev_handle* dev, int ep, const char* bytes, int size, int timeout, int chunk, int window) {
+   int offset = 0, inflight = 0, last = 0, failed = 0;
+   for(;;) {
+
+      // Fill window, failure is finished with empty chunk
+      while(!last && inflight < window) {
+         int len = size - offset;
+         if(len > chunk)
+            len = chunk;
+         if(failed)
+            len = 0;
+         last = failed || (offset + len >= size);
+         pkt_init(pkt, UsbDataChunk);
+         pkt_addint(pkt, dev->fd);
+         pkt_addint(pkt, ep);
+         pkt_addint(pkt, last);
+         pkt_addstr(pkt, len, bytes + offset);
+         pkt_addint(pkt, timeout);
+         session_send(pkt, fd);
+         offset += len;
+         ++inflight;
+      }
+
+      // Chunk ack or transfer result
+      if(session_recv(fd, pkt) == 0)
+         return -EIO;
+
+      Iterator it;
+      pkt_begin(pkt, &it);
+      if(pkt_op(pkt) == UsbBulkWrite)
+         return iter_getint(&it);
+      if(pkt_op(pkt) == UsbDataChunk) {
+         iter_getint(&it); // Device fd
+         iter_getint(&it); // Endpoint
+         if(iter_getint(&it) != chunk)
+            failed = 1;
+         --inflight;
+      }
+   }
+}
+
+/* Descriptor cache.
+ * Standard GET_DESCRIPTOR reads (device and interface recipient) are
+ * idempotent and cached per device. Cache is invalidated on reset,
+ * configuration change, SET_DESCRIPTOR and re-enumeration.
+ * Disabled with USBNET_CACHE=0.
+ */
+
+/** Return true if request is cacheable. */
+static int cache_accepts(int requesttype, int request) {
+
+   // Check configuration once
+   static int enabled = -1;
+   if(enabled < 0) {
+      const char* cfg = getenv("USBNET_CACHE");
+      enabled = (cfg == NULL || atoi(cfg) != 0);
+   }
+
+   return enabled && request == USB_REQ_GET_DESCRIPTOR &&
+          (requesttype == (USB_ENDPOINT_IN|USB_TYPE_STANDARD|USB_RECIP_DEVICE) ||
+           requesttype == (USB_ENDPOINT_IN|USB_TYPE_STANDARD|USB_RECIP_INTERFACE));
+}
+
+/** Drop cached reads of device, all devices if dev is NULL. */
+static void cache_invalidate(usb_dev_handle* dev) {
+   cache_t** p = &__cache;
+   while(*p != NULL) {
+      cache_t* c = *p;
+      if(dev == NULL || (c->bus == dev->bus->location && c->devnum == dev->device->devnum)) {
+         *p = c->next;
+         --__cache_entries;
+         free(c);
+      }
+      else
+         p = &c->next;
+   }
+}
+
+/** Answer read from cache.
+  * Hit if cached read covers requested size or returned the whole descriptor.
+  * \return read length or -1 on miss
+  */
+static int cache_get(usb_dev_handle* dev, int requesttype, int request, int value, int index, char* bytes, int size) {
+   if(!cache_accepts(requesttype, request))
+      return -1;
+
+   cache_t* c = __cache;
+   for(; c != NULL; c = c->next) {
+      if(c->bus == dev->bus->location && c->devnum == dev->device->devnum &&
+         c->requesttype == requesttype && c->value == value && c->index == index &&
+         (size <= c->size || c->res < c->size)) {
+         int res = (size < c->res) ? size : c->res;
+         memcpy(bytes, c->data, res);
+         ++__cache_hits;
+         return res;
+      }
+   }
+
+   ++__cache_misses;
+   return -1;
+}
+
+/** Store read result. */
+static void cache_put(usb_dev_handle* dev, int requesttype, int request, int value, int index, const char* bytes, int size, int res) {
+   if(res <= 0 || !cache_accepts(requesttype, request))
+      return;
+
+   // Evict least recent entry
+   if(__cache_entries >= CACHE_MAX_ENTRIES) {
+      cache_t** p = &__cache;
+      while((*p)->next != NULL)
+         p = &(*p)->next;
+      free(*p);
+      *p = NULL;
+      --__cache_entries;
+   }
+
+   cache_t* c = malloc(sizeof(cache_t) + res);
+   c->bus = dev->bus->location;
+   c->devnum = dev->device->devnum;
+   c->requesttype = requesttype;
+   c->value = value;
+   c->index = index;
+   c->size = size;
+   c->res = res;
+   memcpy(c->data, bytes, res);
+   c->next = __cache;
+   __cache = c;
+   ++__cache_entries;
+}
+
+/** Invalidate device cache on requests changing descriptors. */
+static void cache_control(usb_dev_handle* dev, int requesttype, int request) {
+   if((requesttype & USB_TYPE_RESERVED) == USB_TYPE_STANDARD &&
+      (request == USB_REQ_SET_CONFIGURATION || request == USB_REQ_SET_DESCRIPTOR))
+      cache_invalidate(dev);
+}
+
+/* Virtual bus tree.
+ * Each usb_find_devices() builds a new tree generation in its own arena
+ * and swaps it into usb_busses once complete. Replaced generations are
+ * kept until the last handle opened on their devices is closed.
+ */
+
+/** Allocate zeroed memory in generation arena. */
+static void* gen_alloc(bus_gen_t* gen, size_t size) {
+
+   // Keep pointer alignment
+   size = (size + 2 * sizeof(void*) - 1) & ~(2 * sizeof(void*) - 1);
+
+   // Allocate new block
+   arena_t* a = gen->arena;
+   if(a == NULL || a->size - a->used < size) {
+      size_t bsize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+      a = malloc(sizeof(arena_t) + bsize);
+      a->used = 0;
+      a->size = bsize;
+      a->next = gen->arena;
+      gen->arena = a;
+      gen->bytes += sizeof(arena_t) + bsize;
+   }
+
+   void* ptr = a->data + a->used;
+   a->used += size;
+   memset(ptr, 0, size);
+   return ptr;
+}
+
+/** Free generation with its arena. */
+static void gen_free(bus_gen_t* gen) {
+   debug_msg("freeing generation %u (%lu bytes)", gen->id, gen->bytes);
+   while(gen->arena != NULL) {
+      arena_t* a = gen->arena;
+      gen->arena = a->next;
+      free(a);
+   }
+   free(gen);
+}
+
+/** Return generation owning device, NULL if not found. */
+static bus_gen_t* gen_find(struct usb_device* dev) {
+   bus_gen_t* gen;
+   for(gen = __gens; gen != NULL; gen = gen->next) {
+      arena_t* a;
+      for(a = gen->arena; a != NULL; a = a->next) {
+         if((char*) dev >= a->data && (char*) dev < a->data + a->used)
+            return gen;
+      }
+   }
+   return NULL;
+}
+
+/** Free replaced generation if no longer referenced. */
+static void gen_release(bus_gen_t* gen) {
+   if(gen == __gens || gen->refs > 0)
+      return;
+
+   bus_gen_t** p = &__gens;
+   while(*p != gen)
+      p = &(*p)->next;
+   *p = gen->next;
+   gen_free(gen);
+}
+
+/* Transfer capture.
+ * With USBNET_CAPTURE set, transfers are written to a pcap file
+ * in usbmon format as seen by the application.
+ */
+
+/** Record transfer submission, return 0 if capture is off. */
+static int capture_begin(usbcap_urb_t* urb, usb_dev_handle* dev, int xfer, int ep,
+                         const uint8_t* setup, const char* bytes, int size) {
+   if(!usbcap_enabled())
+      return 0;
+
+   struct usb_device* d = dev->device;
+   int busnum = (d != NULL && d->bus != NULL) ? atoi(d->bus->dirname) : 0;
+   usbcap_urb(urb, xfer, ep, busnum, (d != NULL) ? d->devnum : 0, setup);
+   usbcap_submit(urb, bytes, size);
+   return 1;
+}
 
 /* libusb functions reimplementation.
  * \see http://libusb.sourceforge.net/doc/functions.html
@@ -128,8 +1225,8 @@ void usb_init(void)
 
    // Create buffer
    pkt_init(pkt, UsbInit);
-   pkt_send(pkt, fd);
-   pkt_release();
+   session_send(pkt, fd);
+   session_release();
 
    // Initialize locally
    debug_msg("called");
@@ -146,19 +1243,19 @@ int usb_find_busses(void)
 
    // Initialize pkt
    pkt_init(pkt, UsbFindBusses);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get number of changes
    int res = 0;
    Iterator it;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbFindBusses) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbFindBusses) {
       if(pkt_begin(pkt, &it) != NULL) {
          res = iter_getint(&it);
       }
    }
 
    // Return remote result
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -173,23 +1270,30 @@ int usb_find_devices(void)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
-   // Create buffer
+   // Re-enumeration invalidates cached descriptors
+   cache_invalidate(NULL);
+
+   // Create buffer, pass device filter if set
    pkt_init(pkt, UsbFindDevices);
-   pkt_send(pkt, fd);
+   const char* filter = getenv("USBNET_FILTER");
+   if(filter != NULL && *filter != '\0')
+      pkt_addstr(pkt, strlen(filter) + 1, filter);
+   session_send(pkt, fd);
 
    // Get number of changes
    int res = 0;
    Iterator it;
-   if(pkt_recv(fd, pkt) > 0) {
+   if(session_recv(fd, pkt) > 0) {
       pkt_begin(pkt, &it);
 
       // Get return value
       res = iter_getint(&it);
 
-      // Allocate virtualbus
-      struct usb_bus vbus;
-      vbus.next = __remote_bus;
-      struct usb_bus* rbus = &vbus;
+      // Build new generation
+      bus_gen_t* gen = malloc(sizeof(bus_gen_t));
+      memset(gen, 0, sizeof(bus_gen_t));
+      gen->id = ++__gen_last;
+      struct usb_bus* rbus = NULL;
 
       // Get busses
       while(!iter_end(&it)) {
@@ -199,17 +1303,13 @@ int usb_find_devices(void)
             iter_enter(&it);
 
             // Allocate bus
-            if(rbus->next == NULL) {
-
-               // Allocate next item
-               struct usb_bus* nbus = malloc(sizeof(struct usb_bus));
-               memset(nbus, 0, sizeof(struct usb_bus));
-               rbus->next = nbus;
-               nbus->prev = rbus;
-               rbus = nbus;
-            }
+            struct usb_bus* nbus = gen_alloc(gen, sizeof(struct usb_bus));
+            if(rbus == NULL)
+               gen->busses = nbus;
             else
-               rbus = rbus->next;
+               rbus->next = nbus;
+            nbus->prev = rbus;
+            rbus = nbus;
 
             // Read dirname
             strcpy(rbus->dirname, iter_getstr(&it));
@@ -218,24 +1318,19 @@ int usb_find_devices(void)
             rbus->location = iter_getuint(&it);
 
             // Read devices
-            struct usb_device vdev;
-            vdev.next = rbus->devices;
-            struct usb_device* dev = &vdev;
+            struct usb_device* dev = NULL;
             while(it.type == SequenceType) {
                iter_enter(&it);
 
-               // Initialize
-               if(dev->next == NULL) {
-                  dev->next = malloc(sizeof(struct usb_device));
-                  memset(dev->next, 0, sizeof(struct usb_device));
-                  dev->next->bus = rbus;
-                  if(dev != &vdev)
-                     dev->next->prev = dev;
-                  if(rbus->devices == NULL)
-                     rbus->devices = dev->next;
-               }
-
-               dev = dev->next;
+               // Allocate device
+               struct usb_device* ndev = gen_alloc(gen, sizeof(struct usb_device));
+               ndev->bus = rbus;
+               if(dev == NULL)
+                  rbus->devices = ndev;
+               else
+                  dev->next = ndev;
+               ndev->prev = dev;
+               dev = ndev;
 
                // Read filename
                strcpy(dev->filename, iter_getstr(&it));
@@ -255,10 +1350,8 @@ int usb_find_devices(void)
                // Alloc configurations
                unsigned cfgid = 0, cfgnum = dev->descriptor.bNumConfigurations;
                dev->config = NULL;
-               if(cfgnum > 0) {
-                  dev->config = malloc(cfgnum * sizeof(struct usb_config_descriptor));
-                  memset(dev->config, 0, cfgnum * sizeof(struct usb_config_descriptor));
-               }
+               if(cfgnum > 0)
+                  dev->config = gen_alloc(gen, cfgnum * sizeof(struct usb_config_descriptor));
 
                // Read config
                while(it.type == RawType && cfgid < cfgnum) {
@@ -276,9 +1369,8 @@ int usb_find_devices(void)
 
                   // Allocate interfaces
                   cfg->interface = NULL;
-                  if(cfg->bNumInterfaces > 0) {
-                     cfg->interface = malloc(cfg->bNumInterfaces * sizeof(struct usb_interface));
-                  }
+                  if(cfg->bNumInterfaces > 0)
+                     cfg->interface = gen_alloc(gen, cfg->bNumInterfaces * sizeof(struct usb_interface));
 
                   //! \test Implement usb_device extra interfaces - are they needed?
                   cfg->extralen = 0;
@@ -294,9 +1386,8 @@ int usb_find_devices(void)
                      iface->num_altsetting = iter_getint(&it);
 
                      // Allocate altsettings
-                     if(iface->num_altsetting > 0) {
-                        iface->altsetting = malloc(iface->num_altsetting * sizeof(struct usb_interface_descriptor));
-                     }
+                     if(iface->num_altsetting > 0)
+                        iface->altsetting = gen_alloc(gen, iface->num_altsetting * sizeof(struct usb_interface_descriptor));
 
                      // Load altsettings
                      for(j = 0; j < iface->num_altsetting; ++j) {
@@ -313,11 +1404,8 @@ int usb_find_devices(void)
 
                         // Allocate endpoints
                         as->endpoint = NULL;
-                        if(as->bNumEndpoints > 0) {
-                           size_t epsize = as->bNumEndpoints * sizeof(struct usb_endpoint_descriptor);
-                           as->endpoint = malloc(epsize);
-                           memset(as->endpoint, 0, epsize);
-                        }
+                        if(as->bNumEndpoints > 0)
+                           as->endpoint = gen_alloc(gen, as->bNumEndpoints * sizeof(struct usb_endpoint_descriptor));
 
                         // Load endpoints
                         for(k = 0; k < as->bNumEndpoints; ++k) {
@@ -341,7 +1429,7 @@ int usb_find_devices(void)
                         iter_next(&it);
 
                         if(as->extralen > 0){
-                            as->extra = malloc(as->extralen);
+                            as->extra = gen_alloc(gen, as->extralen);
 
                             int szlen = as->extralen;
                             if(szlen > it.len)
@@ -358,15 +1446,6 @@ int usb_find_devices(void)
 
                //log_msg("Bus %s Device %s: ID %04x:%04x", rbus->dirname, dev->filename, dev->descriptor.idVendor, dev->descriptor.idProduct);
             }
-
-            // Free unused devices
-            while(dev->next != NULL) {
-               struct usb_device* ddev = dev->next;
-               debug_msg("deleting device %03d", ddev->devnum);
-               dev->next = ddev->next;
-               free(ddev);
-            }
-
          }
          else {
             debug_msg("unexpected item identifier 0x%02x", it.type);
@@ -374,25 +1453,26 @@ int usb_find_devices(void)
          }
       }
 
-      // Deallocate unnecessary busses
-      while(rbus->next != NULL) {
-         debug_msg("deleting bus %03d", rbus->next->location);
-         struct usb_bus* bus = rbus->next;
-         rbus->next = bus->next;
-      }
-
-      // Save busses
-      if(__remote_bus == NULL) {
+      // Swap complete tree into usb_busses
+      if(__gens == NULL) {
          __orig_bus = usb_busses;
-         debug_msg("overriding global usb_busses from %p to %p", usb_busses, vbus.next);
+         debug_msg("overriding global usb_busses from %p to %p", usb_busses, gen->busses);
       }
 
-      __remote_bus = vbus.next;
+      bus_gen_t* prev = __gens;
+      gen->next = __gens;
+      __gens = gen;
+      __remote_bus = gen->busses;
       usb_busses = __remote_bus;
+      debug_msg("generation %u: %lu bytes", gen->id, gen->bytes);
+
+      // Release replaced generation
+      if(prev != NULL)
+         gen_release(prev);
    }
 
    // Return remote result
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -420,15 +1500,17 @@ usb_dev_handle *usb_open(struct usb_device *dev)
    pkt_init(pkt, UsbOpen);
    pkt_adduint(pkt, dev->bus->location);
    pkt_adduint(pkt, dev->devnum);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
-   // Get response
-   int res = -1, devfd = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbOpen) {
+   // Get response, chunk window is reported by newer servers
+   int res = -1, devfd = -1, limit = 0;
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbOpen) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
       devfd = iter_getint(&it);
+      if(!iter_end(&it) && (limit = iter_getint(&it)) > 0)
+         __chunk_limit = limit;
    }
 
    // Evaluate
@@ -439,9 +1521,15 @@ usb_dev_handle *usb_open(struct usb_device *dev)
       udev->device = dev;
       udev->bus = dev->bus;
       udev->config = udev->interface = udev->altsetting = -1;
+
+      // Keep device generation
+      bus_gen_t* gen = gen_find(dev);
+      if(gen != NULL)
+         ++gen->refs;
+      udev->impl_info = gen;
    }
 
-   pkt_release();
+   session_release();
    debug_msg("returned %d (fd %d)", res, devfd);
    return udev;
 }
@@ -452,23 +1540,53 @@ int usb_close(usb_dev_handle *dev)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Wait for pending writes, keep first failure
+   int error = 0;
+   wb_t* w = __writes;
+   while(w != NULL) {
+      wb_t* next = w->next;
+      if(w->devfd == dev->fd) {
+         int res = wb_flush(fd, pkt, w);
+         if(error == 0)
+            error = res;
+         wb_remove(w);
+      }
+      w = next;
+   }
+
+   // Drop streams, closed by server
+   stream_t* s = __streams;
+   while(s != NULL) {
+      stream_t* next = s->next;
+      if(s->devfd == dev->fd)
+         stream_remove(s);
+      s = next;
+   }
+
    // Send packet
    pkt_init(pkt, UsbClose);
    pkt_addint(pkt, dev->fd);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
-   // Free device
+   // Free device, release its generation
+   bus_gen_t* gen = dev->impl_info;
+   if(gen != NULL && --gen->refs == 0)
+      gen_release(gen);
    free(dev);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClose) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClose) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
    }
 
-   pkt_release();
+   // Report write-behind failure
+   if(res == 0 && error < 0)
+      res = error;
+
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -479,15 +1597,21 @@ int usb_set_configuration(usb_dev_handle *dev, int configuration)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Interface state changes, stop read-ahead
+   stream_close_all(fd, pkt, dev->fd);
+
+   // Descriptors may change
+   cache_invalidate(dev);
+
    // Prepare packet
    pkt_init(pkt, UsbSetConfiguration);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, configuration);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbSetConfiguration) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbSetConfiguration) {
       Iterator it;
       pkt_begin(pkt, &it);
 
@@ -502,7 +1626,7 @@ int usb_set_configuration(usb_dev_handle *dev, int configuration)
    dev->config = configuration;
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -513,15 +1637,18 @@ int usb_set_altinterface(usb_dev_handle *dev, int alternate)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Interface state changes, stop read-ahead
+   stream_close_all(fd, pkt, dev->fd);
+
    // Prepare packet
    pkt_init(pkt, UsbSetAltInterface);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, alternate);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbSetAltInterface) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbSetAltInterface) {
       Iterator it;
       pkt_begin(pkt, &it);
 
@@ -536,7 +1663,7 @@ int usb_set_altinterface(usb_dev_handle *dev, int alternate)
    dev->altsetting = alternate;
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -547,15 +1674,20 @@ int usb_resetep(usb_dev_handle *dev, unsigned int ep)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Endpoint state changes, stop read-ahead
+   stream_t* s = stream_find(dev->fd, ep);
+   if(s != NULL)
+      stream_close(fd, pkt, s);
+
    // Prepare packet
    pkt_init(pkt, UsbResetEp);
    pkt_addint(pkt,  dev->fd);
    pkt_adduint(pkt, ep);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbResetEp) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbResetEp) {
       Iterator it;
       pkt_begin(pkt, &it);
 
@@ -564,7 +1696,7 @@ int usb_resetep(usb_dev_handle *dev, unsigned int ep)
    }
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -575,15 +1707,20 @@ int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Endpoint state changes, stop read-ahead
+   stream_t* s = stream_find(dev->fd, ep);
+   if(s != NULL)
+      stream_close(fd, pkt, s);
+
    // Prepare packet
    pkt_init(pkt, UsbClearHalt);
    pkt_addint(pkt, dev->fd);
    pkt_adduint(pkt, ep);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClearHalt) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClearHalt) {
       Iterator it;
       pkt_begin(pkt, &it);
 
@@ -592,7 +1729,7 @@ int usb_clear_halt(usb_dev_handle *dev, unsigned int ep)
    }
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -603,14 +1740,20 @@ int usb_reset(usb_dev_handle *dev)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Interface state changes, stop read-ahead
+   stream_close_all(fd, pkt, dev->fd);
+
+   // Descriptors may change
+   cache_invalidate(dev);
+
    // Prepare packet
    pkt_init(pkt, UsbReset);
    pkt_addint(pkt, dev->fd);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbReset) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbReset) {
       Iterator it;
       pkt_begin(pkt, &it);
 
@@ -619,7 +1762,7 @@ int usb_reset(usb_dev_handle *dev)
    }
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -634,17 +1777,17 @@ int usb_claim_interface(usb_dev_handle *dev, int interface)
    pkt_init(pkt, UsbClaimInterface);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, interface);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClaimInterface) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbClaimInterface) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
    }
 
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -655,21 +1798,24 @@ int usb_release_interface(usb_dev_handle *dev, int interface)
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Interface state changes, stop read-ahead
+   stream_close_all(fd, pkt, dev->fd);
+
    // Send packet
    pkt_init(pkt, UsbReleaseInterface);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, interface);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbReleaseInterface) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbReleaseInterface) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
    }
 
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -678,13 +1824,28 @@ int usb_release_interface(usb_dev_handle *dev, int interface)
  * Control transfers.
  */
 
-int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
+static int control_msg(usb_dev_handle *dev, int requesttype, int request,
         int value, int index, char *bytes, int size, int timeout)
 {
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Answer from descriptor cache
+   int res = cache_get(dev, requesttype, request, value, index, bytes, size);
+   if(res >= 0) {
+      session_release();
+      debug_msg("returned %d (cached)", res);
+      return res;
+   }
+   cache_control(dev, requesttype, request);
+
+   // Fail fast if timeout expires in transit
+   if(session_deadline(fd, pkt, &timeout) < 0) {
+      session_release();
+      return -ETIMEDOUT;
+   }
+
    // Prepare packet
    pkt_init(pkt, UsbControlMsg);
    pkt_addint(pkt, dev->fd);
@@ -694,11 +1855,11 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
    pkt_addint(pkt, index);
    pkt_addstr(pkt, size, bytes);
    pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
-   int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbControlMsg) {
+   res = -1;
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbControlMsg) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
@@ -708,129 +1869,260 @@ int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
          memcpy(bytes, it.val, minlen);
       }
 
+      cache_put(dev, requesttype, request, value, index, bytes, size, (res > size) ? size : res);
    }
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
 
+int usb_control_msg(usb_dev_handle *dev, int requesttype, int request,
+        int value, int index, char *bytes, int size, int timeout)
+{
+   // Setup packet in wire order
+   uint8_t setup[8] = { requesttype, request, value & 0xff, value >> 8,
+                        index & 0xff, index >> 8, size & 0xff, size >> 8 };
+   usbcap_urb_t urb;
+   int captured = capture_begin(&urb, dev, UsbCapControl, requesttype & USB_ENDPOINT_IN, setup, bytes, size);
+   int res = control_msg(dev, requesttype, request, value, index, bytes, size, timeout);
+   if(captured)
+      usbcap_complete(&urb, bytes, res);
+   return res;
+}
+
 /* libusb(4):
  * Bulk transfers.
  */
 
-int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+static int bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
 {
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
-   // Prepare packet
+   // Serve from read-ahead stream
+   stream_t* s = stream_find(dev->fd, ep);
+   int depth = readahead_depth(ep);
+   if(depth > 0 && (s == NULL || (!s->subscribed && (s->size != size || s->timeout != timeout)))) {
+      if(stream_open(fd, pkt, dev, ep, size, timeout, depth) < 0)
+         __readahead[ep & USB_ENDPOINT_ADDRESS_MASK] = 0; // Refused, read synchronously
+      s = stream_find(dev->fd, ep);
+   }
+   if(s != NULL) {
+      int res = stream_read(fd, pkt, s, bytes, size);
+      session_release();
+      debug_msg("returned %d (read-ahead)", res);
+      return res;
+   }
+
+   // Fail fast if timeout expires in transit
+   if(session_deadline(fd, pkt, &timeout) < 0) {
+      session_release();
+      return -ETIMEDOUT;
+   }
+
+   // Prepare packet, large reads are returned in chunks
+   int chunk = 0, window = 0;
+   chunk_config(&chunk, &window);
    pkt_init(pkt, UsbBulkRead);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, ep);
    pkt_addint(pkt, size);
    pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   if(chunk > 0 && size > chunk)
+      pkt_addint(pkt, chunk);
+   session_send(pkt, fd);
 
-   // Get response
-   int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbBulkRead) {
+   // Collect chunks until result
+   int res = -1, offset = 0;
+   while(session_recv(fd, pkt) > 0) {
 
       Iterator it;
       pkt_begin(pkt, &it);
-      res = iter_getint(&it);
-
-      if(res > 0) {
-         int minlen = (res > size) ? size : res;
-         memcpy(bytes, it.val, minlen);
+      if(pkt_op(pkt) == UsbDataChunk) {
+         iter_getint(&it); // Device fd
+         iter_getint(&it); // Endpoint
+         int len = ((int) it.len > size - offset) ? size - offset : (int) it.len;
+         memcpy(bytes + offset, it.val, len);
+         offset += len;
+         continue;
       }
 
+      if(pkt_op(pkt) == UsbBulkRead) {
+         res = iter_getint(&it);
+
+         // Single response carries data
+         if(res > 0 && offset == 0 && !iter_end(&it)) {
+            int minlen = (res > size) ? size : res;
+            memcpy(bytes, it.val, minlen);
+         }
+      }
+      break;
    }
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
 
-int usb_bulk_write(usb_dev_handle *dev, int ep, const char * bytes, int size, int timeout)
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+   usbcap_urb_t urb;
+   int captured = capture_begin(&urb, dev, UsbCapBulk, ep, NULL, bytes, size);
+   int res = bulk_read(dev, ep, bytes, size, timeout);
+   if(captured)
+      usbcap_complete(&urb, bytes, res);
+   return res;
+}
+
+static int bulk_write(usb_dev_handle *dev, int ep, const char * bytes, int size, int timeout)
 {
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Write-behind
+   wb_t* w = wb_find(dev->fd, ep);
+   if(w == NULL && writebehind_window(ep) > 0)
+      w = wb_create(dev->fd, ep, writebehind_window(ep));
+   if(w != NULL && size <= __chunk_limit) {
+      int res = wb_write(fd, pkt, w, bytes, size, timeout);
+      session_release();
+      debug_msg("returned %d (write-behind)", res);
+      return res;
+   }
+
+   // Writes over chunk window are chunked after queued writes
+   if(w != NULL) {
+      int res = wb_flush(fd, pkt, w);
+      if(res < 0) {
+         session_release();
+         return res;
+      }
+   }
+
+   // Fail fast if timeout expires in transit
+   if(session_deadline(fd, pkt, &timeout) < 0) {
+      session_release();
+      return -ETIMEDOUT;
+   }
+
+   // Large write in chunks
+   int chunk, window;
+   chunk_config(&chunk, &window);
+   chunk_fit(size, &chunk, &window);
+   if(chunk > 0 && size > chunk) {
+      int res = chunk_write(fd, pkt, dev, ep, bytes, size, timeout, chunk, window);
+      session_release();
+      debug_msg("returned %d (chunked)", res);
+      return res;
+   }
+
    // Prepare packet
    pkt_init(pkt, UsbBulkWrite);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, ep);
    pkt_addstr(pkt, size,        bytes);
    pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbBulkWrite) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbBulkWrite) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
    }
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
 
+int usb_bulk_write(usb_dev_handle *dev, int ep, const char * bytes, int size, int timeout)
+{
+   usbcap_urb_t urb;
+   int captured = capture_begin(&urb, dev, UsbCapBulk, ep, NULL, bytes, size);
+   int res = bulk_write(dev, ep, bytes, size, timeout);
+   if(captured)
+      usbcap_complete(&urb, bytes, res);
+   return res;
+}
+
 /* libusb(5):
  * Interrupt transfers.
  */
-int usb_interrupt_write(usb_dev_handle *dev, int ep, const char * bytes, int size, int timeout)
+static int interrupt_write(usb_dev_handle *dev, int ep, const char * bytes, int size, int timeout)
 {
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Fail fast if timeout expires in transit
+   if(session_deadline(fd, pkt, &timeout) < 0) {
+      session_release();
+      return -ETIMEDOUT;
+   }
+
    // Prepare packet
    pkt_init(pkt, UsbInterruptWrite);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, ep);
    pkt_addstr(pkt, size, bytes);
    pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbInterruptWrite) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbInterruptWrite) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
    }
 
    // Return response
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
 
-int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+int usb_interrupt_write(usb_dev_handle *dev, int ep, const char * bytes, int size, int timeout)
+{
+   usbcap_urb_t urb;
+   int captured = capture_begin(&urb, dev, UsbCapInterrupt, ep, NULL, bytes, size);
+   int res = interrupt_write(dev, ep, bytes, size, timeout);
+   if(captured)
+      usbcap_complete(&urb, bytes, res);
+   return res;
+}
+
+static int interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
 {
    // Get remote fd
    Packet* pkt = pkt_claim();
    int fd = session_get();
 
+   // Fail fast if timeout expires in transit
+   if(session_deadline(fd, pkt, &timeout) < 0) {
+      session_release();
+      return -ETIMEDOUT;
+   }
+
    // Prepare packet
    pkt_init(pkt, UsbInterruptRead);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, ep);
    pkt_addint(pkt, size);
    pkt_addint(pkt, timeout);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbInterruptRead) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbInterruptRead) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
@@ -843,11 +2135,223 @@ int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int t
    }
 
    // Return response
-   pkt_release();
+   session_release();
+   debug_msg("returned %d", res);
+   return res;
+}
+
+int usb_interrupt_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout)
+{
+   usbcap_urb_t urb;
+   int captured = capture_begin(&urb, dev, UsbCapInterrupt, ep, NULL, bytes, size);
+   int res = interrupt_read(dev, ep, bytes, size, timeout);
+   if(captured)
+      usbcap_complete(&urb, bytes, res);
+   return res;
+}
+
+/* libusbnet extensions:
+ * Bulk IN streaming.
+ */
+
+int usbnet_stream_open(usb_dev_handle *dev, int ep, int chunk, int depth)
+{
+   if(!(ep & USB_ENDPOINT_IN) || chunk <= 0 || depth <= 0)
+      return -EINVAL;
+
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+
+   // Open stream with fixed parameters
+   int res = stream_open(fd, pkt, dev, ep, chunk, USBNET_STREAM_TIMEOUT, depth);
+   if(res == 0)
+      stream_find(dev->fd, ep)->subscribed = 1;
+
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
 
+int usbnet_stream_read(usb_dev_handle *dev, int ep, char *bytes, int size)
+{
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+
+   // Read next chunk
+   int res = -EBADF;
+   stream_t* s = stream_find(dev->fd, ep);
+   if(s != NULL)
+      res = stream_read(fd, pkt, s, bytes, size);
+
+   session_release();
+   return res;
+}
+
+int usbnet_stream_close(usb_dev_handle *dev, int ep)
+{
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+
+   // Close stream
+   int res = -EBADF;
+   stream_t* s = stream_find(dev->fd, ep);
+   if(s != NULL) {
+      stream_close(fd, pkt, s);
+      res = 0;
+   }
+
+   session_release();
+   debug_msg("returned %d", res);
+   return res;
+}
+
+/* libusbnet extensions:
+ * Bulk OUT write-behind.
+ */
+
+int usbnet_write_behind(usb_dev_handle *dev, int ep, int window)
+{
+   if(ep & USB_ENDPOINT_IN || window < 0)
+      return -EINVAL;
+
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+
+   // Update window or disable
+   int res = 0;
+   wb_t* w = wb_find(dev->fd, ep);
+   if(window > 0) {
+      if(w == NULL)
+         w = wb_create(dev->fd, ep, window);
+      w->window = window;
+   }
+   else if(w != NULL) {
+      res = wb_flush(fd, pkt, w);
+      wb_remove(w);
+   }
+
+   session_release();
+   debug_msg("returned %d", res);
+   return res;
+}
+
+int usbnet_write_flush(usb_dev_handle *dev, int ep)
+{
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+
+   // Wait for pending writes
+   int res = 0;
+   wb_t* w = wb_find(dev->fd, ep);
+   if(w != NULL)
+      res = wb_flush(fd, pkt, w);
+
+   session_release();
+   debug_msg("returned %d", res);
+   return res;
+}
+
+/* libusbnet extensions:
+ * Descriptor cache counters.
+ */
+
+void usbnet_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+   pkt_claim();
+   if(hits != NULL)
+      *hits = __cache_hits;
+   if(misses != NULL)
+      *misses = __cache_misses;
+   session_release();
+}
+
+void usbnet_bus_stats(unsigned *generation, unsigned long *bytes, unsigned long *retained)
+{
+   pkt_claim();
+   unsigned long kept = 0;
+   bus_gen_t* gen = __gens;
+   for(gen = (gen != NULL ? gen->next : NULL); gen != NULL; gen = gen->next)
+      kept += gen->bytes;
+   if(generation != NULL)
+      *generation = (__gens != NULL) ? __gens->id : 0;
+   if(bytes != NULL)
+      *bytes = (__gens != NULL) ? __gens->bytes : 0;
+   if(retained != NULL)
+      *retained = kept;
+   session_release();
+}
+
+/* libusbnet extensions:
+ * Batched control transfers.
+ */
+
+int usbnet_control_batch(usb_dev_handle *dev, usbnet_control_t *ctl, int count)
+{
+   if(count <= 0)
+      return 0;
+   if(count > USBNET_BATCH_MAX)
+      return -EINVAL;
+
+   // Get remote fd
+   Packet* pkt = pkt_claim();
+   int fd = session_get();
+
+   // Batch deadline is given by the first transfer
+   int i, timeout = ctl[0].timeout;
+   if(session_deadline(fd, pkt, &timeout) < 0) {
+      for(i = 0; i < count; ++i)
+         ctl[i].result = (i == 0) ? -ETIMEDOUT : -ECANCELED;
+      session_release();
+      return -ETIMEDOUT;
+   }
+
+   // Prepare packet, IN data stages are not sent
+   pkt_init(pkt, UsbControlBatch);
+   pkt_addint(pkt, dev->fd);
+   pkt_addint(pkt, count);
+   for(i = 0; i < count; ++i) {
+      int input = ctl[i].requesttype & USB_ENDPOINT_IN;
+      pkt_addint(pkt, ctl[i].requesttype);
+      pkt_addint(pkt, ctl[i].request);
+      pkt_addint(pkt, ctl[i].value);
+      pkt_addint(pkt, ctl[i].index);
+      pkt_addint(pkt, ctl[i].size);
+      pkt_addstr(pkt, input ? 0 : ctl[i].size, ctl[i].bytes);
+      pkt_addint(pkt, (i == 0) ? timeout : ctl[i].timeout);
+      ctl[i].result = -ECANCELED;
+      cache_control(dev, ctl[i].requesttype, ctl[i].request);
+   }
+   session_send(pkt, fd);
+
+   // Get results of executed transfers
+   int res = -EIO;
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbControlBatch) {
+      Iterator it;
+      pkt_begin(pkt, &it);
+      for(res = 0, i = 0; i < count && !iter_end(&it); ++i) {
+         ctl[i].result = iter_getint(&it);
+         if(ctl[i].result > 0 && it.len > 0) {
+            int minlen = (it.len > (uint32_t) ctl[i].size) ? ctl[i].size : (int) it.len;
+            memcpy(ctl[i].bytes, it.val, minlen);
+         }
+         iter_next(&it);
+         if(ctl[i].result < 0)
+            break;
+         ++res;
+      }
+   }
+
+   // Return response
+   session_release();
+   debug_msg("returned %d/%d", res, count);
+   return res;
+}
+
 /* libusb(6):
  * Non-portable.
  */
@@ -872,11 +2376,11 @@ int usb_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned i
    pkt_addint(pkt,  dev->fd);
    pkt_addint(pkt,  interface);
    pkt_adduint(pkt, namelen);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbGetKernelDriver) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbGetKernelDriver) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
@@ -891,7 +2395,7 @@ int usb_get_driver_np(usb_dev_handle *dev, int interface, char *name, unsigned i
       name[namelen - 1] = '\0';
    }
 
-   pkt_release();
+   session_release();
    debug_msg("returned %d (%s)", res, name);
    return res;
 }
@@ -908,17 +2412,17 @@ int usb_detach_kernel_driver_np(usb_dev_handle *dev, int interface)
    pkt_init(pkt, UsbDetachKernelDriver);
    pkt_addint(pkt, dev->fd);
    pkt_addint(pkt, interface);
-   pkt_send(pkt, fd);
+   session_send(pkt, fd);
 
    // Get response
    int res = -1;
-   if(pkt_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbDetachKernelDriver) {
+   if(session_recv(fd, pkt) > 0 && pkt_op(pkt) == UsbDetachKernelDriver) {
       Iterator it;
       pkt_begin(pkt, &it);
       res = iter_getint(&it);
    }
 
-   pkt_release();
+   session_release();
    debug_msg("returned %d", res);
    return res;
 }
@@ -995,52 +2499,4 @@ int usb_get_string_simple(usb_dev_handle *dev, int index, char *buf, size_t bufl
   return di;
 }
 
-#ifdef MISSING_USB_DESTROY_CONFIGURATION 
-/** \private
-  *  Imported from libusb-0.1.12 private interface as helper function.
-  */
-static void usb_destroy_configuration(struct usb_device *dev)
-{
-  int c, i, j, k;
-
-  if (!dev->config)
-    return;
-
-  for (c = 0; c < dev->descriptor.bNumConfigurations; c++) {
-    struct usb_config_descriptor *cf = &dev->config[c];
-
-    if (!cf->interface)
-      continue;
-
-    for (i = 0; i < cf->bNumInterfaces; i++) {
-      struct usb_interface *ifp = &cf->interface[i];
-
-      if (!ifp->altsetting)
-        continue;
-
-      for (j = 0; j < ifp->num_altsetting; j++) {
-        struct usb_interface_descriptor *as = &ifp->altsetting[j];
-
-        if (as->extra)
-          free(as->extra);
-
-        if (!as->endpoint)
-          continue;
-
-        for (k = 0; k < as->bNumEndpoints; k++) {
-          if (as->endpoint[k].extra)
-            free(as->endpoint[k].extra);
-        }
-        free(as->endpoint);
-      }
-
-      free(ifp->altsetting);
-    }
-
-    free(cf->interface);
-  }
-
-  free(dev->config);
-}
-#endif
 /** @} */
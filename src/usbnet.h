@@ -52,10 +52,37 @@ typedef enum {
    UsbClearHalt          = CallType  + 17, // int usb_clear_halt()
    UsbReset              = CallType  + 18, // int usb_reset()
    UsbInterruptRead      = CallType  + 19, // int usb_interrupt_read()
-   UsbInterruptWrite     = CallType  + 20  // int usb_interrupt_write()
+   UsbInterruptWrite     = CallType  + 20, // int usb_interrupt_write()
+   UsbStreamOpen         = CallType  + 21, // start/update bulk IN read-ahead
+   UsbStreamData         = CallType  + 22, // read-ahead result (server push)
+   UsbStreamCredit       = CallType  + 23, // return read-ahead credits
+   UsbStreamClose        = CallType  + 24, // stop bulk IN read-ahead
+   UsbBulkWriteAsync     = CallType  + 25, // write-behind usb_bulk_write()
+   UsbWriteAck           = CallType  + 26, // cumulative write-behind ack (server push)
+   UsbControlBatch       = CallType  + 27, // int usbnet_control_batch()
+   UsbDataChunk          = CallType  + 28, // chunked usb_bulk_write()
+   UsbStats              = CallType  + 29  // server metrics (usbnet --stats)
 
 } Call;
 
+/** Return opcode name. */
+static inline const char* call_name(int op) {
+   static const char* names[] = {
+      "NullRequest", "UsbInit", "UsbFindBusses", "UsbFindDevices", "UsbGetBusses",
+      "UsbOpen", "UsbClose", "UsbControlMsg", "UsbClaimInterface", "UsbReleaseInterface",
+      "UsbGetKernelDriver", "UsbDetachKernelDriver", "UsbBulkRead", "UsbBulkWrite",
+      "UsbSetConfiguration", "UsbSetAltInterface", "UsbResetEp", "UsbClearHalt", "UsbReset",
+      "UsbInterruptRead", "UsbInterruptWrite", "UsbStreamOpen", "UsbStreamData",
+      "UsbStreamCredit", "UsbStreamClose", "UsbBulkWriteAsync", "UsbWriteAck",
+      "UsbControlBatch", "UsbDataChunk", "UsbStats"
+   };
+
+   unsigned idx = op - CallType;
+   if(idx < sizeof(names) / sizeof(names[0]))
+      return names[idx];
+   return "Unknown";
+}
+
 /** \private
     @from: libusb/usbi.h:41
     \warning Matches libusb-0.1.12, may loss binary compatibility.
@@ -74,5 +101,97 @@ struct usb_dev_handle {
    void *impl_info;
 };
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* libusbnet extensions.
+ */
+
+/** Server read timeout for subscribed streams (ms). */
+#define USBNET_STREAM_TIMEOUT 1000
+
+/** Subscribe to bulk IN endpoint.
+  * Server reads the endpoint continuously and pushes the results,
+  * at most \c depth chunks are in flight or queued locally.
+  * \param dev open device
+  * \param ep IN endpoint address
+  * \param chunk read size in bytes
+  * \param depth read-ahead window (1 - 64)
+  * \return 0 on success, negative errno on error
+  */
+int usbnet_stream_open(usb_dev_handle *dev, int ep, int chunk, int depth);
+
+/** Read next chunk from subscribed endpoint.
+  * Chunk larger than \c size is consumed by subsequent reads.
+  * \return bytes read or negative errno, -ETIMEDOUT if endpoint was idle
+  *         for USBNET_STREAM_TIMEOUT, stream is closed on other errors
+  */
+int usbnet_stream_read(usb_dev_handle *dev, int ep, char *bytes, int size);
+
+/** Unsubscribe from endpoint, unread chunks are dropped.
+  * \return 0 on success, negative errno on error
+  */
+int usbnet_stream_close(usb_dev_handle *dev, int ep);
+
+/** Enable write-behind on bulk OUT endpoint.
+  * usb_bulk_write() returns once the write is queued, at most \c window
+  * writes are unacknowledged. First failure is returned by the next
+  * usb_bulk_write(), usbnet_write_flush() or usb_close(), writes queued
+  * behind the failed one are dropped.
+  * \param window unacknowledged writes limit, 0 flushes and disables
+  * \return 0 on success, negative errno (unreported failure) on error
+  */
+int usbnet_write_behind(usb_dev_handle *dev, int ep, int window);
+
+/** Wait until all queued writes are acknowledged.
+  * \return 0 on success, negative errno of first unreported failure
+  */
+int usbnet_write_flush(usb_dev_handle *dev, int ep);
+
+/** Return descriptor cache counters.
+  * Standard GET_DESCRIPTOR reads are cached per device unless USBNET_CACHE=0,
+  * cache is invalidated on reset, configuration change and re-enumeration.
+  */
+void usbnet_cache_stats(unsigned long *hits, unsigned long *misses);
+
+/** Return virtual bus tree memory.
+  * Each usb_find_devices() builds a new tree generation, replaced
+  * generations are kept until their last open handle is closed.
+  * \param generation current generation number, 0 before enumeration
+  * \param bytes memory of current generation
+  * \param retained memory of replaced generations still referenced
+  */
+void usbnet_bus_stats(unsigned *generation, unsigned long *bytes, unsigned long *retained);
+
+/** Control transfer in a batch. */
+typedef struct usbnet_control {
+   int requesttype;  //! bmRequestType, direction selects data stage
+   int request;      //! bRequest
+   int value;        //! wValue
+   int index;        //! wIndex
+   char *bytes;      //! Data stage buffer
+   int size;         //! Data stage length
+   int timeout;      //! Timeout (ms)
+   int result;       //! usb_control_msg() result, set by usbnet_control_batch()
+} usbnet_control_t;
+
+/** Maximum transfers in a batch. */
+#define USBNET_BATCH_MAX 1024
+
+/** Execute control transfers in order in a single round-trip.
+  * Execution stops at first failed transfer, results of executed
+  * transfers are stored in \c result and IN data in \c bytes,
+  * \c result of transfers not executed is set to -ECANCELED.
+  * \return number of successful transfers, negative errno on error,
+  *         -EINVAL if count exceeds USBNET_BATCH_MAX
+  */
+int usbnet_control_batch(usb_dev_handle *dev, usbnet_control_t *ctl, int count);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // __usbnet_h__
 /** @} */